@@ -0,0 +1,494 @@
+#include "chip8.hpp"
+#include "delta.hpp"
+#include "jit.hpp"
+#include "lockstep.hpp"
+#include "machine_pool.hpp"
+#include "rom.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+Microbenchmarks for the emulator core. Each benchmark runs its body with a
+growing iteration count until it takes at least --min-time seconds, then
+reports time per iteration. Results are printed as JSON in the layout Google
+Benchmark uses, so existing tooling can diff them release over release.
+
+Opcodes are measured through the synthetic ROMs below rather than by calling
+handlers directly: a ROM that is one instruction repeated, closed by a jump,
+times that instruction on the same path a real program takes.
+*/
+
+namespace
+{
+typedef std::vector<uint16_t> Program;
+
+// Whole-ROM benchmarks run a 60 Hz frame per iteration at this speed.
+const uint64_t FRAME_INSTRUCTIONS = 1000;
+// Machines per Lockstep benchmark.
+const size_t LOCKSTEP_LANES = 1024;
+
+// Append count copies of opcode, then jump back to loopStart.
+Program Repeat(Program program, uint16_t opcode, unsigned int count,
+               uint16_t loopStart)
+{
+    program.insert(program.end(), count, opcode);
+    program.push_back(0x1000 | loopStart);
+    return program;
+}
+
+std::vector<uint8_t> Assemble(const Program& program)
+{
+    std::vector<uint8_t> bytes;
+    for (uint16_t opcode : program)
+    {
+        bytes.push_back(opcode >> 8u);
+        bytes.push_back(opcode & 0xFFu);
+    }
+    return bytes;
+}
+
+struct SyntheticRom
+{
+    std::string name;
+    std::vector<uint8_t> bytes;
+};
+
+std::vector<SyntheticRom> SyntheticRoms()
+{
+    std::vector<SyntheticRom> roms;
+
+    // Register arithmetic only: loads, adds, logic, shifts. V3 counts
+    // iterations so no two in a row match and the loop never looks idle.
+    roms.push_back({"alu", Assemble({0x6005, 0x6103, 0x8014, 0x8115, 0x8022,
+                                     0x7001, 0x8106, 0x810E, 0x8013, 0x8011,
+                                     0x8230, 0x7207, 0x7301, 0x1200})});
+
+    // Polling the delay timer until it runs out, then setting it again;
+    // the interpreter skips the spinning once it sees it.
+    roms.push_back(
+        {"poll", Assemble({0x6078, 0xF015, 0xF107, 0x3100, 0x1204, 0x1200})});
+
+    // Sprites of every height at an unaligned x, with I on the font.
+    for (unsigned int height : {1u, 5u, 15u})
+    {
+        roms.push_back(
+            {"draw_h" + std::to_string(height),
+             Assemble(Repeat({0x600D, 0x6103, 0xA050}, 0xD010 | height, 60,
+                             0x206))});
+    }
+
+    roms.push_back({"clear", Assemble(Repeat({}, 0x00E0, 64, 0x200))});
+    // I is kept clear of the code so stores never invalidate it.
+    roms.push_back({"store", Assemble(Repeat({0xA800}, 0xFF55, 64, 0x202))});
+    roms.push_back({"load", Assemble(Repeat({0xA800}, 0xFF65, 64, 0x202))});
+
+    // A game-shaped loop: tile the screen with font glyphs, then do the
+    // per-frame bookkeeping a game does (random, keys, timers, BCD).
+    roms.push_back({"game", Assemble({
+                                0xA050, // 200 LD I, font
+                                0x6A00, // 202 LD VA, 0
+                                0x6B00, // 204 LD VB, 0
+                                0xDAB5, // 206 DRW VA, VB, 5
+                                0x7A05, // 208 ADD VA, 5
+                                0x3A3C, // 20A SE VA, 60
+                                0x1206, // 20C JP 206
+                                0x6A00, // 20E LD VA, 0
+                                0x7B06, // 210 ADD VB, 6
+                                0x3B1E, // 212 SE VB, 30
+                                0x1206, // 214 JP 206
+                                0xC30F, // 216 RND V3, 0F
+                                0xF329, // 218 LD F, V3
+                                0xE3A1, // 21A SKNP V3
+                                0x00E0, // 21C CLS
+                                0x6410, // 21E LD V4, 10
+                                0xF415, // 220 LD DT, V4
+                                0xF507, // 222 LD V5, DT
+                                0xA800, // 224 LD I, 800
+                                0xF533, // 226 LD B, V5
+                                0x2230, // 228 CALL 230
+                                0x1200, // 22A JP 200
+                                0x0000, // 22C
+                                0x0000, // 22E
+                                0x8454, // 230 ADD V4, V5
+                                0x00EE, // 232 RET
+                            })});
+    return roms;
+}
+
+const SyntheticRom& FindRom(const std::vector<SyntheticRom>& roms,
+                            const std::string& name)
+{
+    return *std::find_if(roms.begin(), roms.end(),
+                         [&](const SyntheticRom& rom) {
+                             return rom.name == name;
+                         });
+}
+
+// The bundled ROMs are written out once so loading from a file is timed too.
+std::string WriteRom(const SyntheticRom& rom)
+{
+    std::filesystem::path path = std::filesystem::temp_directory_path() /
+                                 ("chip8_bench_" + rom.name + ".ch8");
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(rom.bytes.data()),
+               rom.bytes.size());
+    return path.string();
+}
+
+// Run instructions through Run(), whose cycle count is 32 bits.
+void RunFor(Chip8& chip8, uint64_t instructions)
+{
+    while (instructions > 0)
+    {
+        uint32_t slice = std::min<uint64_t>(instructions, UINT32_MAX);
+        chip8.Run(slice);
+        instructions -= slice;
+    }
+}
+
+struct Result
+{
+    std::string name;
+    uint64_t iterations;
+    double realNs; // per iteration
+    double cpuNs;
+    double itemsPerSecond;
+};
+
+class Suite
+{
+public:
+    Suite(double minTime, std::string filter)
+        : minTime(minTime), filter(std::move(filter))
+    {
+    }
+
+    /*
+    Body runs the benchmarked operation the given number of times on state
+    it keeps between calls, and returns the number of items processed for
+    the items_per_second figure (usually instructions).
+    */
+    void Add(const std::string& name,
+             const std::function<uint64_t(uint64_t)>& body)
+    {
+        if (name.find(filter) == std::string::npos)
+        {
+            return;
+        }
+
+        uint64_t iterations = 1;
+        while (true)
+        {
+            auto realStart = std::chrono::steady_clock::now();
+            std::clock_t cpuStart = std::clock();
+            uint64_t items = body(iterations);
+            double cpu = static_cast<double>(std::clock() - cpuStart) /
+                         CLOCKS_PER_SEC;
+            double real = std::chrono::duration<double>(
+                              std::chrono::steady_clock::now() - realStart)
+                              .count();
+
+            if (real >= minTime || iterations >= 1000000000000ull)
+            {
+                Result result = {name, iterations, real * 1e9 / iterations,
+                                 cpu * 1e9 / iterations, items / real};
+                std::fprintf(stderr, "%-28s %12.2f ns %14.0f items/s\n",
+                             name.c_str(), result.realNs,
+                             result.itemsPerSecond);
+                results.push_back(result);
+                return;
+            }
+            // Aim past minTime, growing at most 100x per round
+            double scale = real > 0 ? minTime * 1.4 / real : 100.0;
+            iterations = static_cast<uint64_t>(
+                iterations * std::max(2.0, std::min(100.0, scale)));
+        }
+    }
+
+    void WriteJson(std::ostream& out) const
+    {
+        char date[32];
+        std::time_t now = std::time(nullptr);
+        std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S",
+                      std::localtime(&now));
+
+        out << "{\n  \"context\": {\n"
+            << "    \"date\": \"" << date << "\",\n"
+            << "    \"executable\": \"chip8_bench\",\n"
+            << "    \"jit\": " << (Jit::Available() ? "true" : "false")
+            << "\n  },\n  \"benchmarks\": [";
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            const Result& r = results[i];
+            out << (i ? ",\n" : "\n") << "    {\n"
+                << "      \"name\": \"" << r.name << "\",\n"
+                << "      \"iterations\": " << r.iterations << ",\n"
+                << "      \"real_time\": " << r.realNs << ",\n"
+                << "      \"cpu_time\": " << r.cpuNs << ",\n"
+                << "      \"time_unit\": \"ns\",\n"
+                << "      \"items_per_second\": " << r.itemsPerSecond
+                << "\n    }";
+        }
+        out << "\n  ]\n}\n";
+    }
+
+private:
+    double minTime;
+    std::string filter;
+    std::vector<Result> results;
+};
+
+std::shared_ptr<Chip8> Machine(const std::string& romPath)
+{
+    std::shared_ptr<Chip8> chip8 = std::make_shared<Chip8>(1);
+    chip8->LoadROM(romPath.c_str());
+    return chip8;
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    double minTime = 0.5;
+    std::string filter;
+    const char* outFileName = nullptr;
+    for (int i = 1; i < argc; ++i)
+    {
+        bool hasValue = i + 1 < argc;
+        if (std::strcmp(argv[i], "--min-time") == 0 && hasValue)
+        {
+            minTime = std::stod(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--filter") == 0 && hasValue)
+        {
+            filter = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "--out") == 0 && hasValue)
+        {
+            outFileName = argv[++i];
+        }
+        else
+        {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--min-time SECONDS] [--filter SUBSTRING]"
+                         " [--out FILE]\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::vector<SyntheticRom> roms = SyntheticRoms();
+    std::vector<std::string> paths;
+    for (const SyntheticRom& rom : roms)
+    {
+        paths.push_back(WriteRom(rom));
+    }
+    auto pathOf = [&](const std::string& name) {
+        return paths[&FindRom(roms, name) - roms.data()];
+    };
+
+    Suite suite(minTime, filter);
+
+    // Fetch, decode and dispatch one instruction at a time.
+    {
+        std::shared_ptr<Chip8> chip8 = Machine(pathOf("alu"));
+        suite.Add("Cycle/alu", [chip8](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i)
+            {
+                chip8->Cycle();
+            }
+            return n;
+        });
+    }
+
+    // One instruction per iteration through the block cache.
+    const char* opcodeRoms[][2] = {
+        {"OP_Dxyn/1", "draw_h1"}, {"OP_Dxyn/5", "draw_h5"},
+        {"OP_Dxyn/15", "draw_h15"}, {"OP_00E0", "clear"},
+        {"OP_Fx55", "store"},       {"OP_Fx65", "load"},
+    };
+    for (auto& entry : opcodeRoms)
+    {
+        std::shared_ptr<Chip8> chip8 = Machine(pathOf(entry[1]));
+        suite.Add(entry[0], [chip8](uint64_t n) {
+            RunFor(*chip8, n);
+            return n;
+        });
+    }
+
+    // From a file each time, from a span, and from one shared image
+    {
+        std::string path = pathOf("game");
+        suite.Add("LoadROM/file", [path](uint64_t n) {
+            Chip8 chip8(1);
+            for (uint64_t j = 0; j < n; ++j)
+            {
+                chip8.LoadROM(path.c_str());
+            }
+            return n;
+        });
+
+        const std::vector<uint8_t>* bytes = &FindRom(roms, "game").bytes;
+        suite.Add("LoadROM/span", [bytes](uint64_t n) {
+            Chip8 chip8(1);
+            for (uint64_t j = 0; j < n; ++j)
+            {
+                chip8.LoadROM(bytes->data(), bytes->size());
+            }
+            return n;
+        });
+
+        std::shared_ptr<RomCache> cache = std::make_shared<RomCache>();
+        suite.Add("LoadROM/cached", [cache, path](uint64_t n) {
+            Chip8 chip8(1);
+            for (uint64_t j = 0; j < n; ++j)
+            {
+                chip8.LoadROM(cache->Get(path));
+            }
+            return n;
+        });
+    }
+
+    // Getting a machine ready for the next run: a new instance, a Reset()
+    // of one that ran without writing memory, and a pool round trip
+    {
+        std::shared_ptr<RomCache> cache = std::make_shared<RomCache>();
+        std::shared_ptr<const RomImage> rom = cache->Get(pathOf("game"));
+        suite.Add("Turnover/construct", [rom](uint64_t n) {
+            for (uint64_t j = 0; j < n; ++j)
+            {
+                std::unique_ptr<Chip8> chip8(new Chip8(j));
+                chip8->LoadROM(rom);
+            }
+            return n;
+        });
+
+        std::shared_ptr<Chip8> chip8 = Machine(pathOf("game"));
+        suite.Add("Turnover/reset", [chip8](uint64_t n) {
+            for (uint64_t j = 0; j < n; ++j)
+            {
+                chip8->Reset(j);
+            }
+            return n;
+        });
+
+        std::shared_ptr<MachinePool> pool =
+            std::make_shared<MachinePool>(rom, 4);
+        suite.Add("Turnover/pool", [pool](uint64_t n) {
+            for (uint64_t j = 0; j < n; ++j)
+            {
+                pool->Release(pool->Acquire(j));
+            }
+            return n;
+        });
+    }
+
+    // Frame deltas of the game ROM drawing a little at a time, cycled
+    // through; items_per_second is frames per second.
+    {
+        std::shared_ptr<Chip8> chip8 = Machine(pathOf("game"));
+        auto frames = std::make_shared<std::vector<uint64_t>>();
+        for (unsigned int f = 0; f < 240; ++f)
+        {
+            chip8->Run(20);
+            chip8->TickTimers();
+            frames->insert(frames->end(), std::begin(chip8->video),
+                           std::end(chip8->video));
+        }
+        size_t count = frames->size() / VIDEO_HEIGHT;
+
+        auto encoder = std::make_shared<DeltaEncoder>();
+        auto packets = std::make_shared<std::vector<uint8_t>>();
+        suite.Add("Delta/encode", [=](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i)
+            {
+                packets->clear();
+                encoder->Encode(&(*frames)[i % count * VIDEO_HEIGHT],
+                                *packets);
+            }
+            return n;
+        });
+
+        auto stream = std::make_shared<std::vector<uint8_t>>();
+        DeltaEncoder streamEncoder;
+        for (size_t f = 0; f < count; ++f)
+        {
+            streamEncoder.Encode(&(*frames)[f * VIDEO_HEIGHT], *stream);
+        }
+        suite.Add("Delta/decode", [stream, count](uint64_t n) {
+            DeltaDecoder decoder;
+            size_t at = 0;
+            for (uint64_t i = 0; i < n; ++i)
+            {
+                size_t used = 0;
+                if (i % count == 0)
+                {
+                    at = 0;
+                }
+                decoder.Decode(stream->data() + at, stream->size() - at, used);
+                at += used;
+            }
+            return n;
+        });
+    }
+
+    // Whole-ROM throughput; items_per_second is instructions per second.
+    for (std::string name : {"alu", "game", "poll"})
+    {
+        std::shared_ptr<Chip8> chip8 = Machine(pathOf(name));
+        suite.Add("Run/" + name, [chip8](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i)
+            {
+                chip8->Run(FRAME_INSTRUCTIONS);
+                chip8->TickTimers();
+            }
+            return n * FRAME_INSTRUCTIONS;
+        });
+
+        if (Jit::Available())
+        {
+            std::shared_ptr<Chip8> jitMachine = Machine(pathOf(name));
+            std::shared_ptr<Jit> jit = std::make_shared<Jit>(*jitMachine);
+            suite.Add("Jit/" + name, [jitMachine, jit](uint64_t n) {
+                for (uint64_t i = 0; i < n; ++i)
+                {
+                    jit->Run(FRAME_INSTRUCTIONS);
+                    jitMachine->TickTimers();
+                }
+                return n * FRAME_INSTRUCTIONS;
+            });
+        }
+
+        // Every lane counts, so this is aggregate instructions per second
+        std::shared_ptr<Lockstep> lockstep = std::make_shared<Lockstep>(
+            std::vector<uint32_t>(LOCKSTEP_LANES, 1));
+        lockstep->LoadROM(RomImage::ReadFile(pathOf(name).c_str()));
+        suite.Add("Lockstep/" + name, [lockstep](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i)
+            {
+                lockstep->Run(FRAME_INSTRUCTIONS);
+                lockstep->TickTimers();
+            }
+            return n * FRAME_INSTRUCTIONS * LOCKSTEP_LANES;
+        });
+    }
+
+    if (outFileName)
+    {
+        std::ofstream out(outFileName);
+        suite.WriteJson(out);
+    }
+    else
+    {
+        suite.WriteJson(std::cout);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,549 @@
+#include "chip8.hpp"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+/*
+Fuzzing harness for the emulator core. Each input is a ROM plus a keypad
+script:
+
+  u8      instructions per frame - 1 in the low four bits, quirk profile
+          (modulo the number of profiles) in bits 4-6
+  u8      event count, at most MAX_EVENTS used
+  events  {u8 frame, u8 key in the low nibble and down in bit 7}
+  rest    the ROM, loaded at 0x200
+
+The input runs for FRAMES frames twice, on two long-lived machines put back
+in their starting state with Reset(): once single-stepped through Cycle(),
+recording the guest pc, pc-to-pc edges and opcode classes it executes, and
+once through the block cache with Run(). Sanitizers catch memory errors in
+either; any difference between the two final states aborts as well.
+
+Built with Clang, LLVMFuzzerTestOneInput() is a libFuzzer target and the
+guest coverage is handed to libFuzzer as extra counters next to its own. The
+standalone driver below runs without libFuzzer: it mutates a corpus itself,
+keeping inputs that reach new guest coverage.
+*/
+
+namespace
+{
+const uint32_t FRAMES = 16;
+const size_t MAX_EVENTS = 32;
+const size_t EDGE_COUNTERS = 4096;
+
+#ifdef CHIP8_LIBFUZZER
+#define COVERAGE_COUNTERS __attribute__((section("__libfuzzer_extra_counters")))
+#else
+#define COVERAGE_COUNTERS
+#endif
+
+COVERAGE_COUNTERS uint8_t pcCounters[MEMORY_SIZE];
+COVERAGE_COUNTERS uint8_t edgeCounters[EDGE_COUNTERS];
+COVERAGE_COUNTERS uint8_t opCounters[Chip8::OP_CLASS_COUNT];
+
+inline void Hit(uint8_t& counter)
+{
+    counter += counter != 0xFF;
+}
+
+struct Harness
+{
+    Harness() : stepped(1), blocked(1) {}
+
+    Chip8 stepped;
+    Chip8 blocked;
+    std::vector<uint8_t> left;
+    std::vector<uint8_t> right;
+};
+
+int RunInput(const uint8_t* data, size_t size)
+{
+    static Harness h;
+    if (size < 2)
+    {
+        return 0;
+    }
+    uint32_t instructionsPerFrame = (data[0] & 0x0Fu) + 1;
+    unsigned int profile = ((data[0] >> 4u) & 0x7u) % QUIRK_PROFILE_COUNT;
+    QuirkProfile quirks = static_cast<QuirkProfile>(profile);
+    size_t events = std::min<size_t>(data[1], MAX_EVENTS);
+    size_t header = 2 + 2 * events;
+    if (size <= header)
+    {
+        return 0;
+    }
+    const uint8_t* script = data + 2;
+
+    h.stepped.Reset(1);
+    h.blocked.Reset(1);
+    h.stepped.SetQuirks(quirks);
+    h.blocked.SetQuirks(quirks);
+    if (!h.stepped.LoadROM(data + header, size - header))
+    {
+        return 0;
+    }
+    h.blocked.LoadROM(data + header, size - header);
+
+    uint16_t previous = START_ADDRESS;
+    size_t next = 0;
+    for (uint32_t frame = 0; frame < FRAMES; ++frame)
+    {
+        for (; next < events && script[2 * next] <= frame; ++next)
+        {
+            uint8_t key = script[2 * next + 1] & 0xFu;
+            uint8_t down = script[2 * next + 1] >> 7u;
+            h.stepped.keypad[key] = down;
+            h.blocked.keypad[key] = down;
+        }
+        for (uint32_t i = 0; i < instructionsPerFrame; ++i)
+        {
+            uint16_t pc = h.stepped.ProgramCounter() & ADDRESS_MASK;
+            Hit(pcCounters[pc]);
+            Hit(edgeCounters[(previous * 31u ^ pc) % EDGE_COUNTERS]);
+            Hit(opCounters[Chip8::OpClass(h.stepped.OpcodeAt(pc), quirks)]);
+            previous = pc;
+            h.stepped.Cycle();
+        }
+        h.blocked.Run(instructionsPerFrame);
+        h.stepped.TickTimers();
+        h.blocked.TickTimers();
+    }
+
+    h.left.clear();
+    h.right.clear();
+    h.stepped.SaveState(h.left);
+    h.blocked.SaveState(h.right);
+    if (h.left != h.right)
+    {
+        std::fprintf(stderr, "Cycle() and Run() diverged\n");
+        std::abort();
+    }
+    return 0;
+}
+} // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    return RunInput(data, size);
+}
+
+#ifndef CHIP8_LIBFUZZER
+
+namespace
+{
+typedef std::vector<uint8_t> Input;
+
+// The input running now, written out if a sanitizer or divergence kills us.
+const Input* current = nullptr;
+
+void SaveCrash(int signal)
+{
+    if (current)
+    {
+        if (FILE* out = std::fopen("crash-input", "wb"))
+        {
+            std::fwrite(current->data(), 1, current->size(), out);
+            std::fclose(out);
+            std::fputs("Input written to crash-input\n", stderr);
+        }
+    }
+    std::signal(signal, SIG_DFL);
+    std::raise(signal);
+}
+} // namespace
+
+// Sanitizer errors end in abort() rather than _exit(), so SaveCrash() runs.
+extern "C" const char* __asan_default_options()
+{
+    return "abort_on_error=1";
+}
+
+extern "C" const char* __ubsan_default_options()
+{
+    return "abort_on_error=1:print_stacktrace=1";
+}
+
+namespace
+{
+bool ReadFile(const std::filesystem::path& path, Input& input)
+{
+    std::ifstream in(path, std::ios::binary);
+    input.assign(std::istreambuf_iterator<char>(in),
+                 std::istreambuf_iterator<char>());
+    return in.good() || in.eof();
+}
+
+/*
+Coverage seen so far, with each counter bucketed by magnitude the way
+AFL does (1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+), so running a loop more
+often counts as new behaviour but every extra iteration does not.
+*/
+class CoverageMap
+{
+public:
+    // Fold in the counters of the last run and clear them; true if any
+    // counter reached a bucket it had not before.
+    bool Merge()
+    {
+        bool fresh = Merge(pcCounters, pcSeen, sizeof(pcCounters));
+        fresh = Merge(edgeCounters, edgeSeen, sizeof(edgeCounters)) || fresh;
+        fresh = Merge(opCounters, opSeen, sizeof(opCounters)) || fresh;
+        return fresh;
+    }
+
+    size_t Pcs() const { return Count(pcSeen, sizeof(pcSeen)); }
+    size_t Edges() const { return Count(edgeSeen, sizeof(edgeSeen)); }
+    size_t Ops() const { return Count(opSeen, sizeof(opSeen)); }
+
+private:
+    static bool Merge(uint8_t* counters, uint8_t* seen, size_t size)
+    {
+        static const std::array<uint8_t, 256> BUCKET = []
+        {
+            std::array<uint8_t, 256> b{};
+            for (unsigned int n = 1; n < 256; ++n)
+            {
+                b[n] = n <= 3 ? 1u << (n - 1) : n < 8 ? 0x08 : n < 16 ? 0x10
+                     : n < 32 ? 0x20 : n < 128 ? 0x40 : 0x80;
+            }
+            return b;
+        }();
+
+        bool fresh = false;
+        for (size_t i = 0; i < size; i += 8)
+        {
+            // Most counters stay zero; skip them eight at a time
+            size_t end = std::min(i + 8, size);
+            uint64_t word = 0;
+            std::memcpy(&word, &counters[i], end - i);
+            if (!word)
+            {
+                continue;
+            }
+            for (size_t j = i; j < end; ++j)
+            {
+                uint8_t bucket = BUCKET[counters[j]];
+                fresh = fresh || (seen[j] | bucket) != seen[j];
+                seen[j] |= bucket;
+                counters[j] = 0;
+            }
+        }
+        return fresh;
+    }
+
+    static size_t Count(const uint8_t* seen, size_t size)
+    {
+        return std::count_if(seen, seen + size, [](uint8_t s) { return s; });
+    }
+
+    uint8_t pcSeen[MEMORY_SIZE]{};
+    uint8_t edgeSeen[EDGE_COUNTERS]{};
+    uint8_t opSeen[Chip8::OP_CLASS_COUNT]{};
+};
+
+/*
+Byte-level mutations plus two that know the layout: replacing a ROM word
+with an opcode of a random family, which reaches far more handlers than
+random bytes do, and rewriting the keypad script.
+*/
+class Mutator
+{
+public:
+    Mutator(uint32_t seed, size_t maxLength) : rng(seed), maxLength(maxLength)
+    {
+    }
+
+    void Mutate(Input& input, const std::vector<Input>& corpus)
+    {
+        unsigned int count = 1 + Below(4);
+        for (unsigned int i = 0; i < count; ++i)
+        {
+            MutateOnce(input, corpus);
+        }
+        if (input.size() > maxLength)
+        {
+            input.resize(maxLength);
+        }
+    }
+
+private:
+    uint32_t Below(uint32_t n) { return n ? rng() % n : 0; }
+
+    size_t RomStart(const Input& input) const
+    {
+        size_t events = input.size() > 1
+                            ? std::min<size_t>(input[1], MAX_EVENTS)
+                            : 0;
+        return std::min(input.size(), 2 + 2 * events);
+    }
+
+    void MutateOnce(Input& input, const std::vector<Input>& corpus)
+    {
+        if (input.size() < 4)
+        {
+            input.resize(4);
+        }
+        size_t at = Below(input.size());
+        switch (Below(8))
+        {
+            case 0:
+                input[at] ^= 1u << Below(8);
+                break;
+            case 1:
+                input[at] = static_cast<uint8_t>(rng());
+                break;
+            case 2:
+            {
+                // A whole opcode on a word boundary of the ROM
+                size_t rom = RomStart(input);
+                size_t word = rom + 2 * Below((input.size() - rom) / 2 + 1);
+                uint16_t opcode = static_cast<uint16_t>(rng());
+                if (word + 1 >= input.size())
+                {
+                    input.resize(word + 2);
+                }
+                input[word] = opcode >> 8u;
+                input[word + 1] = opcode & 0xFFu;
+                break;
+            }
+            case 3:
+            {
+                uint16_t opcode = static_cast<uint16_t>(rng());
+                size_t rom = RomStart(input);
+                size_t word = rom + 2 * Below((input.size() - rom) / 2 + 1);
+                uint8_t bytes[2] = {static_cast<uint8_t>(opcode >> 8u),
+                                    static_cast<uint8_t>(opcode & 0xFFu)};
+                input.insert(input.begin() + std::min(word, input.size()),
+                             bytes, bytes + 2);
+                break;
+            }
+            case 4:
+            {
+                size_t length = 1 + Below(std::min<size_t>(16, input.size()));
+                size_t from = Below(input.size() - length + 1);
+                input.erase(input.begin() + from,
+                            input.begin() + from + length);
+                break;
+            }
+            case 5:
+            {
+                // Copy a chunk of the input over another part of it
+                size_t length = 1 + Below(std::min<size_t>(32, input.size()));
+                size_t from = Below(input.size() - length + 1);
+                size_t to = Below(input.size() - length + 1);
+                std::memmove(&input[to], &input[from], length);
+                break;
+            }
+            case 6:
+            {
+                // Splice the tail of another corpus entry on
+                const Input& other = corpus[Below(corpus.size())];
+                size_t from = Below(other.size());
+                input.resize(at);
+                input.insert(input.end(), other.begin() + from, other.end());
+                break;
+            }
+            default:
+            {
+                // New keypad script
+                uint8_t events = Below(8);
+                size_t old = RomStart(input) - 2;
+                Input script(2 * events);
+                for (size_t i = 0; i < script.size(); i += 2)
+                {
+                    script[i] = Below(FRAMES);
+                    script[i + 1] = (Below(2) << 7u) | Below(16);
+                }
+                std::sort(script.begin(), script.end()); // roughly by frame
+                input.erase(input.begin() + 2, input.begin() + 2 + old);
+                input.insert(input.begin() + 2, script.begin(), script.end());
+                input[1] = events;
+                break;
+            }
+        }
+        if (input.size() < 2)
+        {
+            input.resize(2);
+        }
+    }
+
+    std::mt19937 rng;
+    size_t maxLength;
+};
+
+// A few programs to start from when no corpus is given.
+std::vector<Input> BuiltinSeeds()
+{
+    std::vector<std::vector<uint16_t>> programs = {
+        {0x00E0, 0xA050, 0x6000, 0x6100, 0xD015, 0x7008, 0x1208},
+        {0x6005, 0xF015, 0xF007, 0x3000, 0x1204, 0x1200},
+        {0xF00A, 0xE09E, 0x1200, 0x2208, 0x1200, 0x00EE},
+        {0xA300, 0x600F, 0xF033, 0xF055, 0xF065, 0xF01E, 0x1204},
+    };
+    std::vector<Input> seeds;
+    for (const std::vector<uint16_t>& program : programs)
+    {
+        Input input = {9, 0};
+        for (uint16_t opcode : program)
+        {
+            input.push_back(opcode >> 8u);
+            input.push_back(opcode & 0xFFu);
+        }
+        seeds.push_back(input);
+    }
+    return seeds;
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    uint64_t runs = 0;
+    bool fuzz = false;
+    uint32_t seed = 1;
+    size_t maxLength = 512;
+    std::string corpusDir;
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--runs" && hasValue)
+        {
+            runs = std::stoull(argv[++i]);
+            fuzz = true;
+        }
+        else if (arg == "--seed" && hasValue)
+        {
+            seed = std::stoul(argv[++i]);
+        }
+        else if (arg == "--max-len" && hasValue)
+        {
+            maxLength = std::stoul(argv[++i]);
+        }
+        else if (arg == "--corpus" && hasValue)
+        {
+            corpusDir = argv[++i];
+            fuzz = true;
+        }
+        else if (arg.compare(0, 2, "--") == 0)
+        {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--runs N] [--seed N] [--max-len N]"
+                         " [--corpus DIR] [FILE|DIR]...\n";
+            return EXIT_FAILURE;
+        }
+        else
+        {
+            paths.push_back(arg);
+        }
+    }
+    if (!corpusDir.empty())
+    {
+        paths.push_back(corpusDir);
+        std::filesystem::create_directories(corpusDir);
+    }
+
+    std::signal(SIGABRT, SaveCrash);
+
+    // Every given file, and every file in a given directory, runs once;
+    // without --runs or --corpus that is all, to reproduce a crash
+    std::vector<Input> corpus;
+    for (const std::string& path : paths)
+    {
+        std::vector<std::filesystem::path> files;
+        if (std::filesystem::is_directory(path))
+        {
+            for (const auto& entry : std::filesystem::directory_iterator(path))
+            {
+                files.push_back(entry.path());
+            }
+            std::sort(files.begin(), files.end());
+        }
+        else
+        {
+            files.push_back(path);
+        }
+        for (const std::filesystem::path& file : files)
+        {
+            Input input;
+            if (!ReadFile(file, input))
+            {
+                std::cerr << "Cannot read " << file << "\n";
+                return EXIT_FAILURE;
+            }
+            current = &input;
+            RunInput(input.data(), input.size());
+            corpus.push_back(input);
+        }
+    }
+    current = nullptr;
+    if (!fuzz)
+    {
+        std::cout << "Ran " << corpus.size() << " inputs\n";
+        return EXIT_SUCCESS;
+    }
+    if (runs == 0)
+    {
+        runs = UINT64_MAX;
+    }
+
+    CoverageMap coverage;
+    for (const Input& seedInput : BuiltinSeeds())
+    {
+        RunInput(seedInput.data(), seedInput.size());
+        corpus.push_back(seedInput);
+    }
+    coverage.Merge();
+
+    Mutator mutator(seed, maxLength);
+    Input input;
+    current = &input;
+    auto start = std::chrono::steady_clock::now();
+    uint64_t reportAt = 1 << 16;
+    for (uint64_t run = 1; run <= runs; ++run)
+    {
+        input = corpus[run % corpus.size()];
+        mutator.Mutate(input, corpus);
+        RunInput(input.data(), input.size());
+        if (coverage.Merge())
+        {
+            corpus.push_back(input);
+            if (!corpusDir.empty())
+            {
+                char name[32];
+                std::snprintf(name, sizeof(name), "/%08zu", corpus.size());
+                std::ofstream out(corpusDir + name, std::ios::binary);
+                out.write(reinterpret_cast<const char*>(input.data()),
+                          input.size());
+            }
+        }
+
+        if (run == reportAt || run == runs)
+        {
+            double seconds = std::chrono::duration<double>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count();
+            std::cout << "runs " << run << "  exec/s "
+                      << static_cast<uint64_t>(run / seconds) << "  corpus "
+                      << corpus.size() << "  pcs " << coverage.Pcs()
+                      << "  edges " << coverage.Edges() << "  ops "
+                      << coverage.Ops() << std::endl;
+            reportAt *= 2;
+        }
+    }
+    current = nullptr;
+    return EXIT_SUCCESS;
+}
+
+#endif
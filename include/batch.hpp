@@ -0,0 +1,67 @@
+#pragma once
+
+#include "chip8.hpp"
+#include "input.hpp"
+#include "quirks.hpp"
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+struct InputScript
+{
+    std::string name;
+    std::vector<InputEvent> events; // sorted by cycle
+};
+
+// One machine to run: the cartesian product ROM x input script x seed.
+struct BatchJob
+{
+    const std::string* rom;
+    const InputScript* script;
+    uint32_t seed;
+};
+
+struct BatchResult
+{
+    bool loaded = false;
+    uint64_t cycles = 0;
+    uint16_t pc = 0;
+    uint64_t videoHash = 0;
+    uint64_t nanoseconds = 0;
+};
+
+struct BatchOptions
+{
+    unsigned threads = 0; // 0 = one per hardware thread
+    uint64_t cycles = 0;  // per-instance budget; frames is used when 0
+    uint64_t frames = 600;
+    uint32_t cyclesPerFrame = 10;
+    bool jit = false; // run through the dynamic recompiler when available
+    QuirkDatabase quirks; // looked up by ROM hash
+};
+
+/*
+Parse an input script. Each non-empty line that does not start with '#' is
+"<cycle> <key> <down>", where key is a hex digit 0-F and down is 1 or 0.
+*/
+bool LoadInputScript(const char* filename, InputScript& script);
+
+// Called at every frame boundary, right after the timers tick.
+typedef std::function<void(const Chip8&)> FrameHook;
+
+/*
+Run one machine without a platform layer, feeding it a scripted keypad. The
+timers tick once every cyclesPerFrame instructions, the headless equivalent
+of the 60 Hz frame the scheduler runs in a window.
+*/
+BatchResult RunHeadless(Chip8& chip8, const InputScript& script,
+                        uint64_t cycles, uint32_t cyclesPerFrame,
+                        bool useJit = false, const FrameHook& onFrame = {});
+
+std::vector<BatchResult> RunBatch(const std::vector<BatchJob>& jobs,
+                                  const BatchOptions& options);
+
+uint64_t HashVideo(const Chip8& chip8);
+// The same hash for a bare framebuffer, as a client decodes it.
+uint64_t HashVideo(const uint64_t video[VIDEO_HEIGHT]);
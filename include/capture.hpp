@@ -0,0 +1,65 @@
+#pragma once
+
+#include "chip8.hpp"
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+Records the display at every frame boundary, without a window, scaling each
+pixel to a scale x scale square. The file name picks the format:
+
+  *.y4m   one YUV4MPEG2 file at 60 frames per second, uncompressed 8-bit
+          grayscale, which ffmpeg and most players read directly
+  *.png   one 1-bit grayscale PNG per frame, numbered from 0 before the
+          extension (shot.png becomes shot_000000.png, shot_000001.png...)
+
+Frame() only copies the 256-byte display into a queue; scaling and writing
+happen on a thread of its own, so capture never holds up emulation, at the
+cost of the queue growing if the disk cannot keep up.
+*/
+class FrameCapture
+{
+public:
+    static const unsigned int MAX_SCALE = 64;
+
+    FrameCapture(const std::string& fileName, unsigned int scale);
+    // Writes everything still queued before returning.
+    ~FrameCapture();
+    FrameCapture(const FrameCapture&) = delete;
+    FrameCapture& operator=(const FrameCapture&) = delete;
+
+    void Frame(const uint64_t* video);
+    // Wait for the queue to drain and stop the writer. Returns false if the
+    // output could not be opened or a write failed.
+    bool Finish();
+    uint64_t Frames() const { return frames; }
+
+private:
+    typedef std::array<uint64_t, VIDEO_HEIGHT> Rows;
+
+    void WriterLoop();
+    bool WriteY4m(const Rows& rows);
+    bool WritePng(const Rows& rows, uint64_t number);
+
+    std::string fileName;
+    unsigned int scale;
+    bool png;
+    std::ofstream y4m;
+    uint64_t frames = 0;
+    std::vector<uint8_t> buffer; // writer thread only
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<Rows> queue;
+    bool finishing = false;
+    std::atomic<bool> failed{false};
+    std::thread writer;
+};
@@ -1,31 +1,220 @@
 #pragma once
 
-#include <chrono>
+#include <array>
+#include <bitset>
 #include <cstdint>
 #include <cstring>
 #include <fstream>
-#include <random>
+#include <memory>
+#include <vector>
 
 const uint16_t START_ADDRESS = 0x200;
+const uint16_t MEMORY_SIZE = 4096;
+// Addresses wrap at the end of memory: I + n, and a pc fetched past 0xFFE.
+const uint16_t ADDRESS_MASK = MEMORY_SIZE - 1;
 const uint8_t VF = 0xF;
 const uint8_t VIDEO_HEIGHT = 32;
 const uint8_t VIDEO_WIDTH = 64;
+// The SUPER-CHIP and XO-CHIP display; see ExtendedDisplay.
+const uint8_t HIRES_HEIGHT = 64;
+const uint8_t HIRES_WIDTH = 128;
+const unsigned int PLANE_COUNT = 2;
+// XO-CHIP addresses 64 KB through I; code still runs from the first 4 KB.
+const uint32_t XO_MEMORY_SIZE = 0x10000;
 
 static const uint8_t FONTSET_SIZE = 80;
 const uint8_t FONTSET_START_ADDRESS =
     0x50; // Starting location of the FONTSET. anywhere in first 512 bytes
           // should be ok 0x50 seems to be popular
+// The 8x10 digits Fx30 points at, right after the small font under
+// SuperChip and XoChip.
+static const uint8_t BIG_FONTSET_SIZE = 160;
+const uint8_t BIG_FONTSET_START_ADDRESS =
+    FONTSET_START_ADDRESS + FONTSET_SIZE;
+
+/*
+Interpreters disagree on a few instructions, and ROMs are written for one of
+them. A profile fixes the choices:
+
+              8xy6/8xyE   Fx55/Fx65    Bnnn         Dxyn at an edge
+  Default     shift Vx    I unchanged  nnn + V0     wraps
+  Chip8       shift Vy    I += x + 1   nnn + V0     clips
+  Chip48      shift Vx    I += x       xnn + Vx     clips
+  SuperChip   shift Vx    I unchanged  xnn + Vx     clips
+  XoChip      shift Vy    I += x + 1   nnn + V0     wraps
+
+Default is what this emulator always did. In every profile but Default the
+shifts write VF after the result, so VF holds the flag when x is F. A
+sprite's starting position always wraps; the profile decides whether the
+pixels past the edge wrap too or are dropped.
+
+SuperChip and XoChip also enable the extended instruction set: 128x64 hires
+mode (00FE, 00FF), scrolling (00Cn, 00FB, 00FC), 16x16 sprites (Dxy0), the
+big font (Fx30), the RPL flags (Fx75, Fx85) and exit (00FD). XoChip adds
+scrolling up (00Dn), two bitplanes (Fn01), register ranges (5xy2, 5xy3),
+64 KB of memory through I (F000 nnnn), the audio pattern and pitch (F002,
+Fx3A), and skips that step over the whole of F000 nnnn.
+*/
+enum class QuirkProfile : uint8_t
+{
+    Default,
+    Chip8,
+    Chip48,
+    SuperChip,
+    XoChip
+};
+const unsigned int QUIRK_PROFILE_COUNT = 5;
+
+/*
+The display of a SuperChip or XoChip machine, drawn instead of Chip8::video.
+Each row is two words, columns 0-63 then 64-127, with bit 63 the leftmost
+column of each, so a scroll is a few word shifts. Lores mode draws every
+pixel as a 2x2 block, which keeps the one layout for both modes. Only
+XO-CHIP draws to plane 1; a pixel's colour is its plane 0 bit plus twice its
+plane 1 bit.
+*/
+struct ExtendedDisplay
+{
+    uint64_t rows[PLANE_COUNT][HIRES_HEIGHT][2];
+    bool hires;
+    uint8_t planes; // bit mask of the planes drawn, cleared and scrolled
+};
+
+class Chip8;
+class Profiler;
+class RomImage;
+struct Instr;
+
+typedef void (*Chip8Handler)(Chip8&, Instr const&);
+
+/*
+A predecoded instruction. The operand fields are extracted once at decode
+time: imm holds nnn, kk or n depending on the opcode family.
+*/
+struct Instr
+{
+    Chip8Handler handler;
+    uint8_t x;
+    uint8_t y;
+    uint16_t imm;
+    uint8_t op; // Chip8::OpClass() of the opcode
+};
 
 class Chip8
 {
 public:
-    Chip8();
-    void LoadROM(const char* filename);
+    explicit Chip8(uint32_t seed);
+
+    // Opcodes grouped by the handler that runs them, in dispatch order:
+    // 00E0, 00EE, 1nnn-7xkk, 8xy0-8xy7, 8xyE, 9xy0, Annn-Dxyn, Ex9E, ExA1,
+    // the Fx opcodes in ascending order, the SUPER-CHIP and XO-CHIP
+    // opcodes, and last every opcode that does nothing. Without
+    // extensions the extended opcodes fall in with what they always did.
+    static constexpr unsigned int OP_CLASS_COUNT = 51;
+    static constexpr uint8_t
+    OpClass(uint16_t opcode, QuirkProfile profile = QuirkProfile::Default);
+    // Whether the profile changes what opcodes of this class do.
+    static constexpr bool QuirksAffect(QuirkProfile profile, uint8_t opClass);
+
+    /*
+    Copy a ROM into memory at 0x200 and clear the rest of program memory.
+    Each overload returns false, leaving the machine untouched, when the ROM
+    is missing, empty, or larger than RomCapacity() of the current profile,
+    so choose XoChip before loading a ROM that needs its memory. Use
+    RomCache to share one mapped image between many machines.
+    */
+    bool LoadROM(const char* filename);
+    bool LoadROM(const uint8_t* data, size_t size);
+    bool LoadROM(std::shared_ptr<const RomImage> rom);
+    /*
+    Put the machine back in the state a new Chip8(seed) has after loading
+    the current ROM, without touching the file system or allocating. If
+    nothing was written to memory since it was last pristine, memory and
+    the decoded blocks are kept as they are; otherwise memory is rebuilt
+    from the ROM image and the block cache emptied. A Jit attached to the
+    machine must be flushed afterwards.
+    */
+    void Reset(uint32_t seed);
+    /*
+    Choose how the instructions interpreters disagree on behave. The choice
+    is made when an instruction is decoded, by picking that profile's
+    handler, so the block cache is emptied and running costs the same in
+    every profile. Kept by Reset() and LoadROM(); not part of save states,
+    so set the same profile before LoadState(). Flush an attached Jit after
+    changing it. Moving to or from SuperChip or XoChip also clears the
+    display and puts memory back as loaded, so choose the profile before
+    LoadROM() or straight after it. Returns false when the loaded ROM is
+    larger than the new profile's RomCapacity(); the profile is set all the
+    same and the ROM unloaded rather than cut short.
+    */
+    bool SetQuirks(QuirkProfile profile);
+    // The largest ROM a profile holds: 3584 bytes, or 65024 under XoChip.
+    static size_t RomCapacity(QuirkProfile profile);
+    QuirkProfile Quirks() const { return quirks; }
     uint8_t keypad[16] = {0};
-    uint32_t video[VIDEO_WIDTH * VIDEO_HEIGHT] = {0};
+    // One bit per pixel, one word per row; bit 63 is the leftmost column.
+    // Use ExpandFramebuffer() to turn this into RGBA for presentation.
+    // Stays blank under SuperChip and XoChip, which draw to Extended().
+    uint64_t video[VIDEO_HEIGHT] = {0};
+    // The SuperChip or XoChip display; nullptr under other profiles.
+    const ExtendedDisplay* Extended() const
+    {
+        return extension ? &extension->display : nullptr;
+    }
+    // Execute exactly one instruction, decoding it from memory.
     void Cycle();
+    // Execute the given number of instructions through the block cache.
+    void Run(uint32_t cycles);
+    /*
+    True if the last Run() found the machine spinning: back at the same
+    address with the same registers after a loop with no side effects, such
+    as Fx0A waiting for a key or a loop polling the delay timer. Nothing can
+    change until a key or timer does, so Run() skipped the remaining whole
+    iterations of the loop instead of executing them.
+    */
+    bool Idle() const { return idle; }
+    // Count the delay and sound timers down by one; call at 60 Hz.
+    void TickTimers();
+    uint16_t ProgramCounter() const { return pc; }
+    // The opcode at address, wrapping at the end of memory as fetches do.
+    uint16_t OpcodeAt(uint16_t address) const
+    {
+        return (memory[address & ADDRESS_MASK] << 8u) |
+               memory[(address + 1) & ADDRESS_MASK];
+    }
+    /*
+    Serialize the whole machine into a compact, versioned binary blob. With
+    deltaMemory, memory is stored as the runs that differ from the freshly
+    loaded ROM image, so a typical state is a few hundred bytes; LoadState()
+    then requires the same ROM to be loaded.
+    */
+    void SaveState(std::vector<uint8_t>& out, bool deltaMemory = true) const;
+    // Returns false, leaving the machine untouched, if the blob is malformed,
+    // from another version, or delta-encoded against a different ROM.
+    bool LoadState(const uint8_t* data, size_t size);
+    // FNV-1a of the loaded ROM, identifying it in save states and movies.
+    uint32_t RomHash() const;
+    // Bytes owned by this machine, block cache included; the ROM image is
+    // shared and not counted.
+    size_t MemoryFootprint() const;
+    // Route interpreted instructions through profiler, or stop with
+    // nullptr. Does nothing unless built with CHIP8_PROFILE.
+    void SetProfiler(Profiler* profiler) { this->profiler = profiler; }
+
+    // Rows changed since the last call, one bit per row (bit 0 is row 0).
+    // Everything is reported dirty after construction. Extended() displays
+    // are only tracked as a whole: any change sets every bit.
+    uint32_t TakeDirtyRows()
+    {
+        uint32_t rows = dirtyRows;
+        dirtyRows = 0;
+        return rows;
+    }
 
 private:
+    friend class Jit;
+    friend class Lockstep;
+
     uint8_t registers[16]{};
     uint8_t memory[4096]{};
     uint16_t index{};
@@ -34,55 +223,301 @@ private:
     uint16_t pc{};
     uint8_t delayTimer{};
     uint8_t soundTimer{};
-    uint16_t opcode{};
-    void OP_1nnn();
-    void OP_2nnn();
-    void OP_3xkk();
-    void OP_4xkk();
-    void OP_5xy0();
-    void OP_6xkk();
-    void OP_7xkk();
-    void OP_9xy0();
-    void OP_Annn();
-    void OP_Bnnn();
-    void OP_Cxkk();
-    void OP_Dxyn();
-    void OP_00E0();
-    void OP_00EE();
-    void OP_8xy0();
-    void OP_8xy1();
-    void OP_8xy2();
-    void OP_8xy3();
-    void OP_8xy4();
-    void OP_8xy5();
-    void OP_8xy6();
-    void OP_8xy7();
-    void OP_8xyE();
-    void OP_ExA1();
-    void OP_Ex9E();
-    void OP_Fx07();
-    void OP_Fx0A();
-    void OP_Fx15();
-    void OP_Fx18();
-    void OP_Fx1E();
-    void OP_Fx29();
-    void OP_Fx33();
-    void OP_Fx55();
-    void OP_Fx65();
-    void OP_NULL();
-    void Table0();
-    void TableE();
-    void TableF();
-    void Table8();
-
-    typedef void (Chip8::*Chip8Func)();
-
-    Chip8Func table[0xF + 1];
-    Chip8Func table0[0xE + 1];
-    Chip8Func table8[0xE + 1];
-    Chip8Func tableE[0xE + 1];
-    Chip8Func tableF[0x65 + 1];
-
-    std::default_random_engine randGen;
-    std::uniform_int_distribution<uint8_t> randByte;
-};
\ No newline at end of file
+    uint32_t dirtyRows = 0xFFFFFFFF;
+    void OP_1nnn(Instr const& in);
+    void OP_2nnn(Instr const& in);
+    template <typename Quirks>
+    void OP_3xkk(Instr const& in);
+    template <typename Quirks>
+    void OP_4xkk(Instr const& in);
+    template <typename Quirks>
+    void OP_5xy0(Instr const& in);
+    void OP_6xkk(Instr const& in);
+    void OP_7xkk(Instr const& in);
+    template <typename Quirks>
+    void OP_9xy0(Instr const& in);
+    void OP_Annn(Instr const& in);
+    template <typename Quirks>
+    void OP_Bnnn(Instr const& in);
+    void OP_Cxkk(Instr const& in);
+    template <typename Quirks>
+    void OP_Dxyn(Instr const& in);
+    template <typename Quirks>
+    void OP_00E0(Instr const& in);
+    void OP_00EE(Instr const& in);
+    void OP_8xy0(Instr const& in);
+    void OP_8xy1(Instr const& in);
+    void OP_8xy2(Instr const& in);
+    void OP_8xy3(Instr const& in);
+    void OP_8xy4(Instr const& in);
+    void OP_8xy5(Instr const& in);
+    template <typename Quirks>
+    void OP_8xy6(Instr const& in);
+    void OP_8xy7(Instr const& in);
+    template <typename Quirks>
+    void OP_8xyE(Instr const& in);
+    template <typename Quirks>
+    void OP_ExA1(Instr const& in);
+    template <typename Quirks>
+    void OP_Ex9E(Instr const& in);
+    void OP_Fx07(Instr const& in);
+    void OP_Fx0A(Instr const& in);
+    void OP_Fx15(Instr const& in);
+    void OP_Fx18(Instr const& in);
+    void OP_Fx1E(Instr const& in);
+    void OP_Fx29(Instr const& in);
+    template <typename Quirks>
+    void OP_Fx33(Instr const& in);
+    template <typename Quirks>
+    void OP_Fx55(Instr const& in);
+    template <typename Quirks>
+    void OP_Fx65(Instr const& in);
+    // SUPER-CHIP
+    void OP_00Cn(Instr const& in);
+    void OP_00FB(Instr const& in);
+    void OP_00FC(Instr const& in);
+    void OP_00FD(Instr const& in);
+    void OP_00FE(Instr const& in);
+    void OP_00FF(Instr const& in);
+    void OP_Fx30(Instr const& in);
+    void OP_Fx75(Instr const& in);
+    void OP_Fx85(Instr const& in);
+    // XO-CHIP
+    void OP_00Dn(Instr const& in);
+    void OP_5xy2(Instr const& in);
+    void OP_5xy3(Instr const& in);
+    void OP_F000(Instr const& in);
+    void OP_Fn01(Instr const& in);
+    void OP_F002(Instr const& in);
+    void OP_Fx3A(Instr const& in);
+    void OP_NULL(Instr const& in);
+
+    // Step over the instruction at pc, or both words of an XO-CHIP
+    // F000 nnnn.
+    template <typename Quirks>
+    void Skip();
+    // The byte at a data address: wrapped to 4 KB, or anywhere in XO-CHIP's
+    // 64 KB.
+    template <typename Quirks>
+    uint8_t& MemoryAt(uint16_t address);
+    template <typename Quirks>
+    void DrawExtended(Instr const& in);
+    void Scroll(int down, int right);
+
+    template <void (Chip8::*Op)(Instr const&)>
+    static void Thunk(Chip8& chip8, Instr const& in)
+    {
+        (chip8.*Op)(in);
+    }
+
+    // Uses this machine's handlers; the rest is static tables.
+    Instr Decode(uint16_t opcode) const;
+
+    typedef std::array<Chip8Handler, OP_CLASS_COUNT> HandlerTable;
+    template <typename Quirks>
+    static constexpr HandlerTable MakeHandlers();
+    // One handler per opcode class for each profile, shared by every
+    // instance.
+    static const HandlerTable HANDLERS[QUIRK_PROFILE_COUNT];
+    const Chip8Handler* handlers = HANDLERS[0].data();
+    // OpClass() of every opcode under this profile.
+    const uint8_t* opClasses;
+    QuirkProfile quirks = QuirkProfile::Default;
+
+    // What SuperChip and XoChip add to the machine, allocated only under
+    // them so every other machine stays the size it was.
+    struct Extension
+    {
+        ExtendedDisplay display;
+        uint8_t flags[16]; // RPL user flags
+        uint8_t audio[16]; // XO-CHIP audio pattern, one bit per sample
+        uint8_t pitch;
+        // 0x1000-0xFFFF of XO-CHIP memory; empty under SuperChip
+        std::vector<uint8_t> high;
+    };
+    std::unique_ptr<Extension> extension;
+    void ResetExtension();
+
+    /*
+    Straight-line runs of decoded instructions, keyed by start address. A
+    block ends after any instruction that can change pc or write memory, so
+    the instructions of a block always execute back to back.
+    */
+    struct Block
+    {
+        uint16_t start;
+        uint16_t end; // one past the last byte
+        uint32_t first;
+        uint32_t count;
+        bool valid;
+        bool pure; // only touches registers, index, timers and pc
+    };
+
+    struct BlockCache
+    {
+        static constexpr uint16_t NONE = 0xFFFF;
+        uint16_t blockAt[MEMORY_SIZE];
+        std::bitset<MEMORY_SIZE> covered;
+        std::vector<Block> blocks;
+        std::vector<Instr> code;
+    };
+
+    static bool EndsBlock(uint16_t opcode,
+                          QuirkProfile profile = QuirkProfile::Default);
+    static bool HasSideEffects(uint16_t opcode, QuirkProfile profile);
+    const Block& FindBlock(uint16_t address);
+    void FlushCache();
+    void InvalidateCode(uint16_t address, uint16_t length);
+
+    // Allocated on the first call to Run() so single-stepped instances
+    // stay small.
+    std::unique_ptr<BlockCache> cache;
+
+    // The state at the last backward branch, while every block since has
+    // been pure; Run() compares the next one against it to find spins.
+    struct SpinCheck
+    {
+        uint8_t registers[16];
+        uint16_t index;
+        uint16_t pc;
+        uint8_t delayTimer;
+        uint8_t soundTimer;
+        uint32_t cyclesLeft;
+        bool valid;
+    };
+    bool Spinning(uint32_t& cycles);
+
+    SpinCheck spin{};
+    bool idle = false;
+    // Memory may differ from BuildBaseImage(): set by every guest write and
+    // by LoadState(), cleared by Reset().
+    bool memoryDirty = false;
+
+    void BuildBaseImage(uint8_t* image) const;
+    // The same for XO-CHIP memory above 4 KB: the rest of the ROM, then
+    // zeros.
+    void BuildHighImage(uint8_t* image) const;
+    uint8_t RandomByte();
+
+    uint64_t rngState;
+    Profiler* profiler = nullptr;
+    // The loaded ROM, shared rather than copied between instances.
+    std::shared_ptr<const RomImage> romImage;
+};
+
+constexpr uint8_t Chip8::OpClass(uint16_t opcode, QuirkProfile profile)
+{
+    const uint8_t NOP = OP_CLASS_COUNT - 1;
+    uint8_t family = (opcode & 0xF000u) >> 12u;
+    uint8_t low = opcode & 0x000Fu;
+    bool xo = profile == QuirkProfile::XoChip;
+    if (xo || profile == QuirkProfile::SuperChip)
+    {
+        switch (opcode & 0xF0FFu)
+        {
+            case 0xF030:
+                return 46;
+            case 0xF03A:
+                return xo ? 47 : NOP;
+            case 0xF075:
+                return 48;
+            case 0xF085:
+                return 49;
+        }
+        if ((opcode & 0xFFF0u) == 0x00C0u)
+        {
+            return 34;
+        }
+        if (xo && (opcode & 0xFFF0u) == 0x00D0u)
+        {
+            return 35;
+        }
+        if (opcode >= 0x00FBu && opcode <= 0x00FFu)
+        {
+            return 36 + opcode - 0x00FBu;
+        }
+        if (xo && family == 0x5 && (low == 0x2 || low == 0x3))
+        {
+            return 41 + low - 0x2;
+        }
+        if (xo && opcode == 0xF000u)
+        {
+            return 43;
+        }
+        if (xo && (opcode & 0xF0FFu) == 0xF001u)
+        {
+            return 44;
+        }
+        if (xo && opcode == 0xF002u)
+        {
+            return 45;
+        }
+    }
+    switch (family)
+    {
+        case 0x0:
+            return low == 0x0 ? 0 : low == 0xE ? 1 : NOP;
+        case 0x8:
+            if (low <= 0x7)
+            {
+                return 9 + low;
+            }
+            return low == 0xE ? 17 : NOP;
+        case 0x9:
+            return 18;
+        case 0xA:
+        case 0xB:
+        case 0xC:
+        case 0xD:
+            return 19 + family - 0xA;
+        case 0xE:
+            return low == 0xE ? 23 : low == 0x1 ? 24 : NOP;
+        case 0xF:
+            switch (opcode & 0x00FFu)
+            {
+                case 0x07:
+                    return 25;
+                case 0x0A:
+                    return 26;
+                case 0x15:
+                    return 27;
+                case 0x18:
+                    return 28;
+                case 0x1E:
+                    return 29;
+                case 0x29:
+                    return 30;
+                case 0x33:
+                    return 31;
+                case 0x55:
+                    return 32;
+                case 0x65:
+                    return 33;
+            }
+            return NOP;
+        default:
+            // 1nnn through 7xkk
+            return family + 1;
+    }
+}
+
+constexpr bool Chip8::QuirksAffect(QuirkProfile profile, uint8_t opClass)
+{
+    if (profile == QuirkProfile::Default)
+    {
+        return false;
+    }
+    bool extended = profile == QuirkProfile::SuperChip ||
+                    profile == QuirkProfile::XoChip;
+    // Skips over F000 nnnn and I reaching past 4 KB
+    bool xo = profile == QuirkProfile::XoChip;
+    return opClass == OpClass(0x8006) || opClass == OpClass(0x800E) ||
+           opClass == OpClass(0xB000) || opClass == OpClass(0xD000) ||
+           opClass == OpClass(0xF055) || opClass == OpClass(0xF065) ||
+           (extended && (opClass == OpClass(0x00E0) ||
+                         (opClass >= 34 && opClass < OP_CLASS_COUNT - 1))) ||
+           (xo && (opClass == OpClass(0x3000) || opClass == OpClass(0x4000) ||
+                   opClass == OpClass(0x5000) || opClass == OpClass(0x9000) ||
+                   opClass == OpClass(0xE09E) || opClass == OpClass(0xE0A1) ||
+                   opClass == OpClass(0xF033)));
+}
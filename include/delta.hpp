@@ -0,0 +1,97 @@
+#pragma once
+
+#include "chip8.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <vector>
+
+/*
+Compact encoding of a sequence of 1-bit displays, for streaming and
+recording. Each frame becomes one packet: a kind byte, 0 for a delta or 1
+for a keyframe, then the frame's 256 bytes (row by row, leftmost pixels
+first) XORed with the previous frame's, or with a blank display for a
+keyframe, as alternating runs: a varint count of zero bytes, then a varint
+count of literal bytes and the bytes themselves, until all 256 are
+covered. A zero run that reaches the end ends the packet, so an unchanged
+frame costs three bytes and a sprite moving a few pixels about a dozen.
+Varints are 7 bits per byte, low bits first.
+*/
+const size_t DELTA_FRAME_BYTES = VIDEO_HEIGHT * sizeof(uint64_t);
+
+class DeltaEncoder
+{
+public:
+    // A keyframe every keyframeInterval frames (a second at 60 Hz by
+    // default), starting with the first; 0 for only the first.
+    explicit DeltaEncoder(uint32_t keyframeInterval = 60);
+
+    // Append the packet for the next frame to out.
+    void Encode(const uint64_t* video, std::vector<uint8_t>& out);
+    // Make the next packet a keyframe, e.g. for a viewer joining late.
+    void ForceKeyframe() { forceKeyframe = true; }
+
+private:
+    uint32_t keyframeInterval;
+    uint32_t sinceKeyframe = 0;
+    bool forceKeyframe = true;
+    uint64_t previous[VIDEO_HEIGHT]{};
+};
+
+class DeltaDecoder
+{
+public:
+    /*
+    Apply the packet at the start of data, of at most size bytes, and set
+    used to its length. Returns false, leaving the display untouched, for a
+    malformed or truncated packet, or a delta before the first keyframe.
+    */
+    bool Decode(const uint8_t* data, size_t size, size_t& used);
+    // The display as of the last packet applied.
+    const uint64_t* Video() const { return video; }
+    bool LastWasKeyframe() const { return keyframe; }
+
+private:
+    bool synced = false;
+    bool keyframe = false;
+    uint64_t video[VIDEO_HEIGHT]{};
+};
+
+/*
+A delta stream in a file or any other ostream: "C8FD", a version byte, then
+one packet per frame.
+*/
+class DeltaWriter
+{
+public:
+    explicit DeltaWriter(std::ostream& out, uint32_t keyframeInterval = 60);
+
+    void Frame(const uint64_t* video);
+    // False once a write has failed.
+    bool Good() const;
+    uint64_t Frames() const { return frames; }
+    uint64_t Bytes() const { return bytes; }
+
+private:
+    std::ostream& out;
+    DeltaEncoder encoder;
+    std::vector<uint8_t> packet;
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+};
+
+// Reads back a whole stream written by DeltaWriter.
+class DeltaReader
+{
+public:
+    // False if the file cannot be read or is not a delta stream.
+    bool Open(const char* filename);
+    // Decode the next frame; false at the end or on a corrupt packet.
+    bool Next();
+    const uint64_t* Video() const { return decoder.Video(); }
+
+private:
+    std::vector<uint8_t> data;
+    size_t at = 0;
+    DeltaDecoder decoder;
+};
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "chip8.hpp"
+#include <cstdint>
+
+const uint32_t PIXEL_ON = 0xFFFFFFFF;
+const uint32_t PIXEL_OFF = 0x00000000;
+
+/*
+Expand the 1-bit packed framebuffer into one 32-bit pixel per bit, row-major
+with VIDEO_WIDTH pixels per row. Only needed when a frame is actually
+presented; emulation itself never touches the expanded form.
+*/
+void ExpandFramebuffer(const uint64_t* rows, uint32_t* pixels,
+                       uint32_t on = PIXEL_ON, uint32_t off = PIXEL_OFF);
+
+// Expand only rows [first, first + count), e.g. the dirty span of a frame.
+void ExpandRows(const uint64_t* rows, uint32_t* pixels, unsigned int first,
+                unsigned int count, uint32_t on = PIXEL_ON,
+                uint32_t off = PIXEL_OFF);
+
+// Colours of the four plane combinations of an ExtendedDisplay: off, plane
+// 0, plane 1, both.
+const uint32_t EXTENDED_PALETTE[4] = {PIXEL_OFF, PIXEL_ON, 0x55555555,
+                                      0xAAAAAAAA};
+
+// The same for an ExtendedDisplay, always HIRES_WIDTH x HIRES_HEIGHT pixels.
+void ExpandExtended(const ExtendedDisplay& display, uint32_t* pixels,
+                    const uint32_t* palette = EXTENDED_PALETTE);
+
+// Smallest span of rows covering every set bit of a dirty-row mask.
+// Returns false when the mask is empty.
+bool DirtySpan(uint32_t dirtyRows, unsigned int& first, unsigned int& count);
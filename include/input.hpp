@@ -0,0 +1,61 @@
+#pragma once
+
+#include "spsc_queue.hpp"
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// A single keypad change applied right before the given cycle executes.
+struct InputEvent
+{
+    uint64_t cycle;
+    uint8_t key;
+    uint8_t down;
+};
+
+// A keypad change as the platform saw it, stamped with when it happened.
+struct KeyEvent
+{
+    std::chrono::steady_clock::time_point time;
+    uint8_t key;
+    uint8_t down;
+};
+
+// Platform to emulation. Drained every frame, so it only fills up if
+// emulation stalls; further events are then dropped.
+typedef SpscQueue<KeyEvent, 256> KeyEventQueue;
+
+/*
+Places timestamped key events on the cycle timeline of the next frame.
+Events drained at a poll are packed at the start of the frame, so a key
+takes effect on the first instructions after it was seen. Every event gets
+a cycle of its own: a press and release between two polls are both seen,
+in order, at least one instruction apart, and an event that no longer fits
+is carried over to the start of the following frame.
+
+With spread set, events are instead placed at the same relative position
+within the frame as they had within the interval they arrived in. That
+keeps the spacing between them, at the cost of up to a frame of latency.
+*/
+class KeyTimeline
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    explicit KeyTimeline(uint32_t instructionsPerFrame, bool spread = false);
+
+    // Drain the queue and return the events for a frame starting now,
+    // sorted, with cycles counted from the start of the frame.
+    const std::vector<InputEvent>& NextFrame(KeyEventQueue& queue,
+                                             Clock::time_point now);
+
+private:
+    void Place(uint64_t cycle, uint8_t key, uint8_t down);
+
+    uint32_t instructionsPerFrame;
+    bool spread;
+    Clock::time_point last;
+    uint64_t nextCycle = 0;
+    std::vector<InputEvent> events;
+    std::vector<InputEvent> carried;
+};
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "chip8.hpp"
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+/*
+Dynamic recompiler for x86-64. Hot basic blocks are translated into native
+code in an mmap'd executable buffer, with the guest registers a block uses
+held in host registers until the block exits. Instructions that are not
+worth translating (Dxyn, Fx0A, Cxkk, 00E0, Fx33) are executed by the
+interpreter in Chip8::Cycle().
+
+Only available when built with CHIP8_JIT on an x86-64 host; otherwise Run()
+forwards to Chip8::Run().
+*/
+class Jit
+{
+public:
+    explicit Jit(Chip8& chip8);
+    ~Jit();
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+
+    static bool Available();
+
+    // Execute the given number of instructions.
+    void Run(uint32_t cycles);
+    // Execute one translated block or one interpreted instruction, never
+    // more than maxCycles instructions. Returns the number executed.
+    uint32_t Step(uint32_t maxCycles);
+    // Drop every translated block, e.g. after loading a new ROM or a save
+    // state.
+    void Flush();
+
+    /*
+    Differential test: runs a JIT-driven machine and a plain interpreter in
+    lockstep from the same ROM, seed and quirk profile, comparing the full
+    machine state after every translated block. Reports the first
+    divergence to out.
+    */
+    static bool Differential(const char* romFileName, uint32_t seed,
+                             uint64_t cycles, std::ostream& out,
+                             QuirkProfile quirks = QuirkProfile::Default);
+
+private:
+    typedef void (*BlockFunc)(Chip8*);
+
+    struct Block
+    {
+        BlockFunc code; // nullptr: interpret the instruction at start
+        uint16_t start;
+        uint16_t end;
+        uint32_t count;
+        uint8_t writeLength; // bytes at index written by a trailing Fx55
+        bool valid;
+    };
+
+    // Byte offsets of the machine state inside Chip8, used as
+    // displacements from the object pointer passed to a block.
+    struct Offsets
+    {
+        int32_t registers;
+        int32_t memory;
+        int32_t index;
+        int32_t stack;
+        int32_t sp;
+        int32_t pc;
+        int32_t delayTimer;
+        int32_t soundTimer;
+        int32_t keypad;
+    };
+
+    static constexpr uint16_t NONE = 0xFFFF;
+
+    const Block& FindBlock(uint16_t address);
+    Block Compile(uint16_t address);
+    void Invalidate(uint16_t address, uint16_t length);
+
+    static bool SameState(const Chip8& a, const Chip8& b, std::ostream& out);
+
+    Chip8& chip8;
+    Offsets offsets;
+    uint8_t* buffer = nullptr;
+    size_t bufferSize = 0;
+    size_t bufferUsed = 0;
+    uint16_t blockAt[MEMORY_SIZE];
+    std::vector<Block> blocks;
+};
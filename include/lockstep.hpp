@@ -0,0 +1,89 @@
+#pragma once
+
+#include "chip8.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class RomImage;
+
+/*
+Runs many machines on the same ROM together, one lane per machine. Registers,
+pc, index, stack and timers are stored structure-of-arrays, one column per
+field, and each step executes one instruction for every lane whose pc matches
+the lowest pending pc. Register and control-flow instructions run as
+branch-free loops over the columns, which the compiler vectorizes for
+whatever the target supports (SSE2 by default; AVX2 or AVX-512 with
+-march). Lanes that have diverged sit out the step and catch up in later
+ones, and usually reconverge at the next shared instruction.
+
+Memory, the framebuffer and the RNG stay in one Chip8 per lane.
+Instructions that need them (00E0, Cxkk, Dxyn, Fx0A, Fx33, Fx55, Fx65) are
+run per lane by the ordinary OP_* handlers on that Chip8, with the lane's
+registers copied in and back out.
+*/
+class Lockstep
+{
+public:
+    // One lane per seed.
+    explicit Lockstep(const std::vector<uint32_t>& seeds);
+
+    bool LoadROM(std::shared_ptr<const RomImage> rom);
+    // The same profile for every lane; see Chip8::SetQuirks().
+    bool SetQuirks(QuirkProfile profile);
+
+    size_t Lanes() const { return lanes; }
+    // The keypad of one lane, one bit per key.
+    void SetKeys(size_t lane, uint16_t keys) { keypads[lane] = keys; }
+    // Execute exactly cycles instructions on every lane.
+    void Run(uint32_t cycles);
+    void TickTimers();
+
+    // The lane as a complete machine, for video, SaveState() and the like.
+    // Valid until the next Run().
+    const Chip8& Machine(size_t lane);
+
+    // Lane instructions executed, and the steps they took; their ratio is
+    // the average number of lanes that ran together.
+    uint64_t LaneInstructions() const { return laneInstructions; }
+    uint64_t Steps() const { return steps; }
+
+private:
+    void Execute(const Instr& in);
+    void RunHandlers(const Instr& in);
+    void Spill(size_t lane);
+    void Fill(size_t lane);
+
+    // Column accessors; lane counts are padded so every column is whole
+    // vectors long.
+    uint8_t* V(unsigned int r) { return registers.data() + r * stride; }
+    uint16_t* Stack(unsigned int level)
+    {
+        return stack.data() + level * stride;
+    }
+
+    size_t lanes;
+    size_t stride;
+
+    std::vector<uint8_t> registers; // 16 columns
+    std::vector<uint16_t> pc;
+    std::vector<uint16_t> index;
+    std::vector<uint16_t> stack; // 16 columns
+    std::vector<uint8_t> sp;
+    std::vector<uint8_t> delayTimer;
+    std::vector<uint8_t> soundTimer;
+    std::vector<uint16_t> keypads;
+    std::vector<uint32_t> remaining; // instructions left in this Run()
+    std::vector<uint8_t> active;     // 0xFF for lanes in the current step
+
+    std::vector<std::unique_ptr<Chip8>> machines;
+    // Memory as loaded, and the addresses any lane has written since; code
+    // outside written is identical in every lane.
+    uint8_t image[MEMORY_SIZE];
+    std::vector<bool> written;
+
+    QuirkProfile quirks = QuirkProfile::Default;
+    uint64_t laneInstructions = 0;
+    uint64_t steps = 0;
+};
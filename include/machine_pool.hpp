@@ -0,0 +1,48 @@
+#pragma once
+
+#include "chip8.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class RomImage;
+
+/*
+A fixed set of machines with one ROM loaded, for workloads that start many
+short runs. Every machine is constructed and loaded up front in a single
+allocation, each starting on a cache line of its own so machines used by
+different threads never share one. Acquire() hands out a machine Reset() to
+the post-load state with the given seed, and Release() takes it back: a lock,
+a pointer and, if the last run wrote to memory, a 4 KB copy. Every machine
+runs under the one quirk profile given, which the ROM must fit (see
+Chip8::RomCapacity()).
+*/
+class MachinePool
+{
+public:
+    static const size_t CACHE_LINE = 64;
+
+    MachinePool(std::shared_ptr<const RomImage> rom, size_t capacity,
+                QuirkProfile quirks = QuirkProfile::Default);
+    MachinePool(const MachinePool&) = delete;
+    MachinePool& operator=(const MachinePool&) = delete;
+
+    // nullptr when every machine is out.
+    Chip8* Acquire(uint32_t seed);
+    void Release(Chip8* machine);
+    size_t Capacity() const { return capacity; }
+
+private:
+    struct alignas(CACHE_LINE) Slot
+    {
+        Slot() : machine(0) {}
+        Chip8 machine;
+    };
+
+    size_t capacity;
+    std::unique_ptr<Slot[]> slots;
+    std::mutex lock;
+    std::vector<Chip8*> free;
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "batch.hpp"
+#include <cstdint>
+#include <vector>
+
+// The whole keypad as it is from the given cycle of frame onwards.
+struct MovieEvent
+{
+    uint64_t frame;
+    uint32_t cycle; // within the frame
+    uint16_t keys;  // one bit per key
+};
+
+/*
+A recorded session: everything needed to reproduce it exactly given the same
+ROM, down to the instruction each key changed before.
+*/
+struct Movie
+{
+    uint32_t seed = 0;
+    uint32_t romHash = 0;
+    uint32_t instructionsPerFrame = 0;
+    QuirkProfile quirks = QuirkProfile::Default;
+    // False for files from before profiles were recorded; replay them with
+    // the options they were recorded with.
+    bool quirksRecorded = true;
+    uint64_t frames = 0;
+    std::vector<MovieEvent> events; // sorted by frame
+};
+
+class MovieRecorder
+{
+public:
+    MovieRecorder(uint32_t seed, uint32_t romHash,
+                  uint32_t instructionsPerFrame, QuirkProfile quirks);
+
+    // Call once per frame, before it runs, with the keypad it starts with
+    // and the changes it will apply.
+    void Frame(const uint8_t* keypad, const std::vector<InputEvent>& events);
+    // Forget everything after the first frames frames, after rewinding.
+    void Truncate(uint64_t frames);
+
+    const Movie& GetMovie() const { return movie; }
+
+private:
+    void Change(uint32_t cycle, uint16_t now);
+
+    Movie movie;
+    uint16_t keys = 0;
+};
+
+bool SaveMovie(const char* filename, const Movie& movie);
+bool LoadMovie(const char* filename, Movie& movie);
+
+// The movie's keypad changes as a cycle-keyed script for RunHeadless().
+InputScript MovieToScript(const Movie& movie);
@@ -1,3 +1,4 @@
+#include "input.hpp"
 #include <SDL2/SDL.h>
 class Platform
 {
@@ -5,6 +6,9 @@ private:
     SDL_Window* window;
     SDL_Renderer* renderer;
     SDL_Texture* texture;
+    int textureWidth;
+    bool rewindHeld = false;
+    bool fastForwardToggled = false;
 
 public:
     Platform(char const* title, int windowWidth, int windowHeight,
@@ -17,5 +21,20 @@ public:
         SDL_Quit();
     }
     void Update(void const* buffer, int pitch);
-    bool ProcessInput(uint8_t* keys);
+    // Upload only rows [firstRow, firstRow + rowCount) of buffer, which
+    // still holds the whole frame, then present.
+    void Update(void const* buffer, int pitch, int firstRow, int rowCount);
+    // Queue a timestamped event for every keypad key pressed or released
+    // since the last call. Returns true when the user asked to quit.
+    bool ProcessInput(KeyEventQueue& events);
+    // True while the rewind key (Backspace) is held down.
+    bool RewindHeld() const { return rewindHeld; }
+    // True once for each press of the fast-forward key (Tab).
+    bool FastForwardToggled()
+    {
+        bool toggled = fastForwardToggled;
+        fastForwardToggled = false;
+        return toggled;
+    }
+    void SetTitle(char const* title) { SDL_SetWindowTitle(window, title); }
 };
\ No newline at end of file
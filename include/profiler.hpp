@@ -0,0 +1,83 @@
+#pragma once
+
+#include "chip8.hpp"
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+// Set by the CHIP8_PROFILE CMake option. When false every profiling hook in
+// the interpreter is discarded at compile time.
+#ifdef CHIP8_PROFILE
+constexpr bool PROFILE_ENABLED = true;
+#else
+constexpr bool PROFILE_ENABLED = false;
+#endif
+
+/*
+Hot-path profile of the interpreter: executions per opcode, host time per
+opcode sampled about once every SAMPLE_PERIOD instructions with a log2
+histogram of those samples, and executions per pc address. Attach one to a machine
+with Chip8::SetProfiler(). Blocks run natively by the recompiler are not
+seen, only the instructions it hands back to the interpreter.
+*/
+class Profiler
+{
+public:
+    // Indexed by Chip8::OpClass().
+    static const unsigned int OP_COUNT = Chip8::OP_CLASS_COUNT;
+    static const char* const OP_NAMES[OP_COUNT];
+    static const uint32_t SAMPLE_PERIOD = 64;
+    static const unsigned int HISTOGRAM_BUCKETS = 16;
+
+    struct OpStats
+    {
+        uint64_t count;
+        uint64_t samples;
+        uint64_t sampledNs;
+        // Bucket b counts samples that took under 2^b ns; the last bucket
+        // takes everything slower.
+        uint64_t histogram[HISTOGRAM_BUCKETS];
+    };
+
+    Profiler();
+
+    // Execute one instruction found at address on behalf of the
+    // interpreter, recording it.
+    void Execute(Chip8& chip8, Instr const& in, uint16_t address)
+    {
+        ++pcHits[address % MEMORY_SIZE];
+        OpStats& op = ops[in.op];
+        ++op.count;
+        if (--untilSample != 0)
+        {
+            in.handler(chip8, in);
+            return;
+        }
+        Clock::time_point start = Clock::now();
+        in.handler(chip8, in);
+        Record(op, Clock::now() - start);
+        NextSample();
+    }
+
+    const OpStats& Op(unsigned int op) const { return ops[op]; }
+    uint64_t PcHits(uint16_t address) const { return pcHits[address]; }
+    void Reset();
+
+    // Per-opcode stats and the non-zero heatmap entries.
+    void WriteJson(std::ostream& out) const;
+    // An "opcode" row per executed opcode class, then a "pc" row per
+    // executed address, under one kind,key,count,samples,mean_ns header.
+    void WriteCsv(std::ostream& out) const;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    void Record(OpStats& op, Clock::duration elapsed);
+    void NextSample();
+
+    OpStats ops[OP_COUNT];
+    uint64_t pcHits[MEMORY_SIZE];
+    Clock::duration clockOverhead; // subtracted from every sample
+    uint32_t untilSample;
+    uint32_t jitter;
+};
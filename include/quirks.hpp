@@ -0,0 +1,37 @@
+#pragma once
+
+#include "chip8.hpp"
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+// "default", "chip8", "chip48", "schip" or "xochip".
+const char* QuirkProfileName(QuirkProfile profile);
+bool ParseQuirkProfile(const std::string& name, QuirkProfile& profile);
+
+/*
+Which quirk profile each ROM needs, keyed by Chip8::RomHash(), so a mixed
+catalogue runs every ROM with its own. The file format is one ROM per line,
+"<hash> <profile>" with the hash as eight hex digits; anything after the
+profile, such as the ROM's name, and lines starting with '#' are ignored.
+`CHIP8 --rom-hash` prints the hash of each ROM it is given.
+*/
+class QuirkDatabase
+{
+public:
+    // Add the entries of a file to any already loaded; false, adding
+    // nothing, if it cannot be read or a line does not parse.
+    bool Load(const char* filename);
+    void Add(uint32_t romHash, QuirkProfile profile);
+    // Use profile for every ROM, listed or not, e.g. for --quirks.
+    void Force(QuirkProfile profile);
+
+    // The forced profile, else the ROM's entry, else Default.
+    QuirkProfile Find(uint32_t romHash) const;
+    size_t Size() const { return profiles.size(); }
+
+private:
+    std::unordered_map<uint32_t, QuirkProfile> profiles;
+    bool forced = false;
+    QuirkProfile forcedProfile = QuirkProfile::Default;
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "chip8.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+/*
+Fixed-budget history of machine states for rewinding. Every pushed frame is
+a raw save state; most are stored as an XOR against the last keyframe with
+runs of zeros collapsed, so a frame that only touched a few bytes costs a
+few bytes. A full keyframe is stored every keyframeInterval frames. When the
+budget is exhausted the oldest keyframe is dropped together with the deltas
+that depend on it.
+*/
+class Rewind
+{
+public:
+    explicit Rewind(size_t budgetBytes, uint32_t keyframeInterval = 60);
+
+    // Record the machine as it is at the end of a frame.
+    void Push(const Chip8& chip8);
+    // Restore the frame before the newest one and discard the newest, so
+    // emulation continues from the restored point. False when empty.
+    bool StepBack(Chip8& chip8);
+    // Restore the state from framesAgo frames before the newest without
+    // discarding anything, for scrubbing back and forth.
+    bool Seek(Chip8& chip8, size_t framesAgo);
+
+    size_t Frames() const { return entries.size(); }
+    size_t BytesUsed() const { return used; }
+    // Average storage per second of history at 60 frames per second.
+    double BytesPerSecond() const;
+    double SecondsStored() const;
+
+private:
+    struct Entry
+    {
+        size_t offset;
+        size_t size;
+        size_t stateSize; // raw size; SetQuirks() can change it
+        bool keyframe;
+    };
+
+    bool MakeRoom(size_t size);
+    void EvictOldest();
+    bool Decode(size_t entry, std::vector<uint8_t>& state) const;
+
+    std::vector<uint8_t> ring;
+    size_t head = 0; // where the next entry is written
+    size_t used = 0;
+    uint32_t keyframeInterval;
+    uint32_t sinceKeyframe = 0;
+    std::deque<Entry> entries;
+
+    std::vector<uint8_t> keyframe; // raw state of the newest keyframe
+    std::vector<uint8_t> current;
+    std::vector<uint8_t> encoded;
+};
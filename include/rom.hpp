@@ -0,0 +1,73 @@
+#pragma once
+
+#include "chip8.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+A validated, immutable ROM shared by every machine that loads it. Images
+opened from a file are mapped read-only rather than read, so the file must
+not be rewritten while in use. A machine initializes its memory from an
+image with a single bulk copy.
+*/
+class RomImage
+{
+public:
+    // Everything from 0x200 to the end of XO-CHIP's 64 KB. A machine
+    // takes only what Chip8::RomCapacity() allows for its profile.
+    static const size_t MAX_SIZE = XO_MEMORY_SIZE - START_ADDRESS;
+
+    /*
+    Both return nullptr when the file cannot be read, is empty, or is over
+    MAX_SIZE. Mapping a file this small costs a few microseconds more than
+    reading it, which only pays off for an image many machines share, so
+    RomCache maps and a one-off Chip8::LoadROM(filename) reads.
+    */
+    static std::shared_ptr<const RomImage> MapFile(const char* filename);
+    static std::shared_ptr<const RomImage> ReadFile(const char* filename);
+    // Copies size bytes from data; nullptr under the same rules.
+    static std::shared_ptr<const RomImage> FromMemory(const uint8_t* data,
+                                                      size_t size);
+
+    ~RomImage();
+    RomImage(const RomImage&) = delete;
+    RomImage& operator=(const RomImage&) = delete;
+
+    const uint8_t* Data() const { return data; }
+    size_t Size() const { return size; }
+    // FNV-1a of the contents.
+    uint32_t Hash() const { return hash; }
+
+    // The hash reported for a machine with no ROM loaded.
+    static const uint32_t EMPTY_HASH = 0x811C9DC5u;
+
+private:
+    RomImage() = default;
+    void Seal();
+
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    uint32_t hash = EMPTY_HASH;
+    void* mapping = nullptr; // unmapped on destruction when set
+    std::vector<uint8_t> owned;
+};
+
+/*
+Opens each ROM file once, however many machines load it; later requests for
+the same path share the first image. Failures are remembered too. Safe to use
+from several threads.
+*/
+class RomCache
+{
+public:
+    std::shared_ptr<const RomImage> Get(const std::string& filename);
+
+private:
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<const RomImage>> images;
+};
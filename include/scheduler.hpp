@@ -0,0 +1,56 @@
+#pragma once
+
+#include "chip8.hpp"
+#include "input.hpp"
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+const uint32_t FRAME_RATE = 60;
+
+/*
+Paces emulation in 60 Hz frames. Each frame runs a fixed number of
+instructions and ticks the timers once; the caller presents whatever the
+frame drew and then sleeps until the next frame is due. Frames can also be
+paced faster than real time; the timers still tick once per frame, so the
+program sees the same 60 Hz either way.
+*/
+class Scheduler
+{
+public:
+    explicit Scheduler(uint32_t instructionsPerFrame);
+
+    // Run one frame's worth of instructions, then tick the timers. Each
+    // event changes the keypad right before its cycle, counted from the
+    // start of the frame.
+    void RunFrame(Chip8& chip8, const std::vector<InputEvent>& events = {});
+    // Sleep until the next frame boundary, or not at all when uncapped. If
+    // emulation has fallen more than a few frames behind, the schedule is
+    // reset instead of bursting to catch up.
+    void WaitForNextFrame();
+
+    uint32_t InstructionsPerFrame() const { return instructionsPerFrame; }
+    uint64_t Frames() const { return frames; }
+
+    // Run frames at speed times real time, or as fast as possible for 0.
+    void SetSpeed(double speed);
+    double Speed() const { return speed; }
+    // Emulated seconds per wall-clock second since the last SetSpeed().
+    double MeasuredSpeed() const;
+
+    // Instructions per frame for a per-instruction delay in milliseconds,
+    // the unit the command line has always used.
+    static uint32_t FromCycleDelay(float cycleDelay);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    uint32_t instructionsPerFrame;
+    uint64_t frames = 0;
+    Clock::duration framePeriod;
+    Clock::time_point nextFrame;
+    double speed = 1.0;
+    Clock::duration period;
+    Clock::time_point speedSince;
+    uint64_t framesSince = 0;
+};
@@ -0,0 +1,147 @@
+#pragma once
+
+#include "quirks.hpp"
+#include "rom.hpp"
+#include "thread_pool.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+Wire protocol between Server and RunClient(), over a Unix domain stream
+socket. Every message is a 32-bit little-endian length, counting the type
+byte and the payload, followed by a one-byte type and the payload.
+
+Client to server:
+    'O' open      u32 seed, u32 instructions per frame, ROM path (the rest)
+    'K' key       u8 key 0-F, u8 down 1 or 0
+    'S' stats     nothing
+Server to client:
+    'R' ready     u32 ROM hash; frames follow, 60 per second
+    'E' error     message text; the connection stays open
+    'F' frame     u64 frame number, then the frame as a DeltaEncoder
+                  packet; the first is a keyframe, and so is one after
+                  frames were skipped for a slow client
+    'T' stats     JSON text
+A connection hosts at most one machine, opened once; stats can be asked for
+on any connection, with or without a machine.
+*/
+namespace ServerProtocol
+{
+const uint8_t OPEN = 'O';
+const uint8_t KEY = 'K';
+const uint8_t STATS = 'S';
+const uint8_t READY = 'R';
+const uint8_t FAILED = 'E';
+const uint8_t FRAME = 'F';
+const uint8_t STATS_REPLY = 'T';
+
+const size_t HEADER_SIZE = 5;
+// Largest message either side accepts.
+const uint32_t MAX_MESSAGE = 64 * 1024;
+} // namespace ServerProtocol
+
+struct ServerOptions
+{
+    unsigned threads = 0; // emulation workers; 0 = one per hardware thread
+    // A client more than this many bytes behind is skipped until it catches
+    // up, then sent a whole frame.
+    size_t maxBacklog = 256 * 1024;
+    QuirkDatabase quirks; // each opened ROM runs under its profile
+};
+
+/*
+Hosts many machines in one process, one per client connection. A single
+thread runs an epoll loop over the listening socket, every connection, a
+60 Hz timer and SIGINT/SIGTERM; on every timer tick it runs one frame of
+every machine on a worker pool, waits for them, and queues each machine's
+frame delta to its client. Sockets never block: a slow client falls
+behind on its own without holding up the others. Only built on Linux; on
+other systems Listen() fails.
+*/
+class Server
+{
+public:
+    explicit Server(const ServerOptions& options);
+    ~Server();
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+
+    // Bind and listen on socketPath, replacing a stale socket file there.
+    bool Listen(const char* socketPath);
+    // Serve until SIGINT or SIGTERM, then close every connection and
+    // remove the socket file.
+    void Run();
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Session; // a machine and its frame pacing and key queue
+    struct Connection
+    {
+        int fd;
+        std::vector<uint8_t> in;
+        std::vector<uint8_t> out;
+        size_t sent = 0;      // bytes of out already written
+        bool writing = false; // waiting for the socket to take more
+        std::unique_ptr<Session> session;
+    };
+
+    void Accept();
+    // These return false when the connection must be closed.
+    bool Receive(Connection& connection);
+    bool Handle(Connection& connection, uint8_t type, const uint8_t* payload,
+                size_t size);
+    bool Flush(Connection& connection);
+    void Close(int fd);
+    void Tick();
+    std::string Stats() const;
+
+    ServerOptions options;
+    std::string socketPath;
+    int listenFd = -1;
+    int epollFd = -1;
+    int timerFd = -1;
+    int signalFd = -1;
+    std::unique_ptr<ThreadPool> pool;
+    RomCache roms;
+    std::unordered_map<int, std::unique_ptr<Connection>> connections;
+    // Connections with a machine, rebuilt on the next tick after one opens
+    // or closes.
+    std::vector<Connection*> active;
+    bool activeChanged = false;
+
+    Clock::time_point started;
+    uint64_t ticks = 0;
+    uint64_t lateTicks = 0; // timer expirations missed while busy
+    uint64_t sessionFrames = 0;
+    std::atomic<uint64_t> emulationNanoseconds{0}; // summed over workers
+    uint64_t outputNanoseconds = 0;
+};
+
+struct ClientOptions
+{
+    std::string rom; // path as the server sees it
+    unsigned sessions = 1;
+    uint64_t frames = 600; // per session
+    uint32_t seed = 1;
+    uint32_t instructionsPerFrame = 10;
+    std::string input; // input script, sent as frames go by; optional
+};
+
+/*
+Test client: opens options.sessions machines on the server at socketPath,
+sends the input script's key events as the frames they fall in arrive,
+decodes the frame deltas, and prints one CSV line per
+session once it has received options.frames frames.
+*/
+bool RunClient(const char* socketPath, const ClientOptions& options,
+               std::ostream& out);
+// Ask the server for its stats and print them.
+bool RunStatsClient(const char* socketPath, std::ostream& out);
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+/*
+Bounded lock-free queue for exactly one producer thread and one consumer
+thread. Neither side blocks: TryPush() fails when the queue is full and
+TryPop() when it is empty. Capacity must be a power of two.
+*/
+template <typename T, size_t Capacity>
+class SpscQueue
+{
+    static_assert(Capacity && !(Capacity & (Capacity - 1)),
+                  "Capacity must be a power of two");
+
+public:
+    // Producer.
+    bool TryPush(const T& item)
+    {
+        size_t position = tail.load(std::memory_order_relaxed);
+        if (position - headSeen == Capacity)
+        {
+            headSeen = head.load(std::memory_order_acquire);
+            if (position - headSeen == Capacity)
+            {
+                return false;
+            }
+        }
+        items[position & MASK] = item;
+        tail.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer.
+    bool TryPop(T& item)
+    {
+        size_t position = head.load(std::memory_order_relaxed);
+        if (position == tailSeen)
+        {
+            tailSeen = tail.load(std::memory_order_acquire);
+            if (position == tailSeen)
+            {
+                return false;
+            }
+        }
+        item = items[position & MASK];
+        head.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    static const size_t MASK = Capacity - 1;
+
+    T items[Capacity]{};
+    // Each side keeps its own index and a possibly stale copy of the
+    // other's, on separate cache lines, and rereads the other only when
+    // the stale copy says full or empty.
+    alignas(64) std::atomic<size_t> head{0};
+    size_t tailSeen = 0;
+    alignas(64) std::atomic<size_t> tail{0};
+    size_t headSeen = 0;
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+Work-stealing thread pool. Every worker owns a deque of tasks: it pops from
+the back of its own deque and, once that is empty, steals from the front of
+the other workers' deques. Tasks are distributed round-robin on submission so
+long-running instances on one worker are balanced out by the others stealing.
+*/
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned threadCount);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void Submit(std::function<void()> task);
+    // Block until every submitted task has finished running.
+    void Wait();
+    unsigned Size() const { return static_cast<unsigned>(threads.size()); }
+
+private:
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    void WorkerLoop(unsigned id);
+    bool PopLocal(unsigned id, std::function<void()>& task);
+    bool Steal(unsigned id, std::function<void()>& task);
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> nextQueue{0};
+    std::atomic<size_t> queued{0};
+    std::atomic<size_t> pending{0};
+    std::mutex sleepLock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    bool stopping = false;
+};
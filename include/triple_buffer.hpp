@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+/*
+Lock-free handoff of the latest value from one writer thread to one reader
+thread. The writer fills Back() and publishes it; the reader takes whatever
+was published last. Three slots mean neither side ever waits: the writer
+always has a slot of its own, the reader keeps the one it is using, and
+the third holds the newest published value. Values the reader never got to
+are overwritten, which is what a renderer wants from an emulator.
+*/
+template <typename T>
+class TripleBuffer
+{
+public:
+    // Writer: the slot to fill next.
+    T& Back() { return slots[back].value; }
+    // Writer: make Back() the latest value and get a fresh slot.
+    void Publish()
+    {
+        back = middle.exchange(back | FRESH, std::memory_order_acq_rel) &
+               INDEX;
+    }
+
+    // Reader: true if something was published since the last call, which
+    // Front() then holds.
+    bool Acquire()
+    {
+        if (!(middle.load(std::memory_order_relaxed) & FRESH))
+        {
+            return false;
+        }
+        front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+        return true;
+    }
+    // Reader: the value taken by the last successful Acquire().
+    const T& Front() const { return slots[front].value; }
+
+private:
+    static const uint8_t INDEX = 0x3;
+    static const uint8_t FRESH = 0x4;
+
+    // Slots on their own cache lines, so the two threads never share one
+    struct alignas(64) Slot
+    {
+        T value{};
+    };
+
+    Slot slots[3];
+    alignas(64) std::atomic<uint8_t> middle{1};
+    alignas(64) uint8_t back = 0;
+    alignas(64) uint8_t front = 2;
+};
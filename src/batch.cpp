@@ -0,0 +1,209 @@
+#include "batch.hpp"
+#include "jit.hpp"
+#include "machine_pool.hpp"
+#include "rom.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+
+namespace
+{
+uint64_t HashBytes(uint64_t hash, const void* data, size_t size)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ull;
+    }
+    return hash;
+}
+} // namespace
+
+bool LoadInputScript(const char* filename, InputScript& script)
+{
+    std::ifstream file(filename);
+    if (!file.is_open())
+    {
+        return false;
+    }
+
+    script.name = filename;
+    script.events.clear();
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+        std::istringstream fields(line);
+        uint64_t cycle;
+        unsigned key;
+        unsigned down;
+        if (!(fields >> cycle >> std::hex >> key >> std::dec >> down) ||
+            key > 0xF)
+        {
+            return false;
+        }
+        script.events.push_back({cycle, static_cast<uint8_t>(key),
+                                 static_cast<uint8_t>(down != 0)});
+    }
+
+    std::stable_sort(script.events.begin(), script.events.end(),
+                     [](const InputEvent& a, const InputEvent& b) {
+                         return a.cycle < b.cycle;
+                     });
+    return true;
+}
+
+uint64_t HashVideo(const uint64_t video[VIDEO_HEIGHT])
+{
+    return HashBytes(0xCBF29CE484222325ull, video,
+                     VIDEO_HEIGHT * sizeof(uint64_t));
+}
+
+/*
+FNV-1a over the framebuffer, continued over the planes of the extended
+display when there is one. Cheap enough to run per instance and stable
+across runs, so two builds can be compared by their result lines alone.
+*/
+uint64_t HashVideo(const Chip8& chip8)
+{
+    uint64_t hash = HashVideo(chip8.video);
+    if (const ExtendedDisplay* extended = chip8.Extended())
+    {
+        hash = HashBytes(hash, extended->rows, sizeof(extended->rows));
+    }
+    return hash;
+}
+
+BatchResult RunHeadless(Chip8& chip8, const InputScript& script,
+                        uint64_t cycles, uint32_t cyclesPerFrame, bool useJit,
+                        const FrameHook& onFrame)
+{
+    BatchResult result;
+    result.loaded = true;
+
+    std::unique_ptr<Jit> jit;
+    if (useJit && Jit::Available())
+    {
+        jit.reset(new Jit(chip8));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    size_t next = 0;
+    uint64_t cycle = 0;
+    while (cycle < cycles)
+    {
+        while (next < script.events.size() &&
+               script.events[next].cycle <= cycle)
+        {
+            chip8.keypad[script.events[next].key] = script.events[next].down;
+            ++next;
+        }
+
+        // Run straight through to the next scripted key change or frame
+        // boundary, whichever comes first.
+        uint64_t frameEnd = (cycle / cyclesPerFrame + 1) * cyclesPerFrame;
+        uint64_t until = std::min(cycles, frameEnd);
+        if (next < script.events.size())
+        {
+            until = std::min(until, script.events[next].cycle);
+        }
+        uint64_t slice = std::min<uint64_t>(until - cycle, UINT32_MAX);
+        if (jit)
+        {
+            jit->Run(static_cast<uint32_t>(slice));
+        }
+        else
+        {
+            chip8.Run(static_cast<uint32_t>(slice));
+        }
+        cycle += slice;
+        if (cycle == frameEnd)
+        {
+            chip8.TickTimers();
+            if (onFrame)
+            {
+                onFrame(chip8);
+            }
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    result.cycles = cycles;
+    result.pc = chip8.ProgramCounter();
+    result.videoHash = HashVideo(chip8);
+    result.nanoseconds =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+            .count();
+    return result;
+}
+
+std::vector<BatchResult> RunBatch(const std::vector<BatchJob>& jobs,
+                                  const BatchOptions& options)
+{
+    std::vector<BatchResult> results(jobs.size());
+    uint64_t budget = options.cycles
+                          ? options.cycles
+                          : options.frames * options.cyclesPerFrame;
+
+    unsigned threads = options.threads;
+    if (threads == 0)
+    {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // Every instance of a ROM shares one mapped image, and the instances
+    // come from a pool per ROM with a machine for each worker, so a job
+    // starts with a Reset() instead of a construction and a load
+    RomCache roms;
+    ThreadPool pool(threads);
+    std::map<std::string, std::unique_ptr<MachinePool>> machines;
+    for (const BatchJob& job : jobs)
+    {
+        if (machines.count(*job.rom))
+        {
+            continue;
+        }
+        // A ROM that cannot be loaded, or is too large for its profile, gets
+        // no pool; its jobs stay unloaded
+        std::shared_ptr<const RomImage> rom = roms.Get(*job.rom);
+        QuirkProfile quirks =
+            rom ? options.quirks.Find(rom->Hash()) : QuirkProfile::Default;
+        machines[*job.rom].reset(
+            rom && rom->Size() <= Chip8::RomCapacity(quirks)
+                ? new MachinePool(rom, pool.Size(), quirks)
+                : nullptr);
+    }
+    for (size_t i = 0; i < jobs.size(); ++i)
+    {
+        bool useJit = options.jit;
+        uint32_t cyclesPerFrame = std::max(1u, options.cyclesPerFrame);
+        MachinePool* machinePool = machines[*jobs[i].rom].get();
+        pool.Submit([&jobs, &results, machinePool, budget, cyclesPerFrame,
+                     useJit, i] {
+            const BatchJob& job = jobs[i];
+            // Each task owns its machine outright until it is released;
+            // nothing is shared between running instances except the
+            // read-only job description.
+            Chip8* chip8 = machinePool ? machinePool->Acquire(job.seed)
+                                       : nullptr;
+            if (!chip8)
+            {
+                return;
+            }
+            results[i] = RunHeadless(*chip8, *job.script, budget,
+                                     cyclesPerFrame, useJit);
+            machinePool->Release(chip8);
+        });
+    }
+    pool.Wait();
+    return results;
+}
@@ -0,0 +1,380 @@
+#include "capture.hpp"
+#include <algorithm>
+#include <cstdio>
+
+namespace
+{
+const uint8_t Y4M_ON = 0xFF;
+const uint8_t Y4M_OFF = 0x00;
+
+bool EndsWith(const std::string& text, const char* suffix)
+{
+    size_t length = std::char_traits<char>::length(suffix);
+    return text.size() >= length &&
+           text.compare(text.size() - length, length, suffix) == 0;
+}
+
+void PutBE(std::vector<uint8_t>& out, uint32_t value)
+{
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        out.push_back((value >> shift) & 0xFFu);
+    }
+}
+
+uint32_t Crc32(const uint8_t* data, size_t size)
+{
+    static const std::array<uint32_t, 256> table = []
+    {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t n = 0; n < 256; ++n)
+        {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k)
+            {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[n] = c;
+        }
+        return t;
+    }();
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; ++i)
+    {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+uint32_t Adler32(const uint8_t* data, size_t size)
+{
+    uint32_t a = 1;
+    uint32_t b = 0;
+    for (size_t i = 0; i < size; ++i)
+    {
+        a = (a + data[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    return (b << 16) | a;
+}
+
+void PutChunk(std::vector<uint8_t>& out, const char* type,
+              const std::vector<uint8_t>& data)
+{
+    PutBE(out, static_cast<uint32_t>(data.size()));
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data.begin(), data.end());
+    PutBE(out, Crc32(&out[start], out.size() - start));
+}
+
+// Deflate bit stream, least significant bit first.
+struct BitWriter
+{
+    std::vector<uint8_t>& out;
+    uint32_t bits = 0;
+    unsigned int count = 0;
+
+    void Put(uint32_t value, unsigned int width)
+    {
+        bits |= value << count;
+        count += width;
+        while (count >= 8)
+        {
+            out.push_back(bits & 0xFF);
+            bits >>= 8;
+            count -= 8;
+        }
+    }
+
+    // Huffman codes go in most significant bit first.
+    void PutCode(uint32_t code, unsigned int width)
+    {
+        uint32_t reversed = 0;
+        for (unsigned int i = 0; i < width; ++i)
+        {
+            reversed |= ((code >> i) & 1) << (width - 1 - i);
+        }
+        Put(reversed, width);
+    }
+
+    void Flush()
+    {
+        if (count)
+        {
+            out.push_back(bits & 0xFF);
+        }
+        bits = 0;
+        count = 0;
+    }
+};
+
+// Literal/length symbol in the fixed Huffman code of RFC 1951.
+void PutSymbol(BitWriter& bits, unsigned int symbol)
+{
+    if (symbol < 144)
+    {
+        bits.PutCode(0x30 + symbol, 8);
+    }
+    else if (symbol < 256)
+    {
+        bits.PutCode(0x190 + symbol - 144, 9);
+    }
+    else if (symbol < 280)
+    {
+        bits.PutCode(symbol - 256, 7);
+    }
+    else
+    {
+        bits.PutCode(0xC0 + symbol - 280, 8);
+    }
+}
+
+void PutMatch(BitWriter& bits, unsigned int length, unsigned int distance)
+{
+    static const uint16_t LENGTH_BASE[29] = {
+        3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+        31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const uint8_t LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                             1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                             4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const uint16_t DISTANCE_BASE[30] = {
+        1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+        33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+        1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+    static const uint8_t DISTANCE_EXTRA[30] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+        6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+    unsigned int l = 28;
+    while (LENGTH_BASE[l] > length)
+    {
+        --l;
+    }
+    PutSymbol(bits, 257 + l);
+    bits.Put(length - LENGTH_BASE[l], LENGTH_EXTRA[l]);
+
+    unsigned int d = 29;
+    while (DISTANCE_BASE[d] > distance)
+    {
+        --d;
+    }
+    bits.PutCode(d, 5);
+    bits.Put(distance - DISTANCE_BASE[d], DISTANCE_EXTRA[d]);
+}
+
+/*
+A zlib stream of data in one fixed-Huffman deflate block. Scaled frames are
+made of repeats, so the only matches looked for are the two that cover
+nearly everything: a copy of the scanline above, and a run of the previous
+byte. That is a single pass with no hash table, and shrinks a frame to a
+few hundred bytes.
+*/
+void Deflate(const std::vector<uint8_t>& data, size_t stride,
+             std::vector<uint8_t>& out)
+{
+    const size_t MAX_LENGTH = 258;
+    const size_t MAX_DISTANCE = 32768;
+
+    out.push_back(0x78); // deflate, 32 KB window
+    out.push_back(0x01); // no dictionary, fastest; checksum of the two
+    BitWriter bits{out};
+    bits.Put(1, 1); // final block
+    bits.Put(1, 2); // fixed Huffman codes
+
+    size_t size = data.size();
+    for (size_t at = 0; at < size;)
+    {
+        size_t limit = std::min(MAX_LENGTH, size - at);
+        size_t above = 0;
+        if (at >= stride && stride <= MAX_DISTANCE)
+        {
+            while (above < limit &&
+                   data[at + above] == data[at + above - stride])
+            {
+                ++above;
+            }
+        }
+        size_t run = 0;
+        if (at >= 1)
+        {
+            while (run < limit && data[at + run] == data[at - 1])
+            {
+                ++run;
+            }
+        }
+
+        if (above >= 3 && above >= run)
+        {
+            PutMatch(bits, above, stride);
+            at += above;
+        }
+        else if (run >= 3)
+        {
+            PutMatch(bits, run, 1);
+            at += run;
+        }
+        else
+        {
+            PutSymbol(bits, data[at++]);
+        }
+    }
+    PutSymbol(bits, 256); // end of block
+    bits.Flush();
+    PutBE(out, Adler32(data.data(), data.size()));
+}
+} // namespace
+
+FrameCapture::FrameCapture(const std::string& fileName, unsigned int scale)
+    : fileName(fileName), scale(scale), png(!EndsWith(fileName, ".y4m"))
+{
+    if (scale == 0 || scale > MAX_SCALE ||
+        !(EndsWith(fileName, ".y4m") || EndsWith(fileName, ".png")))
+    {
+        failed = true;
+        return;
+    }
+    if (!png)
+    {
+        y4m.open(fileName, std::ios::binary);
+        y4m << "YUV4MPEG2 W" << VIDEO_WIDTH * scale << " H"
+            << VIDEO_HEIGHT * scale << " F60:1 Ip A1:1 Cmono\n";
+        if (!y4m)
+        {
+            failed = true;
+            return;
+        }
+    }
+    writer = std::thread(&FrameCapture::WriterLoop, this);
+}
+
+FrameCapture::~FrameCapture()
+{
+    Finish();
+}
+
+void FrameCapture::Frame(const uint64_t* video)
+{
+    if (!writer.joinable())
+    {
+        return;
+    }
+    Rows rows;
+    std::copy(video, video + VIDEO_HEIGHT, rows.begin());
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        queue.push_back(rows);
+    }
+    wake.notify_one();
+    ++frames;
+}
+
+bool FrameCapture::Finish()
+{
+    if (writer.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            finishing = true;
+        }
+        wake.notify_one();
+        writer.join();
+        if (y4m.is_open())
+        {
+            y4m.close();
+            failed = failed || y4m.fail();
+        }
+    }
+    return !failed;
+}
+
+// Takes everything queued at once, so the lock is held once per batch.
+void FrameCapture::WriterLoop()
+{
+    std::deque<Rows> batch;
+    uint64_t written = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [this] { return finishing || !queue.empty(); });
+            if (queue.empty())
+            {
+                return;
+            }
+            batch.swap(queue);
+        }
+        for (const Rows& rows : batch)
+        {
+            bool ok = png ? WritePng(rows, written) : WriteY4m(rows);
+            failed = failed || !ok;
+            ++written;
+        }
+        batch.clear();
+    }
+}
+
+bool FrameCapture::WriteY4m(const Rows& rows)
+{
+    size_t width = VIDEO_WIDTH * scale;
+    buffer.resize(width);
+    y4m << "FRAME\n";
+    for (unsigned int y = 0; y < VIDEO_HEIGHT; ++y)
+    {
+        for (unsigned int x = 0; x < VIDEO_WIDTH; ++x)
+        {
+            bool on = (rows[y] >> (63 - x)) & 1;
+            std::fill_n(&buffer[x * scale], scale, on ? Y4M_ON : Y4M_OFF);
+        }
+        for (unsigned int repeat = 0; repeat < scale; ++repeat)
+        {
+            y4m.write(reinterpret_cast<const char*>(buffer.data()), width);
+        }
+    }
+    return y4m.good();
+}
+
+bool FrameCapture::WritePng(const Rows& rows, uint64_t number)
+{
+    uint32_t width = VIDEO_WIDTH * scale;
+    uint32_t height = VIDEO_HEIGHT * scale;
+    size_t stride = 1 + (width + 7) / 8; // filter byte, then the pixels
+
+    // Scanlines with filter type 0, one bit per pixel, MSB leftmost.
+    buffer.assign(stride * height, 0);
+    for (unsigned int y = 0; y < VIDEO_HEIGHT; ++y)
+    {
+        uint8_t* line = &buffer[y * scale * stride];
+        for (uint32_t x = 0; x < width; ++x)
+        {
+            if ((rows[y] >> (63 - x / scale)) & 1)
+            {
+                line[1 + x / 8] |= 0x80 >> (x % 8);
+            }
+        }
+        for (unsigned int repeat = 1; repeat < scale; ++repeat)
+        {
+            std::copy(line, line + stride, line + repeat * stride);
+        }
+    }
+
+    std::vector<uint8_t> file = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    std::vector<uint8_t> chunk;
+    PutBE(chunk, width);
+    PutBE(chunk, height);
+    chunk.insert(chunk.end(), {1, 0, 0, 0, 0}); // 1-bit grayscale
+    PutChunk(file, "IHDR", chunk);
+    chunk.clear();
+    Deflate(buffer, stride, chunk);
+    PutChunk(file, "IDAT", chunk);
+    PutChunk(file, "IEND", {});
+
+    size_t dot = fileName.size() - 4;
+    char suffix[32];
+    std::snprintf(suffix, sizeof(suffix), "_%06llu.png",
+                  static_cast<unsigned long long>(number));
+    std::string name = fileName.substr(0, dot) + suffix;
+    std::ofstream out(name, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(file.data()), file.size());
+    return out.good();
+}
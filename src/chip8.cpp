@@ -1,6 +1,13 @@
 #include "chip8.hpp"
-
-uint8_t fontset[FONTSET_SIZE] = {
+#include "profiler.hpp"
+#include "rom.hpp"
+#include <algorithm>
+#include <iterator>
+#include <utility>
+
+// Shared read-only font data, copied into each instance's memory on
+// construction so no machine ever writes to state it does not own.
+static const uint8_t fontset[FONTSET_SIZE] = {
     0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
     0x20, 0x60, 0x20, 0x20, 0x70, // 1
     0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
@@ -19,8 +26,275 @@ uint8_t fontset[FONTSET_SIZE] = {
     0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
-Chip8::Chip8()
-    : randGen(std::chrono::system_clock::now().time_since_epoch().count())
+// SUPER-CHIP's 8x10 digits, with XO-CHIP's A-F after them.
+static const uint8_t bigFontset[BIG_FONTSET_SIZE] = {
+    0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C, // 0
+    0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, // 1
+    0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF, // 2
+    0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C, // 3
+    0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06, // 4
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C, // 5
+    0x3E, 0x7C, 0xC0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C, // 6
+    0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60, // 7
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C, // 8
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C, // 9
+    0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+    0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+    0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  // F
+};
+
+/*
+Compile-time quirk policies, one per QuirkProfile. The OP_* templates read
+them with if constexpr, so every profile gets its own copy of the handlers
+that differ, with the choice compiled in rather than tested per instruction.
+EXTENDED turns on the SUPER-CHIP display and instructions, XO_CHIP the
+XO-CHIP ones on top.
+*/
+namespace
+{
+enum class LoadStoreIndex
+{
+    Unchanged,
+    PlusX,
+    PlusXPlusOne
+};
+
+struct DefaultQuirks
+{
+    static constexpr bool SHIFT_READS_VY = false;
+    static constexpr bool SHIFT_FLAG_FIRST = true;
+    static constexpr LoadStoreIndex LOAD_STORE_INDEX =
+        LoadStoreIndex::Unchanged;
+    static constexpr bool JUMP_ADDS_VX = false;
+    static constexpr bool CLIP_SPRITES = false;
+    static constexpr bool EXTENDED = false;
+    static constexpr bool XO_CHIP = false;
+};
+
+struct Chip8Quirks
+{
+    static constexpr bool SHIFT_READS_VY = true;
+    static constexpr bool SHIFT_FLAG_FIRST = false;
+    static constexpr LoadStoreIndex LOAD_STORE_INDEX =
+        LoadStoreIndex::PlusXPlusOne;
+    static constexpr bool JUMP_ADDS_VX = false;
+    static constexpr bool CLIP_SPRITES = true;
+    static constexpr bool EXTENDED = false;
+    static constexpr bool XO_CHIP = false;
+};
+
+struct Chip48Quirks
+{
+    static constexpr bool SHIFT_READS_VY = false;
+    static constexpr bool SHIFT_FLAG_FIRST = false;
+    static constexpr LoadStoreIndex LOAD_STORE_INDEX =
+        LoadStoreIndex::PlusX;
+    static constexpr bool JUMP_ADDS_VX = true;
+    static constexpr bool CLIP_SPRITES = true;
+    static constexpr bool EXTENDED = false;
+    static constexpr bool XO_CHIP = false;
+};
+
+struct SuperChipQuirks
+{
+    static constexpr bool SHIFT_READS_VY = false;
+    static constexpr bool SHIFT_FLAG_FIRST = false;
+    static constexpr LoadStoreIndex LOAD_STORE_INDEX =
+        LoadStoreIndex::Unchanged;
+    static constexpr bool JUMP_ADDS_VX = true;
+    static constexpr bool CLIP_SPRITES = true;
+    static constexpr bool EXTENDED = true;
+    static constexpr bool XO_CHIP = false;
+};
+
+struct XoChipQuirks
+{
+    static constexpr bool SHIFT_READS_VY = true;
+    static constexpr bool SHIFT_FLAG_FIRST = false;
+    static constexpr LoadStoreIndex LOAD_STORE_INDEX =
+        LoadStoreIndex::PlusXPlusOne;
+    static constexpr bool JUMP_ADDS_VX = false;
+    static constexpr bool CLIP_SPRITES = false;
+    static constexpr bool EXTENDED = true;
+    static constexpr bool XO_CHIP = true;
+};
+
+// I after Fx55 or Fx65 moved V0 through Vx.
+template <typename Quirks>
+uint16_t IndexAfterLoadStore(uint16_t index, uint8_t x)
+{
+    switch (Quirks::LOAD_STORE_INDEX)
+    {
+        case LoadStoreIndex::PlusX:
+            return index + x;
+        case LoadStoreIndex::PlusXPlusOne:
+            return index + x + 1;
+        default:
+            return index;
+    }
+}
+
+// Each of the low 16 bits twice, for sprites drawn in lores.
+uint32_t Widen(uint32_t bits)
+{
+    bits = (bits | bits << 8u) & 0x00FF00FFu;
+    bits = (bits | bits << 4u) & 0x0F0F0F0Fu;
+    bits = (bits | bits << 2u) & 0x33333333u;
+    bits = (bits | bits << 1u) & 0x55555555u;
+    return bits | bits << 1u;
+}
+
+// Shift and rotate a 128-pixel row held as two words, high word first.
+void ShiftRight(uint64_t& high, uint64_t& low, unsigned int count)
+{
+    if (count >= 64)
+    {
+        low = high >> (count - 64);
+        high = 0;
+    }
+    else if (count > 0)
+    {
+        low = (low >> count) | (high << (64 - count));
+        high >>= count;
+    }
+}
+
+void RotateRight(uint64_t& high, uint64_t& low, unsigned int count)
+{
+    if (count >= 64)
+    {
+        std::swap(high, low);
+        count -= 64;
+    }
+    if (count > 0)
+    {
+        uint64_t carry = low << (64 - count);
+        low = (low >> count) | (high << (64 - count));
+        high = (high >> count) | carry;
+    }
+}
+} // namespace
+
+template <typename Quirks>
+constexpr Chip8::HandlerTable Chip8::MakeHandlers()
+{
+    // Classes a profile never decodes to get OP_NULL
+    constexpr bool EXTENDED = Quirks::EXTENDED;
+    constexpr bool XO = Quirks::XO_CHIP;
+    return {
+        &Thunk<&Chip8::OP_00E0<Quirks>>, &Thunk<&Chip8::OP_00EE>,
+        &Thunk<&Chip8::OP_1nnn>, &Thunk<&Chip8::OP_2nnn>,
+        &Thunk<&Chip8::OP_3xkk<Quirks>>, &Thunk<&Chip8::OP_4xkk<Quirks>>,
+        &Thunk<&Chip8::OP_5xy0<Quirks>>, &Thunk<&Chip8::OP_6xkk>,
+        &Thunk<&Chip8::OP_7xkk>, &Thunk<&Chip8::OP_8xy0>,
+        &Thunk<&Chip8::OP_8xy1>, &Thunk<&Chip8::OP_8xy2>,
+        &Thunk<&Chip8::OP_8xy3>, &Thunk<&Chip8::OP_8xy4>,
+        &Thunk<&Chip8::OP_8xy5>, &Thunk<&Chip8::OP_8xy6<Quirks>>,
+        &Thunk<&Chip8::OP_8xy7>, &Thunk<&Chip8::OP_8xyE<Quirks>>,
+        &Thunk<&Chip8::OP_9xy0<Quirks>>, &Thunk<&Chip8::OP_Annn>,
+        &Thunk<&Chip8::OP_Bnnn<Quirks>>, &Thunk<&Chip8::OP_Cxkk>,
+        &Thunk<&Chip8::OP_Dxyn<Quirks>>, &Thunk<&Chip8::OP_Ex9E<Quirks>>,
+        &Thunk<&Chip8::OP_ExA1<Quirks>>, &Thunk<&Chip8::OP_Fx07>,
+        &Thunk<&Chip8::OP_Fx0A>, &Thunk<&Chip8::OP_Fx15>,
+        &Thunk<&Chip8::OP_Fx18>, &Thunk<&Chip8::OP_Fx1E>,
+        &Thunk<&Chip8::OP_Fx29>, &Thunk<&Chip8::OP_Fx33<Quirks>>,
+        &Thunk<&Chip8::OP_Fx55<Quirks>>, &Thunk<&Chip8::OP_Fx65<Quirks>>,
+        &Thunk<EXTENDED ? &Chip8::OP_00Cn : &Chip8::OP_NULL>,
+        &Thunk<XO ? &Chip8::OP_00Dn : &Chip8::OP_NULL>,
+        &Thunk<EXTENDED ? &Chip8::OP_00FB : &Chip8::OP_NULL>,
+        &Thunk<EXTENDED ? &Chip8::OP_00FC : &Chip8::OP_NULL>,
+        &Thunk<EXTENDED ? &Chip8::OP_00FD : &Chip8::OP_NULL>,
+        &Thunk<EXTENDED ? &Chip8::OP_00FE : &Chip8::OP_NULL>,
+        &Thunk<EXTENDED ? &Chip8::OP_00FF : &Chip8::OP_NULL>,
+        &Thunk<XO ? &Chip8::OP_5xy2 : &Chip8::OP_NULL>,
+        &Thunk<XO ? &Chip8::OP_5xy3 : &Chip8::OP_NULL>,
+        &Thunk<XO ? &Chip8::OP_F000 : &Chip8::OP_NULL>,
+        &Thunk<XO ? &Chip8::OP_Fn01 : &Chip8::OP_NULL>,
+        &Thunk<XO ? &Chip8::OP_F002 : &Chip8::OP_NULL>,
+        &Thunk<EXTENDED ? &Chip8::OP_Fx30 : &Chip8::OP_NULL>,
+        &Thunk<XO ? &Chip8::OP_Fx3A : &Chip8::OP_NULL>,
+        &Thunk<EXTENDED ? &Chip8::OP_Fx75 : &Chip8::OP_NULL>,
+        &Thunk<EXTENDED ? &Chip8::OP_Fx85 : &Chip8::OP_NULL>,
+        &Thunk<&Chip8::OP_NULL>};
+}
+
+// In QuirkProfile order
+const Chip8::HandlerTable Chip8::HANDLERS[QUIRK_PROFILE_COUNT] = {
+    MakeHandlers<DefaultQuirks>(), MakeHandlers<Chip8Quirks>(),
+    MakeHandlers<Chip48Quirks>(), MakeHandlers<SuperChipQuirks>(),
+    MakeHandlers<XoChipQuirks>()};
+
+// Spot checks that the table above lines up with OpClass()
+static_assert(Chip8::OpClass(0x00E0) == 0 && Chip8::OpClass(0x5121) == 6 &&
+                  Chip8::OpClass(0x812E) == 17 &&
+                  Chip8::OpClass(0xD125) == 22 &&
+                  Chip8::OpClass(0xF165) == 33 &&
+                  Chip8::OpClass(0x00C1, QuirkProfile::SuperChip) == 34 &&
+                  Chip8::OpClass(0x00FF, QuirkProfile::SuperChip) == 40 &&
+                  Chip8::OpClass(0xF185, QuirkProfile::XoChip) == 49 &&
+                  Chip8::OpClass(0xF166) == Chip8::OP_CLASS_COUNT - 1,
+              "opcode classes out of step with HANDLERS");
+
+/*
+OpClass() of every opcode, generated at compile time. 64 KB of read-only
+data per instruction set replaces a data-dependent switch on the
+single-step path, where Decode() runs on every instruction.
+*/
+namespace
+{
+struct OpClassTable
+{
+    uint8_t of[0x10000];
+};
+
+constexpr OpClassTable MakeOpClassTable(QuirkProfile profile)
+{
+    OpClassTable table{};
+    for (uint32_t opcode = 0; opcode <= 0xFFFF; ++opcode)
+    {
+        table.of[opcode] = Chip8::OpClass(opcode, profile);
+    }
+    return table;
+}
+
+constexpr OpClassTable OP_CLASSES = MakeOpClassTable(QuirkProfile::Default);
+constexpr OpClassTable SUPER_CHIP_OP_CLASSES =
+    MakeOpClassTable(QuirkProfile::SuperChip);
+constexpr OpClassTable XO_CHIP_OP_CLASSES =
+    MakeOpClassTable(QuirkProfile::XoChip);
+
+const uint8_t* OpClassesFor(QuirkProfile profile)
+{
+    switch (profile)
+    {
+        case QuirkProfile::SuperChip:
+            return SUPER_CHIP_OP_CLASSES.of;
+        case QuirkProfile::XoChip:
+            return XO_CHIP_OP_CLASSES.of;
+        default:
+            return OP_CLASSES.of;
+    }
+}
+
+bool IsExtended(QuirkProfile profile)
+{
+    return profile == QuirkProfile::SuperChip ||
+           profile == QuirkProfile::XoChip;
+}
+
+// Bytes of ROM that fit between 0x200 and the end of the first 4 KB.
+const size_t PROGRAM_SIZE = MEMORY_SIZE - START_ADDRESS;
+} // namespace
+
+/*
+The seed is supplied by the caller rather than read from the clock so that
+headless and batch runs are reproducible: two instances built with the same
+seed and fed the same ROM and input execute identically.
+*/
+Chip8::Chip8(uint32_t seed) : opClasses(OP_CLASSES.of), rngState(seed)
 {
     pc = START_ADDRESS;
     // copy the fontset into memory starting at 0x50
@@ -28,103 +302,244 @@ Chip8::Chip8()
     {
         memory[FONTSET_START_ADDRESS + i] = fontset[i];
     }
-    // initialize the random number generator
-    randByte = std::uniform_int_distribution<uint8_t>(0, 255U);
-
-    // Setup function pointer table
-    table[0x0] = &Chip8::Table0;
-    table[0x1] = &Chip8::OP_1nnn;
-    table[0x2] = &Chip8::OP_2nnn;
-    table[0x3] = &Chip8::OP_3xkk;
-    table[0x4] = &Chip8::OP_4xkk;
-    table[0x5] = &Chip8::OP_5xy0;
-    table[0x6] = &Chip8::OP_6xkk;
-    table[0x7] = &Chip8::OP_7xkk;
-    table[0x8] = &Chip8::Table8;
-    table[0x9] = &Chip8::OP_9xy0;
-    table[0xA] = &Chip8::OP_Annn;
-    table[0xB] = &Chip8::OP_Bnnn;
-    table[0xC] = &Chip8::OP_Cxkk;
-    table[0xD] = &Chip8::OP_Dxyn;
-    table[0xE] = &Chip8::TableE;
-    table[0xF] = &Chip8::TableF;
-
-    for (size_t i = 0; i <= 0xE; i++)
-    {
-        table0[i] = &Chip8::OP_NULL;
-        table8[i] = &Chip8::OP_NULL;
-        tableE[i] = &Chip8::OP_NULL;
-    }
-
-    table0[0x0] = &Chip8::OP_00E0;
-    table0[0xE] = &Chip8::OP_00EE;
-
-    table8[0x0] = &Chip8::OP_8xy0;
-    table8[0x1] = &Chip8::OP_8xy1;
-    table8[0x2] = &Chip8::OP_8xy2;
-    table8[0x3] = &Chip8::OP_8xy3;
-    table8[0x4] = &Chip8::OP_8xy4;
-    table8[0x5] = &Chip8::OP_8xy5;
-    table8[0x6] = &Chip8::OP_8xy6;
-    table8[0x7] = &Chip8::OP_8xy7;
-    table8[0xE] = &Chip8::OP_8xyE;
-
-    tableE[0x1] = &Chip8::OP_ExA1;
-    tableE[0xE] = &Chip8::OP_Ex9E;
-
-    for (size_t i = 0; i <= 0x65; i++)
-    {
-        tableF[i] = &Chip8::OP_NULL;
-    }
-
-    tableF[0x07] = &Chip8::OP_Fx07;
-    tableF[0x0A] = &Chip8::OP_Fx0A;
-    tableF[0x15] = &Chip8::OP_Fx15;
-    tableF[0x18] = &Chip8::OP_Fx18;
-    tableF[0x1E] = &Chip8::OP_Fx1E;
-    tableF[0x29] = &Chip8::OP_Fx29;
-    tableF[0x33] = &Chip8::OP_Fx33;
-    tableF[0x55] = &Chip8::OP_Fx55;
-    tableF[0x65] = &Chip8::OP_Fx65;
-}
-
-void Chip8::LoadROM(char const* filename)
-{
-    // open file as a binary stream and move the file pointer to the end so we
-    // call use tellg to get the size of the file
-    std::ifstream file(filename, std::ios::binary | std::ios::ate);
-
-    if (file.is_open())
-    {
-        std::streampos size = file.tellg();
-        char* buffer = new char[size];
-
-        // go back to the beginning of the file and read its contents into the
-        // allocated buffer
-        file.seekg(0, std::ios::beg);
-        file.read(buffer, size);
-        file.close();
-
-        // Copy the buffer into main memory, starting at 0x200 which is the
-        // offset for chip8 programs to be read in.
-        for (uint32_t i = 0; i < size; i++)
+}
+
+bool Chip8::LoadROM(char const* filename)
+{
+    return LoadROM(RomImage::ReadFile(filename));
+}
+
+bool Chip8::LoadROM(const uint8_t* data, size_t size)
+{
+    return LoadROM(RomImage::FromMemory(data, size));
+}
+
+bool Chip8::LoadROM(std::shared_ptr<const RomImage> rom)
+{
+    if (!rom || rom->Size() > RomCapacity(quirks))
+    {
+        return false;
+    }
+    // Chip8 programs start at 0x200; whatever a previous ROM left above
+    // this one is cleared so memory matches BuildBaseImage()
+    size_t size = std::min(rom->Size(), PROGRAM_SIZE);
+    memcpy(memory + START_ADDRESS, rom->Data(), size);
+    memset(memory + START_ADDRESS + size, 0, PROGRAM_SIZE - size);
+
+    // Keep the image so save states can be stored as a delta against it
+    romImage = std::move(rom);
+    if (extension && !extension->high.empty())
+    {
+        BuildHighImage(extension->high.data());
+    }
+    FlushCache();
+    return true;
+}
+
+void Chip8::Reset(uint32_t seed)
+{
+    if (memoryDirty)
+    {
+        BuildBaseImage(memory);
+        if (extension && !extension->high.empty())
+        {
+            BuildHighImage(extension->high.data());
+        }
+        FlushCache();
+        memoryDirty = false;
+    }
+    if (extension)
+    {
+        ResetExtension();
+    }
+    memset(registers, 0, sizeof(registers));
+    memset(stack, 0, sizeof(stack));
+    memset(keypad, 0, sizeof(keypad));
+    memset(video, 0, sizeof(video));
+    index = 0;
+    sp = 0;
+    pc = START_ADDRESS;
+    delayTimer = 0;
+    soundTimer = 0;
+    dirtyRows = 0xFFFFFFFF;
+    rngState = seed;
+    spin = SpinCheck{};
+    idle = false;
+}
+
+bool Chip8::SetQuirks(QuirkProfile profile)
+{
+    if (profile == quirks)
+    {
+        return true;
+    }
+    // Only leaving XoChip can shrink the capacity, which changes the layout
+    bool fits = !romImage || romImage->Size() <= RomCapacity(profile);
+    bool layoutChanged = IsExtended(profile) != IsExtended(quirks) ||
+                         (profile == QuirkProfile::XoChip) !=
+                             (quirks == QuirkProfile::XoChip);
+    quirks = profile;
+    handlers = HANDLERS[static_cast<unsigned int>(profile)].data();
+    opClasses = OpClassesFor(profile);
+    FlushCache();
+    if (!layoutChanged)
+    {
+        return true;
+    }
+
+    if (!IsExtended(profile))
+    {
+        extension.reset();
+    }
+    else
+    {
+        if (!extension)
         {
-            memory[START_ADDRESS + i] = buffer[i];
+            extension.reset(new Extension);
         }
+        extension->high.assign(
+            profile == QuirkProfile::XoChip ? XO_MEMORY_SIZE - MEMORY_SIZE
+                                            : 0,
+            0);
+        extension->high.shrink_to_fit();
+        ResetExtension();
+    }
+    if (!fits)
+    {
+        romImage.reset();
+    }
+    BuildBaseImage(memory);
+    if (extension && !extension->high.empty())
+    {
+        BuildHighImage(extension->high.data());
+    }
+    memoryDirty = false;
+    memset(video, 0, sizeof(video));
+    dirtyRows = 0xFFFFFFFF;
+    return fits;
+}
+
+size_t Chip8::RomCapacity(QuirkProfile profile)
+{
+    return profile == QuirkProfile::XoChip ? XO_MEMORY_SIZE - START_ADDRESS
+                                           : PROGRAM_SIZE;
+}
+
+void Chip8::ResetExtension()
+{
+    ExtendedDisplay& display = extension->display;
+    memset(display.rows, 0, sizeof(display.rows));
+    display.hires = false;
+    display.planes = 0x1;
+    memset(extension->flags, 0, sizeof(extension->flags));
+    memset(extension->audio, 0, sizeof(extension->audio));
+    extension->pitch = 64; // 4000 Hz
+    dirtyRows = 0xFFFFFFFF;
+}
 
-        delete[] buffer;
+uint32_t Chip8::RomHash() const
+{
+    return romImage ? romImage->Hash() : RomImage::EMPTY_HASH;
+}
+
+size_t Chip8::MemoryFootprint() const
+{
+    size_t bytes = sizeof(*this);
+    if (cache)
+    {
+        bytes += sizeof(BlockCache) +
+                 cache->blocks.capacity() * sizeof(Block) +
+                 cache->code.capacity() * sizeof(Instr);
+    }
+    if (extension)
+    {
+        bytes += sizeof(Extension) + extension->high.capacity();
     }
+    return bytes;
 }
 
-void Chip8::Table0() { (this->*(table0[opcode & 0x000Fu]))(); }
+/*
+Memory as it is right after LoadROM(): the font at 0x50, the big font after
+it under SuperChip and XoChip, the ROM at 0x200 and zeros everywhere else.
+*/
+void Chip8::BuildBaseImage(uint8_t* image) const
+{
+    memset(image, 0, MEMORY_SIZE);
+    memcpy(image + FONTSET_START_ADDRESS, fontset, FONTSET_SIZE);
+    if (IsExtended(quirks))
+    {
+        memcpy(image + BIG_FONTSET_START_ADDRESS, bigFontset,
+               BIG_FONTSET_SIZE);
+    }
+    if (romImage)
+    {
+        memcpy(image + START_ADDRESS, romImage->Data(),
+               std::min(romImage->Size(), PROGRAM_SIZE));
+    }
+}
 
-void Chip8::Table8() { (this->*(table8[opcode & 0x000Fu]))(); }
+void Chip8::BuildHighImage(uint8_t* image) const
+{
+    memset(image, 0, XO_MEMORY_SIZE - MEMORY_SIZE);
+    if (romImage && romImage->Size() > PROGRAM_SIZE)
+    {
+        memcpy(image, romImage->Data() + PROGRAM_SIZE,
+               romImage->Size() - PROGRAM_SIZE);
+    }
+}
 
-void Chip8::TableE() { (this->*(tableE[opcode & 0x000Fu]))(); }
+/*
+SplitMix64. The whole generator is one 64-bit word, which keeps it cheap to
+copy into save states, and the sequence for a given seed is the same on every
+platform and standard library.
+*/
+uint8_t Chip8::RandomByte()
+{
+    uint64_t z = (rngState += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30u)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27u)) * 0x94D049BB133111EBull;
+    return (z ^ (z >> 31u)) >> 56u;
+}
 
-void Chip8::TableF() { (this->*(tableF[opcode & 0x00FFu]))(); }
+/*
+Resolve an opcode to its handler and pull out the operand fields. Both
+lookups are into static tables, the handler from the row for this machine's
+quirk profile; the block cache stores the result so it runs once per
+instruction address rather than per cycle.
+*/
+Instr Chip8::Decode(uint16_t opcode) const
+{
+    Instr in;
+    in.x = (opcode & 0x0F00u) >> 8u;
+    in.y = (opcode & 0x00F0u) >> 4u;
+    in.imm = 0;
+    in.op = opClasses[opcode];
+    in.handler = handlers[in.op];
+
+    switch ((opcode & 0xF000u) >> 12u)
+    {
+        case 0x1:
+        case 0x2:
+        case 0xA:
+        case 0xB:
+            in.imm = opcode & 0x0FFFu;
+            break;
+        case 0x3:
+        case 0x4:
+        case 0x6:
+        case 0x7:
+        case 0xC:
+            in.imm = opcode & 0x00FFu;
+            break;
+        case 0x0: // n of 00Cn and 00Dn
+        case 0xD:
+            in.imm = opcode & 0x000Fu;
+            break;
+    }
+    return in;
+}
 
-void Chip8::OP_NULL() {}
+void Chip8::OP_NULL(Instr const&) {}
 
 // BEGIN INSTRUCTIONS
 
@@ -132,10 +547,25 @@ void Chip8::OP_NULL() {}
   00E0 - CLS
   Clear the display.
 */
-void Chip8::OP_00E0()
+template <typename Quirks>
+void Chip8::OP_00E0(Instr const&)
 {
+    if constexpr (Quirks::EXTENDED)
+    {
+        ExtendedDisplay& display = extension->display;
+        for (unsigned int plane = 0; plane < PLANE_COUNT; ++plane)
+        {
+            if (display.planes & (1u << plane))
+            {
+                memset(display.rows[plane], 0, sizeof(display.rows[plane]));
+            }
+        }
+        dirtyRows = 0xFFFFFFFF;
+        return;
+    }
     // Clear the video buffer
     memset(video, 0, sizeof(video));
+    dirtyRows = 0xFFFFFFFF;
 }
 
 /*
@@ -144,12 +574,13 @@ Return from a subroutine.
 The interpreter sets the program counter to the address at the top of the stack,
 then subtracts 1 from the stack pointer.
 */
-void Chip8::OP_00EE()
+void Chip8::OP_00EE(Instr const&)
 {
     // Subtract sp first since top of stack holds address of instruction that is
-    // one past the one who called Subrouine.
+    // one past the one who called Subrouine. Only the low four bits of sp
+    // index the stack, so an unbalanced return wraps round it.
     --sp;
-    pc = stack[sp];
+    pc = stack[sp & 0xFu];
 }
 
 /*
@@ -158,9 +589,9 @@ Jump to location nnn.
 
 The interpreter sets the program counter to nnn.
 */
-void Chip8::OP_1nnn()
+void Chip8::OP_1nnn(Instr const& in)
 {
-    uint16_t address = opcode & 0x0FFFu;
+    uint16_t address = in.imm;
     pc = address;
 }
 
@@ -171,10 +602,11 @@ Call subroutine at nnn.
 The interpreter increments the stack pointer, then puts the current PC on the
 top of the stack. The PC is then set to nnn
 */
-void Chip8::OP_2nnn()
+void Chip8::OP_2nnn(Instr const& in)
 {
-    uint16_t address = opcode & 0x0FFFu;
-    stack[sp] = pc;
+    uint16_t address = in.imm;
+    // Nesting deeper than 16 overwrites the oldest return address
+    stack[sp & 0xFu] = pc;
     ++sp;
     pc = address;
 }
@@ -185,14 +617,15 @@ Skip next instruction if Vx = kk.
 The interpreter compares register Vx to kk, and if they are equal, increments
 the program counter by 2.
 */
-void Chip8::OP_3xkk()
+template <typename Quirks>
+void Chip8::OP_3xkk(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-    uint8_t byte = opcode & 0x00FFu;
+    uint8_t Vx = in.x;
+    uint8_t byte = in.imm;
 
     if (registers[Vx] == byte)
     {
-        pc += 2;
+        Skip<Quirks>();
     }
 }
 
@@ -203,14 +636,15 @@ The interpreter compares register Vx to kk, and if they are not equal,
 increments the program counter by 2.
 
 */
-void Chip8::OP_4xkk()
+template <typename Quirks>
+void Chip8::OP_4xkk(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-    uint8_t byte = opcode & 0x00FFu;
+    uint8_t Vx = in.x;
+    uint8_t byte = in.imm;
 
     if (registers[Vx] != byte)
     {
-        pc += 2;
+        Skip<Quirks>();
     }
 }
 
@@ -223,14 +657,15 @@ The interpreter compares register Vx to register Vy, and if they are equal,
 increments the program counter by 2.
 
 */
-void Chip8::OP_5xy0()
+template <typename Quirks>
+void Chip8::OP_5xy0(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-    uint8_t Vy = (opcode & 0x00F0u) >> 4u;
+    uint8_t Vx = in.x;
+    uint8_t Vy = in.y;
 
     if (registers[Vx] == registers[Vy])
     {
-        pc += 2;
+        Skip<Quirks>();
     }
 }
 
@@ -239,10 +674,10 @@ void Chip8::OP_5xy0()
 Set Vx = kk.
 
 The interpreter puts the value kk into register Vx.*/
-void Chip8::OP_6xkk()
+void Chip8::OP_6xkk(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-    uint8_t byte = (opcode & 0x00FFu);
+    uint8_t Vx = in.x;
+    uint8_t byte = in.imm;
 
     registers[Vx] = byte;
 }
@@ -253,10 +688,10 @@ Set Vx = Vx + kk.
 
 Adds the value kk to the value of register Vx, then stores the result in Vx.
 */
-void Chip8::OP_7xkk()
+void Chip8::OP_7xkk(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-    uint8_t byte = (opcode & 0x00FFu);
+    uint8_t Vx = in.x;
+    uint8_t byte = in.imm;
 
     registers[Vx] += byte;
 }
@@ -266,10 +701,10 @@ void Chip8::OP_7xkk()
 Set Vx = Vy.
 Stores the value of register Vy in register Vx.
 */
-void Chip8::OP_8xy0()
+void Chip8::OP_8xy0(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-    uint8_t Vy = (opcode & 0x00F0u) >> 4u;
+    uint8_t Vx = in.x;
+    uint8_t Vy = in.y;
 
     registers[Vx] = registers[Vy];
 }
@@ -282,10 +717,10 @@ void Chip8::OP_8xy0()
  A bitwise OR compares the corrseponding bits from two values, and if either bit
  is 1, then the same bit in the result is also 1. Otherwise, it is 0.
 */
-void Chip8::OP_8xy1()
+void Chip8::OP_8xy1(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-    uint8_t Vy = (opcode & 0x00F0u) >> 4u;
+    uint8_t Vx = in.x;
+    uint8_t Vy = in.y;
 
     registers[Vx] |= registers[Vy];
 }
@@ -298,10 +733,10 @@ Performs a bitwise AND on the values of Vx and Vy, then stores the result in Vx.
 A bitwise AND compares the corrseponding bits from two values, and if both bits
 are 1, then the same bit in the result is also 1. Otherwise, it is 0.
 */
-void Chip8::OP_8xy2()
+void Chip8::OP_8xy2(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-    uint8_t Vy = (opcode & 0x00F0u) >> 4u;
+    uint8_t Vx = in.x;
+    uint8_t Vy = in.y;
 
     registers[Vx] &= registers[Vy];
 }
@@ -315,10 +750,10 @@ result in Vx. An exclusive OR compares the corrseponding bits from two values,
 and if the bits are not both the same, then the corresponding bit in the result
 is set to 1. Otherwise, it is 0.
 */
-void Chip8::OP_8xy3()
+void Chip8::OP_8xy3(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-    uint8_t Vy = (opcode & 0x00F0u) >> 4u;
+    uint8_t Vx = in.x;
+    uint8_t Vy = in.y;
 
     registers[Vx] ^= registers[Vy];
 }
@@ -331,10 +766,10 @@ The values of Vx and Vy are added together. If the result is greater than 8 bits
 (i.e., > 255,) VF is set to 1, otherwise 0. Only the lowest 8 bits of the result
 are kept, and stored in Vx.
 */
-void Chip8::OP_8xy4()
+void Chip8::OP_8xy4(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-    uint8_t Vy = (opcode & 0x00F0u) >> 4u;
+    uint8_t Vx = in.x;
+    uint8_t Vy = in.y;
 
     uint16_t res = registers[Vx] + registers[Vy];
 
@@ -355,10 +790,10 @@ Set Vx = Vx - Vy, set VF = NOT borrow.
 If Vx > Vy, then VF is set to 1, otherwise 0. Then Vy is subtracted from Vx, and
 the results stored in Vx.
 */
-void Chip8::OP_8xy5()
+void Chip8::OP_8xy5(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-    uint8_t Vy = (opcode & 0x00F0u) >> 4u;
+    uint8_t Vx = in.x;
+    uint8_t Vy = in.y;
 
     if (registers[Vx] > registers[Vy])
     {
@@ -377,21 +812,24 @@ void Chip8::OP_8xy5()
 Set Vx = Vx SHR 1.
 
 If the least-significant bit of Vx is 1, then VF is set to 1, otherwise 0. Then
-Vx is divided by 2.
+Vx is divided by 2. Profiles that shift Vy set Vx = Vy SHR 1 instead.
 */
-void Chip8::OP_8xy6()
+template <typename Quirks>
+void Chip8::OP_8xy6(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
+    uint8_t Vx = in.x;
+    uint8_t source = registers[Quirks::SHIFT_READS_VY ? in.y : Vx];
 
-    if (registers[Vx] & 0x1u)
+    if constexpr (Quirks::SHIFT_FLAG_FIRST)
     {
-        registers[VF] = 1;
+        registers[VF] = source & 0x1u;
+        registers[Vx] = registers[Vx] >> 1u;
     }
     else
     {
-        registers[VF] = 0;
+        registers[Vx] = source >> 1u;
+        registers[VF] = source & 0x1u;
     }
-    registers[Vx] >>= 1u;
 }
 
 /*
@@ -401,10 +839,10 @@ Set Vx = Vy - Vx, set VF = NOT borrow.
 If Vy > Vx, then VF is set to 1, otherwise 0. Then Vx is subtracted from Vy, and
 the results stored in Vx.
 */
-void Chip8::OP_8xy7()
+void Chip8::OP_8xy7(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-    uint8_t Vy = (opcode & 0x00F0u) >> 4u;
+    uint8_t Vx = in.x;
+    uint8_t Vy = in.y;
 
     if (registers[Vx] < registers[Vy])
     {
@@ -423,16 +861,24 @@ void Chip8::OP_8xy7()
 Set Vx = Vx SHL 1.
 
 If the most-significant bit of Vx is 1, then VF is set to 1, otherwise to 0.
-Then Vx is multiplied by 2.
+Then Vx is multiplied by 2. Profiles that shift Vy set Vx = Vy SHL 1 instead.
 */
-void Chip8::OP_8xyE()
+template <typename Quirks>
+void Chip8::OP_8xyE(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-    // TODO CHECK IF THIS IS CORRECT
-    registers[VF] = (registers[Vx] & 0xFFu) >> 8u;
+    uint8_t Vx = in.x;
+    uint8_t source = registers[Quirks::SHIFT_READS_VY ? in.y : Vx];
 
-    // Multiple register Vx by 2
-    registers[Vx] <<= 0x1u;
+    if constexpr (Quirks::SHIFT_FLAG_FIRST)
+    {
+        registers[VF] = source >> 7u;
+        registers[Vx] = registers[Vx] << 1u;
+    }
+    else
+    {
+        registers[Vx] = source << 1u;
+        registers[VF] = source >> 7u;
+    }
 }
 
 /*
@@ -442,14 +888,15 @@ Skip next instruction if Vx != Vy.
 The values of Vx and Vy are compared, and if they are not equal, the program
 counter is increased by 2.
 */
-void Chip8::OP_9xy0()
+template <typename Quirks>
+void Chip8::OP_9xy0(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-    uint8_t Vy = (opcode & 0x00F0u) >> 4u;
+    uint8_t Vx = in.x;
+    uint8_t Vy = in.y;
 
     if (registers[Vx] != registers[Vy])
     {
-        pc += 2;
+        Skip<Quirks>();
     }
 }
 
@@ -460,9 +907,9 @@ Set I = nnn.
 The value of register I is set to nnn.
 
 */
-void Chip8::OP_Annn()
+void Chip8::OP_Annn(Instr const& in)
 {
-    uint16_t nnn = opcode & 0x0FFFu;
+    uint16_t nnn = in.imm;
     index = nnn;
 }
 
@@ -470,12 +917,14 @@ void Chip8::OP_Annn()
 Bnnn - JP V0, addr
 Jump to location nnn + V0.
 
-The program counter is set to nnn plus the value of V0.
+The program counter is set to nnn plus the value of V0. CHIP-48 and SUPER-CHIP
+read it as Bxnn and add Vx, the register named by the top digit of nnn.
 */
-void Chip8::OP_Bnnn()
+template <typename Quirks>
+void Chip8::OP_Bnnn(Instr const& in)
 {
-    uint16_t addr = opcode & 0x0FFFu;
-    pc = addr + registers[0];
+    uint16_t addr = in.imm;
+    pc = addr + registers[Quirks::JUMP_ADDS_VX ? in.x : 0];
 }
 
 /*
@@ -486,12 +935,12 @@ The interpreter generates a random number from 0 to 255, which is then ANDed
 with the value kk. The results are stored in Vx. See instruction 8xy2 for more
 information on AND.
 */
-void Chip8::OP_Cxkk()
+void Chip8::OP_Cxkk(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-    uint8_t kk = (opcode & 0x00FFu);
+    uint8_t Vx = in.x;
+    uint8_t kk = in.imm;
 
-    registers[Vx] = randByte(randGen) & kk;
+    registers[Vx] = RandomByte() & kk;
 }
 
 /*
@@ -506,43 +955,54 @@ erased, VF is set to 1, otherwise it is set to 0. If the sprite is positioned so
 part of it is outside the coordinates of the display, it wraps around to the
 opposite side of the screen. See instruction 8xy3 for more information on XOR,
 and section 2.4, Display, for more information on the Chip-8 screen and sprites.
+Profiles that clip drop the part past the edges instead; the starting
+position wraps either way. SuperChip and XoChip draw on the extended display.
 */
-void Chip8::OP_Dxyn()
+template <typename Quirks>
+void Chip8::OP_Dxyn(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-    uint8_t Vy = (opcode & 0x00F0u) >> 4u;
-    uint8_t height = opcode & 0x000Fu;
+    if constexpr (Quirks::EXTENDED)
+    {
+        DrawExtended<Quirks>(in);
+        return;
+    }
+    uint8_t Vx = in.x;
+    uint8_t Vy = in.y;
+    uint8_t height = in.imm;
 
     // Wrap if going beyond screen boundaries
     uint8_t xPos = registers[Vx] % VIDEO_WIDTH;
     uint8_t yPos = registers[Vy] % VIDEO_HEIGHT;
+    unsigned int rows = height;
+    if constexpr (Quirks::CLIP_SPRITES)
+    {
+        rows = std::min<unsigned int>(height, VIDEO_HEIGHT - yPos);
+    }
 
-    registers[0xF] = 0;
+    uint8_t collision = 0;
 
-    for (unsigned int row = 0; row < height; ++row)
+    for (unsigned int row = 0; row < rows; ++row)
     {
-        uint8_t spriteByte = memory[index + row];
-
-        for (unsigned int col = 0; col < 8; ++col)
+        // Move the sprite byte to column xPos, as a rotate so columns pushed
+        // off the right edge come back in on the left unless clipping.
+        uint64_t sprite =
+            static_cast<uint64_t>(memory[(index + row) & ADDRESS_MASK])
+            << 56u;
+        uint64_t spriteMask = sprite >> xPos;
+        if constexpr (!Quirks::CLIP_SPRITES)
         {
-            uint8_t spritePixel = spriteByte & (0x80u >> col);
-            uint32_t* screenPixel =
-                &video[(yPos + row) * VIDEO_WIDTH + (xPos + col)];
-
-            // Sprite pixel is on
-            if (spritePixel)
-            {
-                // Screen pixel also on - collision
-                if (*screenPixel == 0xFFFFFFFF)
-                {
-                    registers[0xF] = 1;
-                }
-
-                // Effectively XOR with the sprite pixel
-                *screenPixel ^= 0xFFFFFFFF;
-            }
+            spriteMask |= sprite << ((VIDEO_WIDTH - xPos) & 63u);
         }
+        unsigned int y = (yPos + row) % VIDEO_HEIGHT;
+        uint64_t& screenRow = video[y];
+
+        // Any sprite pixel landing on a lit pixel is a collision
+        collision |= (screenRow & spriteMask) != 0;
+        screenRow ^= spriteMask;
+        dirtyRows |= static_cast<uint32_t>(spriteMask != 0) << y;
     }
+
+    registers[0xF] = collision;
 }
 /*
 Ex9E - SKP Vx
@@ -551,15 +1011,17 @@ Skip next instruction if key with the value of Vx is pressed.
 Checks the keyboard, and if the key corresponding to the value of Vx is
 currently in the down position, PC is increased by 2.
 */
-void Chip8::OP_Ex9E()
+template <typename Quirks>
+void Chip8::OP_Ex9E(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
+    uint8_t Vx = in.x;
 
     uint8_t key = registers[Vx];
 
-    if (keypad[key])
+    // Keys past F read as released
+    if (key < 16 && keypad[key])
     {
-        pc += 2;
+        Skip<Quirks>();
     }
 }
 
@@ -570,15 +1032,16 @@ Skip next instruction if key with the value of Vx is not pressed.
 Checks the keyboard, and if the key corresponding to the value of Vx is
 currently in the up position, PC is increased by 2.
 */
-void Chip8::OP_ExA1()
+template <typename Quirks>
+void Chip8::OP_ExA1(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
+    uint8_t Vx = in.x;
 
     uint8_t key = registers[Vx];
 
-    if (!keypad[key])
+    if (key >= 16 || !keypad[key])
     {
-        pc += 2;
+        Skip<Quirks>();
     }
 }
 
@@ -588,9 +1051,9 @@ Set Vx = delay timer value.
 
 The value of DT is placed into Vx.
 */
-void Chip8::OP_Fx07()
+void Chip8::OP_Fx07(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
+    uint8_t Vx = in.x;
     registers[Vx] = delayTimer;
 }
 
@@ -601,9 +1064,9 @@ Wait for a key press, store the value of the key in Vx.
 All execution stops until a key is pressed, then the value of that key is stored
 in Vx.
 */
-void Chip8::OP_Fx0A()
+void Chip8::OP_Fx0A(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
+    uint8_t Vx = in.x;
     for (uint8_t i = 0; i < 16; ++i)
     {
         if (keypad[i])
@@ -622,9 +1085,9 @@ Set delay timer = Vx.
 
 DT is set equal to the value of Vx.
 */
-void Chip8::OP_Fx15()
+void Chip8::OP_Fx15(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
+    uint8_t Vx = in.x;
     delayTimer = registers[Vx];
 }
 
@@ -634,9 +1097,9 @@ Set sound timer = Vx.
 
 ST is set equal to the value of Vx.
 */
-void Chip8::OP_Fx18()
+void Chip8::OP_Fx18(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
+    uint8_t Vx = in.x;
     soundTimer = registers[Vx];
 }
 
@@ -646,9 +1109,9 @@ Set I = I + Vx.
 
 The values of I and Vx are added, and the results are stored in I.
 */
-void Chip8::OP_Fx1E()
+void Chip8::OP_Fx1E(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
+    uint8_t Vx = in.x;
     index += registers[Vx];
 }
 
@@ -660,9 +1123,9 @@ The value of I is set to the location for the hexadecimal sprite corresponding
 to the value of Vx. See section 2.4, Display, for more information on the Chip-8
 hexadecimal font.
 */
-void Chip8::OP_Fx29()
+void Chip8::OP_Fx29(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
+    uint8_t Vx = in.x;
     uint8_t digit = registers[Vx];
     index = FONTSET_START_ADDRESS + (5 * digit);
 }
@@ -675,17 +1138,15 @@ The interpreter takes the decimal value of Vx, and places the hundreds digit in
 memory at location in I, the tens digit at location I+1, and the ones digit at
 location I+2.
 */
-void Chip8::OP_Fx33()
+template <typename Quirks>
+void Chip8::OP_Fx33(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-    uint8_t digit = registers[Vx];
-    uint8_t i = 2;
-    while (digit > 0)
-    {
-        memory[index + i] = digit % 10;
-        digit /= 10;
-        --i;
-    }
+    uint8_t Vx = in.x;
+    uint8_t value = registers[Vx];
+    MemoryAt<Quirks>(index) = value / 100;
+    MemoryAt<Quirks>(index + 1) = value / 10 % 10;
+    MemoryAt<Quirks>(index + 2) = value % 10;
+    InvalidateCode(index, 3);
 }
 
 /*
@@ -693,16 +1154,20 @@ Fx55 - LD [I], Vx
 Store registers V0 through Vx in memory starting at location I.
 
 The interpreter copies the values of registers V0 through Vx into memory,
-starting at the address in I.
+starting at the address in I. Depending on the profile, I is then left alone
+or moved past the registers (CHIP-48 stops one short).
 */
-void Chip8::OP_Fx55()
+template <typename Quirks>
+void Chip8::OP_Fx55(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
+    uint8_t Vx = in.x;
 
     for (uint8_t i = 0; i <= Vx; ++i)
     {
-        memory[index + i] = registers[i];
+        MemoryAt<Quirks>(index + i) = registers[i];
     }
+    InvalidateCode(index, Vx + 1);
+    index = IndexAfterLoadStore<Quirks>(index, Vx);
 }
 
 /*
@@ -710,31 +1175,342 @@ Fx65 - LD Vx, [I]
 Read registers V0 through Vx from memory starting at location I.
 
 The interpreter reads values from memory starting at location I into registers
-V0 through Vx.
+V0 through Vx. I then moves as it does for Fx55.
 */
-void Chip8::OP_Fx65()
+template <typename Quirks>
+void Chip8::OP_Fx65(Instr const& in)
 {
-    uint8_t Vx = (opcode & 0x0F00u) >> 8u;
+    uint8_t Vx = in.x;
 
     for (uint8_t i = 0; i <= Vx; ++i)
     {
-        registers[i] = memory[index + i];
+        registers[i] = MemoryAt<Quirks>(index + i);
+    }
+    index = IndexAfterLoadStore<Quirks>(index, Vx);
+}
+
+/*
+00Cn - SCD n (SUPER-CHIP)
+Scroll the display down n rows.
+
+00Dn - SCU n (XO-CHIP)
+Scroll the display up n rows.
+
+00FB - SCR, 00FC - SCL (SUPER-CHIP)
+Scroll the display right or left 4 columns.
+
+Only the selected planes move. In lores every distance is doubled, so the
+picture moves by lores pixels.
+*/
+void Chip8::OP_00Cn(Instr const& in) { Scroll(in.imm, 0); }
+
+void Chip8::OP_00Dn(Instr const& in) { Scroll(-in.imm, 0); }
+
+void Chip8::OP_00FB(Instr const&) { Scroll(0, 4); }
+
+void Chip8::OP_00FC(Instr const&) { Scroll(0, -4); }
+
+/*
+00FD - EXIT (SUPER-CHIP)
+Stop the interpreter. Here the machine stays on this instruction for good.
+*/
+void Chip8::OP_00FD(Instr const&) { pc -= 2; }
+
+/*
+00FE - LOW, 00FF - HIGH (SUPER-CHIP)
+Switch to 64x32 lores or 128x64 hires mode. Both clear every plane.
+*/
+void Chip8::OP_00FE(Instr const&)
+{
+    ExtendedDisplay& display = extension->display;
+    display.hires = false;
+    memset(display.rows, 0, sizeof(display.rows));
+    dirtyRows = 0xFFFFFFFF;
+}
+
+void Chip8::OP_00FF(Instr const&)
+{
+    ExtendedDisplay& display = extension->display;
+    display.hires = true;
+    memset(display.rows, 0, sizeof(display.rows));
+    dirtyRows = 0xFFFFFFFF;
+}
+
+/*
+5xy2 - SAVE Vx - Vy (XO-CHIP)
+Store Vx through Vy in memory starting at I, in either direction; I is left
+alone.
+*/
+void Chip8::OP_5xy2(Instr const& in)
+{
+    int step = in.x <= in.y ? 1 : -1;
+    unsigned int count = (in.x <= in.y ? in.y - in.x : in.x - in.y) + 1;
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        MemoryAt<XoChipQuirks>(index + i) = registers[in.x + step * int(i)];
+    }
+    InvalidateCode(index, count);
+}
+
+/*
+5xy3 - LOAD Vx - Vy (XO-CHIP)
+Read Vx through Vy from memory starting at I, in either direction; I is left
+alone.
+*/
+void Chip8::OP_5xy3(Instr const& in)
+{
+    int step = in.x <= in.y ? 1 : -1;
+    unsigned int count = (in.x <= in.y ? in.y - in.x : in.x - in.y) + 1;
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        registers[in.x + step * int(i)] = MemoryAt<XoChipQuirks>(index + i);
+    }
+}
+
+/*
+F000 nnnn - LD I, long (XO-CHIP)
+Set I to the 16-bit address in the next word and step over it.
+*/
+void Chip8::OP_F000(Instr const&)
+{
+    index = OpcodeAt(pc);
+    pc += 2;
+}
+
+/*
+Fn01 - PLANE n (XO-CHIP)
+Select the planes later drawing, clearing and scrolling apply to.
+*/
+void Chip8::OP_Fn01(Instr const& in)
+{
+    extension->display.planes = in.x & 0x3u;
+}
+
+/*
+F002 - AUDIO (XO-CHIP)
+Load the 16-byte audio pattern from I. It is kept for save states; nothing
+plays it.
+*/
+void Chip8::OP_F002(Instr const&)
+{
+    for (uint8_t i = 0; i < 16; ++i)
+    {
+        extension->audio[i] = MemoryAt<XoChipQuirks>(index + i);
+    }
+}
+
+/*
+Fx30 - LD HF, Vx (SUPER-CHIP)
+Set I to the 8x10 big font digit for the low nibble of Vx.
+*/
+void Chip8::OP_Fx30(Instr const& in)
+{
+    uint8_t digit = registers[in.x] & 0xFu;
+    index = BIG_FONTSET_START_ADDRESS + (10 * digit);
+}
+
+/*
+Fx3A - PITCH Vx (XO-CHIP)
+Set the audio pattern's playback rate.
+*/
+void Chip8::OP_Fx3A(Instr const& in) { extension->pitch = registers[in.x]; }
+
+/*
+Fx75 - LD R, Vx and Fx85 - LD Vx, R (SUPER-CHIP)
+Store V0 through Vx in the RPL user flags, or read them back. The flags live
+as long as the machine rather than on disk.
+*/
+void Chip8::OP_Fx75(Instr const& in)
+{
+    memcpy(extension->flags, registers, in.x + 1u);
+}
+
+void Chip8::OP_Fx85(Instr const& in)
+{
+    memcpy(registers, extension->flags, in.x + 1u);
+}
+
+template <typename Quirks>
+void Chip8::Skip()
+{
+    if constexpr (Quirks::XO_CHIP)
+    {
+        if (OpcodeAt(pc) == 0xF000u)
+        {
+            pc += 2;
+        }
+    }
+    pc += 2;
+}
+
+template <typename Quirks>
+uint8_t& Chip8::MemoryAt(uint16_t address)
+{
+    if constexpr (Quirks::XO_CHIP)
+    {
+        return address < MEMORY_SIZE ? memory[address]
+                                     : extension->high[address - MEMORY_SIZE];
+    }
+    else
+    {
+        return memory[address & ADDRESS_MASK];
+    }
+}
+
+/*
+Dxyn on the extended display. Dxy0 draws a 16x16 sprite of two bytes per
+row. In lores each sprite row is widened to twice its bits and XORed into
+two display rows. Each selected plane takes the next sprite's worth of
+bytes from I, and VF is 1 when any plane had a collision.
+*/
+template <typename Quirks>
+void Chip8::DrawExtended(Instr const& in)
+{
+    ExtendedDisplay& display = extension->display;
+    unsigned int scale = display.hires ? 1 : 2;
+    unsigned int width = HIRES_WIDTH / scale;
+    unsigned int height = HIRES_HEIGHT / scale;
+    unsigned int xPos = registers[in.x] % width;
+    unsigned int yPos = registers[in.y] % height;
+    unsigned int bytesPerRow = in.imm == 0 ? 2 : 1;
+    unsigned int spriteRows = in.imm == 0 ? 16 : in.imm;
+    unsigned int spriteWidth = 8 * bytesPerRow * scale;
+    unsigned int rows = spriteRows;
+    if constexpr (Quirks::CLIP_SPRITES)
+    {
+        rows = std::min(spriteRows, height - yPos);
+    }
+
+    uint16_t address = index;
+    uint64_t collision = 0;
+    for (unsigned int plane = 0; plane < PLANE_COUNT; ++plane)
+    {
+        if (!(display.planes & (1u << plane)))
+        {
+            continue;
+        }
+        for (unsigned int row = 0; row < rows; ++row)
+        {
+            uint32_t bits = MemoryAt<Quirks>(address + row * bytesPerRow);
+            if (bytesPerRow == 2)
+            {
+                bits = (bits << 8u) |
+                       MemoryAt<Quirks>(address + row * bytesPerRow + 1);
+            }
+            if (scale == 2)
+            {
+                bits = Widen(bits);
+            }
+            // Left-align the sprite in the row, then move it to its column
+            uint64_t high = static_cast<uint64_t>(bits) << (64 - spriteWidth);
+            uint64_t low = 0;
+            if constexpr (Quirks::CLIP_SPRITES)
+            {
+                ShiftRight(high, low, xPos * scale);
+            }
+            else
+            {
+                RotateRight(high, low, xPos * scale);
+            }
+
+            unsigned int y = (yPos + row) % height * scale;
+            for (unsigned int i = 0; i < scale; ++i)
+            {
+                uint64_t* screenRow = display.rows[plane][y + i];
+                collision |= (screenRow[0] & high) | (screenRow[1] & low);
+                screenRow[0] ^= high;
+                screenRow[1] ^= low;
+            }
+        }
+        address += spriteRows * bytesPerRow;
+    }
+
+    registers[0xF] = collision != 0;
+    dirtyRows = 0xFFFFFFFF;
+}
+
+/*
+Scroll the selected planes by whole pixels of the current mode; positive is
+down or right. What scrolls in is blank.
+*/
+void Chip8::Scroll(int down, int right)
+{
+    ExtendedDisplay& display = extension->display;
+    if (!display.hires)
+    {
+        down *= 2;
+        right *= 2;
     }
+    unsigned int up = down < 0 ? -down : 0;
+    unsigned int left = right < 0 ? -right : 0;
+    down = std::max(down, 0);
+    right = std::max(right, 0);
+
+    for (unsigned int plane = 0; plane < PLANE_COUNT; ++plane)
+    {
+        if (!(display.planes & (1u << plane)))
+        {
+            continue;
+        }
+        uint64_t(*rows)[2] = display.rows[plane];
+        const size_t rowSize = sizeof(rows[0]);
+        if (down > 0)
+        {
+            memmove(rows + down, rows, (HIRES_HEIGHT - down) * rowSize);
+            memset(rows, 0, down * rowSize);
+        }
+        else if (up > 0)
+        {
+            memmove(rows, rows + up, (HIRES_HEIGHT - up) * rowSize);
+            memset(rows + HIRES_HEIGHT - up, 0, up * rowSize);
+        }
+        for (unsigned int y = 0; right + left > 0 && y < HIRES_HEIGHT; ++y)
+        {
+            uint64_t& high = rows[y][0];
+            uint64_t& low = rows[y][1];
+            if (right > 0)
+            {
+                ShiftRight(high, low, right);
+            }
+            else
+            {
+                high = (high << left) | (low >> (64 - left));
+                low <<= left;
+            }
+        }
+    }
+    dirtyRows = 0xFFFFFFFF;
 }
 
 /*
 This function implements the a simulated cycle of the CPU. In each cycle the
 next instruction is fetched as an opcode, then the instruction is decoded to in
-the lookup table and executed. If delaytimer or soundTimer is set, increment
-decrement it.
+the lookup table and executed. The timers are not touched here; they count
+down at 60 Hz through TickTimers(), independent of the instruction rate.
 */
 void Chip8::Cycle()
 {
-    opcode = (memory[pc] << 8u) | memory[pc + 1];
+    Instr in = Decode(OpcodeAt(pc));
     // Increment the program counter to point to the next instruction
     pc += 2;
 
-    (this->*(table[(opcode & 0xF000u) >> 12u]))();
+    if constexpr (PROFILE_ENABLED)
+    {
+        if (profiler)
+        {
+            profiler->Execute(*this, in, pc - 2);
+            return;
+        }
+    }
+    in.handler(*this, in);
+}
+
+/*
+If delaytimer or soundTimer is set, decrement it. Called once per 60 Hz frame
+by the scheduler.
+*/
+void Chip8::TickTimers()
+{
     if (delayTimer > 0)
     {
         --delayTimer;
@@ -743,4 +1519,297 @@ void Chip8::Cycle()
     {
         --soundTimer;
     }
-}
\ No newline at end of file
+}
+
+/*
+Run through the block cache. Whole blocks are executed per dispatch; when a
+block is longer than the remaining budget the rest is single-stepped so the
+instruction count is exact.
+*/
+void Chip8::Run(uint32_t cycles)
+{
+    if (!cache)
+    {
+        cache.reset(new BlockCache);
+        FlushCache();
+    }
+
+    idle = false;
+    spin.valid = false;
+    while (cycles > 0)
+    {
+        if (pc > MEMORY_SIZE - 2)
+        {
+            Cycle();
+            --cycles;
+            spin.valid = false;
+            continue;
+        }
+
+        // A block longer than the cycles left runs only as far as they go;
+        // stepping the rest with Cycle() would decode a new block at each pc
+        const Block& block = FindBlock(pc);
+        uint32_t count = std::min(block.count, cycles);
+        const Instr* in = &cache->code[block.first];
+        const Instr* last = in + count;
+        cycles -= count;
+        if constexpr (PROFILE_ENABLED)
+        {
+            if (profiler)
+            {
+                for (; in != last; ++in)
+                {
+                    pc += 2;
+                    profiler->Execute(*this, *in, pc - 2);
+                }
+                continue;
+            }
+        }
+        uint16_t start = block.start;
+        bool pure = block.pure && count == block.count;
+        for (; in != last; ++in)
+        {
+            pc += 2;
+            in->handler(*this, *in);
+        }
+
+        if (!pure)
+        {
+            spin.valid = false;
+        }
+        else if (pc <= start && Spinning(cycles))
+        {
+            idle = true;
+        }
+    }
+}
+
+/*
+Called after a pure block branched backwards. If the previous backward
+branch came to the same address with the same state and only pure blocks
+ran in between, each further trip round the loop would do exactly the same,
+so all the whole iterations that fit in cycles are dropped; the remainder
+still runs normally so Run() stops at the same point it otherwise would.
+Returns whether iterations were dropped.
+*/
+bool Chip8::Spinning(uint32_t& cycles)
+{
+    if (spin.valid && spin.pc == pc && spin.index == index &&
+        spin.delayTimer == delayTimer && spin.soundTimer == soundTimer &&
+        std::memcmp(spin.registers, registers, sizeof(registers)) == 0)
+    {
+        uint32_t length = spin.cyclesLeft - cycles;
+        cycles %= length;
+        spin.valid = false;
+        return true;
+    }
+
+    std::memcpy(spin.registers, registers, sizeof(registers));
+    spin.index = index;
+    spin.pc = pc;
+    spin.delayTimer = delayTimer;
+    spin.soundTimer = soundTimer;
+    spin.cyclesLeft = cycles;
+    spin.valid = true;
+    return false;
+}
+
+bool Chip8::EndsBlock(uint16_t opcode, QuirkProfile profile)
+{
+    switch (OpClass(opcode, profile))
+    {
+        case 38: // 00FD rewinds pc to stay put
+        case 43: // F000 nnnn steps over its address
+            return true;
+    }
+    switch ((opcode & 0xF000u) >> 12u)
+    {
+        case 0x0:
+            return (opcode & 0x000Fu) == 0xEu;
+        case 0x1:
+        case 0x2:
+        case 0x3:
+        case 0x4:
+        case 0x5:
+        case 0x9:
+        case 0xB:
+        case 0xE:
+            return true;
+        case 0xF:
+            switch (opcode & 0x00FFu)
+            {
+                case 0x0A: // rewinds pc while waiting for a key
+                case 0x33: // memory writes may hit cached code
+                case 0x55:
+                    return true;
+            }
+            return false;
+        default:
+            return false;
+    }
+}
+
+/*
+Instructions that change anything besides registers, index, timers and pc:
+memory, the stack, the framebuffer or the RNG. A loop without any of them
+depends only on state Run() can compare.
+*/
+bool Chip8::HasSideEffects(uint16_t opcode, QuirkProfile profile)
+{
+    switch (OpClass(opcode, profile))
+    {
+        case OpClass(0x00E0):
+        case OpClass(0x00EE):
+        case OpClass(0x2000):
+        case OpClass(0xC000):
+        case OpClass(0xD000):
+        case OpClass(0xF033):
+        case OpClass(0xF055):
+        // The extended opcodes that touch the display, flags or audio
+        case 34: // 00Cn
+        case 35: // 00Dn
+        case 36: // 00FB
+        case 37: // 00FC
+        case 39: // 00FE
+        case 40: // 00FF
+        case 41: // 5xy2
+        case 44: // Fn01
+        case 45: // F002
+        case 47: // Fx3A
+        case 48: // Fx75
+            return true;
+        default:
+            return false;
+    }
+}
+
+const Chip8::Block& Chip8::FindBlock(uint16_t address)
+{
+    uint16_t id = cache->blockAt[address];
+    if (id != BlockCache::NONE)
+    {
+        return cache->blocks[id];
+    }
+
+    const uint32_t maxBlockLength = 64;
+    const size_t maxCodeSize = 1u << 16u;
+    if (cache->blocks.size() >= BlockCache::NONE ||
+        cache->code.size() >= maxCodeSize)
+    {
+        FlushCache();
+    }
+
+    Block block;
+    block.start = address;
+    block.first = static_cast<uint32_t>(cache->code.size());
+    block.count = 0;
+    block.valid = true;
+    block.pure = true;
+
+    uint16_t addr = address;
+    while (addr <= MEMORY_SIZE - 2 && block.count < maxBlockLength)
+    {
+        uint16_t opcode = (memory[addr] << 8u) | memory[addr + 1];
+        cache->code.push_back(Decode(opcode));
+        block.pure = block.pure && !HasSideEffects(opcode, quirks);
+        ++block.count;
+        addr += 2;
+        if (EndsBlock(opcode, quirks))
+        {
+            break;
+        }
+    }
+    block.end = addr;
+
+    for (uint16_t a = block.start; a < block.end; ++a)
+    {
+        cache->covered[a] = true;
+    }
+    cache->blockAt[address] = static_cast<uint16_t>(cache->blocks.size());
+    cache->blocks.push_back(block);
+    return cache->blocks.back();
+}
+
+void Chip8::FlushCache()
+{
+    if (!cache)
+    {
+        return;
+    }
+    std::fill(std::begin(cache->blockAt), std::end(cache->blockAt),
+              BlockCache::NONE);
+    cache->covered.reset();
+    cache->blocks.clear();
+    cache->code.clear();
+}
+
+/*
+Called after every guest memory write. Blocks overlapping the written range
+are dropped and decoded again the next time execution reaches them. The
+range wraps at the end of memory like the write itself.
+*/
+void Chip8::InvalidateCode(uint16_t address, uint16_t length)
+{
+    memoryDirty = true;
+    if (!cache)
+    {
+        return;
+    }
+
+    uint32_t end;
+    if (quirks == QuirkProfile::XoChip)
+    {
+        // Writes from 0x1000 up land in high memory, which code is never
+        // fetched from; only a write running past 0xFFFF reaches low memory
+        end = static_cast<uint32_t>(address) + length;
+        if (end > XO_MEMORY_SIZE)
+        {
+            InvalidateCode(0, end - XO_MEMORY_SIZE);
+        }
+        if (address >= MEMORY_SIZE)
+        {
+            return;
+        }
+        end = std::min<uint32_t>(end, MEMORY_SIZE);
+    }
+    else
+    {
+        address &= ADDRESS_MASK;
+        end = static_cast<uint32_t>(address) + length;
+        if (end > MEMORY_SIZE)
+        {
+            InvalidateCode(0, end - MEMORY_SIZE);
+            end = MEMORY_SIZE;
+        }
+    }
+    bool hit = false;
+    for (uint32_t a = address; a < end; ++a)
+    {
+        hit = hit || cache->covered[a];
+    }
+    if (!hit)
+    {
+        return;
+    }
+
+    for (Block& block : cache->blocks)
+    {
+        if (block.valid && block.start < end && address < block.end)
+        {
+            block.valid = false;
+            cache->blockAt[block.start] = BlockCache::NONE;
+        }
+    }
+
+    cache->covered.reset();
+    for (const Block& block : cache->blocks)
+    {
+        if (block.valid)
+        {
+            for (uint16_t a = block.start; a < block.end; ++a)
+            {
+                cache->covered[a] = true;
+            }
+        }
+    }
+}
@@ -0,0 +1,220 @@
+#include "delta.hpp"
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
+namespace
+{
+const uint8_t DELTA_MAGIC[4] = {'C', '8', 'F', 'D'};
+const uint8_t DELTA_VERSION = 1;
+const uint8_t KIND_DELTA = 0;
+const uint8_t KIND_KEYFRAME = 1;
+
+void PutVarint(std::vector<uint8_t>& out, uint64_t value)
+{
+    while (value >= 0x80u)
+    {
+        out.push_back((value & 0x7Fu) | 0x80u);
+        value >>= 7u;
+    }
+    out.push_back(value);
+}
+
+bool GetVarint(const uint8_t* data, size_t size, size_t& at, uint64_t& value)
+{
+    value = 0;
+    for (unsigned int shift = 0; shift < 64; shift += 7)
+    {
+        if (at == size)
+        {
+            return false;
+        }
+        uint8_t byte = data[at++];
+        value |= static_cast<uint64_t>(byte & 0x7Fu) << shift;
+        if (!(byte & 0x80u))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Byte i of a display in stream order: row by row, leftmost pixels first.
+inline uint8_t ByteAt(const uint64_t* rows, size_t i)
+{
+    return static_cast<uint8_t>(rows[i / 8] >> (56 - 8 * (i % 8)));
+}
+} // namespace
+
+DeltaEncoder::DeltaEncoder(uint32_t keyframeInterval)
+    : keyframeInterval(keyframeInterval)
+{
+}
+
+/*
+Most rows of a delta are unchanged, so zero runs are scanned a row at a
+time and only rows with changes are looked at byte by byte. A lone zero
+byte between changes stays in the literal, where it costs one byte instead
+of the two that ending and restarting it would.
+*/
+void DeltaEncoder::Encode(const uint64_t* video, std::vector<uint8_t>& out)
+{
+    bool keyframe = forceKeyframe ||
+                    (keyframeInterval && sinceKeyframe >= keyframeInterval);
+    if (keyframe)
+    {
+        sinceKeyframe = 0;
+        forceKeyframe = false;
+    }
+    ++sinceKeyframe;
+
+    uint64_t diff[VIDEO_HEIGHT];
+    for (unsigned int row = 0; row < VIDEO_HEIGHT; ++row)
+    {
+        diff[row] = keyframe ? video[row] : video[row] ^ previous[row];
+        previous[row] = video[row];
+    }
+
+    out.push_back(keyframe ? KIND_KEYFRAME : KIND_DELTA);
+    const size_t end = DELTA_FRAME_BYTES;
+    size_t at = 0;
+    while (at < end)
+    {
+        size_t zeros = at;
+        while (zeros < end)
+        {
+            if (zeros % 8 == 0 && !diff[zeros / 8])
+            {
+                zeros += 8;
+            }
+            else if (!ByteAt(diff, zeros))
+            {
+                ++zeros;
+            }
+            else
+            {
+                break;
+            }
+        }
+        PutVarint(out, zeros - at);
+        if (zeros == end)
+        {
+            break;
+        }
+
+        size_t literal = zeros + 1;
+        while (literal < end &&
+               (ByteAt(diff, literal) ||
+                (literal + 1 < end && ByteAt(diff, literal + 1))))
+        {
+            ++literal;
+        }
+        PutVarint(out, literal - zeros);
+        for (size_t i = zeros; i < literal; ++i)
+        {
+            out.push_back(ByteAt(diff, i));
+        }
+        at = literal;
+    }
+}
+
+bool DeltaDecoder::Decode(const uint8_t* data, size_t size, size_t& used)
+{
+    if (size == 0 || data[0] > KIND_KEYFRAME ||
+        (data[0] == KIND_DELTA && !synced))
+    {
+        return false;
+    }
+    bool isKeyframe = data[0] == KIND_KEYFRAME;
+    uint64_t next[VIDEO_HEIGHT];
+    for (unsigned int row = 0; row < VIDEO_HEIGHT; ++row)
+    {
+        next[row] = isKeyframe ? 0 : video[row];
+    }
+
+    const size_t end = DELTA_FRAME_BYTES;
+    size_t in = 1;
+    size_t at = 0;
+    while (at < end)
+    {
+        uint64_t zeros;
+        if (!GetVarint(data, size, in, zeros) || zeros > end - at)
+        {
+            return false;
+        }
+        at += zeros;
+        if (at == end)
+        {
+            break;
+        }
+
+        uint64_t literal;
+        if (!GetVarint(data, size, in, literal) || literal == 0 ||
+            literal > end - at || literal > size - in)
+        {
+            return false;
+        }
+        for (uint64_t i = 0; i < literal; ++i, ++at)
+        {
+            next[at / 8] ^= static_cast<uint64_t>(data[in++])
+                            << (56 - 8 * (at % 8));
+        }
+    }
+
+    std::copy(std::begin(next), std::end(next), video);
+    synced = true;
+    keyframe = isKeyframe;
+    used = in;
+    return true;
+}
+
+DeltaWriter::DeltaWriter(std::ostream& out, uint32_t keyframeInterval)
+    : out(out), encoder(keyframeInterval)
+{
+    out.write(reinterpret_cast<const char*>(DELTA_MAGIC), sizeof(DELTA_MAGIC));
+    out.put(static_cast<char>(DELTA_VERSION));
+    bytes = sizeof(DELTA_MAGIC) + 1;
+}
+
+void DeltaWriter::Frame(const uint64_t* video)
+{
+    packet.clear();
+    encoder.Encode(video, packet);
+    out.write(reinterpret_cast<const char*>(packet.data()), packet.size());
+    ++frames;
+    bytes += packet.size();
+}
+
+bool DeltaWriter::Good() const
+{
+    return out.good();
+}
+
+bool DeltaReader::Open(const char* filename)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+    data.assign(std::istreambuf_iterator<char>(file),
+                std::istreambuf_iterator<char>());
+    at = sizeof(DELTA_MAGIC) + 1;
+    decoder = DeltaDecoder();
+    return data.size() >= at &&
+           std::equal(std::begin(DELTA_MAGIC), std::end(DELTA_MAGIC),
+                      data.begin()) &&
+           data[sizeof(DELTA_MAGIC)] == DELTA_VERSION;
+}
+
+bool DeltaReader::Next()
+{
+    size_t used = 0;
+    if (at >= data.size() ||
+        !decoder.Decode(data.data() + at, data.size() - at, used))
+    {
+        return false;
+    }
+    at += used;
+    return true;
+}
@@ -0,0 +1,114 @@
+#include "framebuffer.hpp"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+Each source byte covers eight pixels. The byte is broadcast to every lane,
+ANDed with a per-lane bit mask and compared against that mask, giving an
+all-ones or all-zero lane that then selects between the two colours.
+*/
+void ExpandFramebuffer(const uint64_t* rows, uint32_t* pixels, uint32_t on,
+                       uint32_t off)
+{
+    ExpandRows(rows, pixels, 0, VIDEO_HEIGHT, on, off);
+}
+
+void ExpandRows(const uint64_t* rows, uint32_t* pixels, unsigned int first,
+                unsigned int count, uint32_t on, uint32_t off)
+{
+    unsigned int end = first + count;
+#if defined(__AVX2__)
+    const __m256i bits = _mm256_setr_epi32(0x80, 0x40, 0x20, 0x10, 0x08,
+                                           0x04, 0x02, 0x01);
+    const __m256i onColour = _mm256_set1_epi32(on);
+    const __m256i offColour = _mm256_set1_epi32(off);
+    for (unsigned int y = first; y < end; ++y)
+    {
+        for (unsigned int b = 0; b < 8; ++b)
+        {
+            uint8_t byte = rows[y] >> (56u - 8u * b);
+            __m256i lit = _mm256_cmpeq_epi32(
+                _mm256_and_si256(_mm256_set1_epi32(byte), bits), bits);
+            __m256i out = _mm256_blendv_epi8(offColour, onColour, lit);
+            _mm256_storeu_si256(
+                reinterpret_cast<__m256i*>(pixels + y * VIDEO_WIDTH + b * 8),
+                out);
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i high = _mm_setr_epi32(0x80, 0x40, 0x20, 0x10);
+    const __m128i low = _mm_setr_epi32(0x08, 0x04, 0x02, 0x01);
+    const __m128i onColour = _mm_set1_epi32(on);
+    const __m128i offColour = _mm_set1_epi32(off);
+    for (unsigned int y = first; y < end; ++y)
+    {
+        for (unsigned int b = 0; b < 8; ++b)
+        {
+            uint8_t byte = rows[y] >> (56u - 8u * b);
+            __m128i value = _mm_set1_epi32(byte);
+            __m128i litHigh =
+                _mm_cmpeq_epi32(_mm_and_si128(value, high), high);
+            __m128i litLow = _mm_cmpeq_epi32(_mm_and_si128(value, low), low);
+            __m128i* out =
+                reinterpret_cast<__m128i*>(pixels + y * VIDEO_WIDTH + b * 8);
+            _mm_storeu_si128(out, _mm_or_si128(_mm_and_si128(litHigh, onColour),
+                                               _mm_andnot_si128(litHigh,
+                                                                offColour)));
+            _mm_storeu_si128(out + 1,
+                             _mm_or_si128(_mm_and_si128(litLow, onColour),
+                                          _mm_andnot_si128(litLow, offColour)));
+        }
+    }
+#else
+    for (unsigned int y = first; y < end; ++y)
+    {
+        uint64_t row = rows[y];
+        for (unsigned int x = 0; x < VIDEO_WIDTH; ++x)
+        {
+            uint32_t lit = 0u - static_cast<uint32_t>((row >> (63u - x)) & 1u);
+            pixels[y * VIDEO_WIDTH + x] = (on & lit) | (off & ~lit);
+        }
+    }
+#endif
+}
+
+void ExpandExtended(const ExtendedDisplay& display, uint32_t* pixels,
+                    const uint32_t* palette)
+{
+    for (unsigned int y = 0; y < HIRES_HEIGHT; ++y)
+    {
+        for (unsigned int x = 0; x < HIRES_WIDTH; ++x)
+        {
+            unsigned int word = x / 64;
+            unsigned int shift = 63u - x % 64;
+            unsigned int colour =
+                ((display.rows[0][y][word] >> shift) & 1u) |
+                (((display.rows[1][y][word] >> shift) & 1u) << 1u);
+            pixels[y * HIRES_WIDTH + x] = palette[colour];
+        }
+    }
+}
+
+bool DirtySpan(uint32_t dirtyRows, unsigned int& first, unsigned int& count)
+{
+    if (dirtyRows == 0)
+    {
+        return false;
+    }
+    first = 0;
+    while (!(dirtyRows & (1u << first)))
+    {
+        ++first;
+    }
+    unsigned int last = VIDEO_HEIGHT - 1;
+    while (!(dirtyRows & (1u << last)))
+    {
+        --last;
+    }
+    count = last - first + 1;
+    return true;
+}
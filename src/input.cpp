@@ -0,0 +1,51 @@
+#include "input.hpp"
+#include <algorithm>
+
+KeyTimeline::KeyTimeline(uint32_t instructionsPerFrame, bool spread)
+    : instructionsPerFrame(std::max(1u, instructionsPerFrame)),
+      spread(spread),
+      last(Clock::now())
+{
+}
+
+const std::vector<InputEvent>& KeyTimeline::NextFrame(KeyEventQueue& queue,
+                                                      Clock::time_point now)
+{
+    std::vector<InputEvent> earlier;
+    earlier.swap(carried);
+    events.clear();
+    nextCycle = 0;
+
+    for (const InputEvent& event : earlier)
+    {
+        Place(0, event.key, event.down);
+    }
+
+    Clock::duration span = std::max(now - last, Clock::duration(1));
+    KeyEvent key;
+    while (queue.TryPop(key))
+    {
+        uint64_t cycle = 0;
+        if (spread)
+        {
+            Clock::time_point time = std::min(std::max(key.time, last), now);
+            cycle = static_cast<uint64_t>((time - last).count()) *
+                    instructionsPerFrame / span.count();
+        }
+        Place(cycle, key.key, key.down);
+    }
+    last = now;
+    return events;
+}
+
+void KeyTimeline::Place(uint64_t cycle, uint8_t key, uint8_t down)
+{
+    cycle = std::max(cycle, nextCycle);
+    if (cycle >= instructionsPerFrame)
+    {
+        carried.push_back({0, key, down});
+        return;
+    }
+    events.push_back({cycle, key, down});
+    nextCycle = cycle + 1;
+}
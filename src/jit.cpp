@@ -0,0 +1,1129 @@
+#include "jit.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <memory>
+
+#ifdef CHIP8_JIT
+#include <sys/mman.h>
+#endif
+
+namespace
+{
+const size_t BUFFER_SIZE = 1u << 20u;
+// Worst case for one block is well under this: 64 instructions, the largest
+// being an unrolled Fx55/Fx65 of 16 moves.
+const size_t MAX_BLOCK_BYTES = 16u << 10u;
+const uint32_t MAX_BLOCK_LENGTH = 64;
+
+// Host register numbers as encoded in ModRM/REX.
+enum HostReg : uint8_t
+{
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    RSP = 4,
+    RBP = 5,
+    RSI = 6,
+    RDI = 7,
+    R8 = 8,
+    R9 = 9,
+    R10 = 10,
+    R11 = 11,
+    R12 = 12,
+    R13 = 13,
+    R14 = 14,
+    R15 = 15
+};
+
+// Registers available for caching guest V0-VF. rdi holds the Chip8 pointer
+// and rax/rcx are scratch.
+const uint8_t HOST_POOL[] = {RBX, RBP, RSI, R8,  R9, R10,
+                             R11, R12, R13, R14, R15};
+const size_t HOST_POOL_SIZE = sizeof(HOST_POOL);
+
+bool IsCalleeSaved(uint8_t reg)
+{
+    return reg == RBX || reg == RBP || reg >= R12;
+}
+
+// Condition codes for Jcc/SETcc.
+enum Cond : uint8_t
+{
+    CC_B = 0x2,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_A = 0x7
+};
+
+// ALU opcodes in their "r/m8, r8" form.
+enum Alu : uint8_t
+{
+    ALU_ADD = 0x00,
+    ALU_OR = 0x08,
+    ALU_AND = 0x20,
+    ALU_SUB = 0x28,
+    ALU_XOR = 0x30,
+    ALU_CMP = 0x38
+};
+
+/*
+Minimal x86-64 encoder covering the handful of forms the translator needs.
+Every memory operand is addressed off rdi, optionally indexed by rax.
+*/
+class Emitter
+{
+public:
+    std::vector<uint8_t> bytes;
+
+    void Byte(uint8_t b) { bytes.push_back(b); }
+
+    void Word(uint16_t w)
+    {
+        Byte(w & 0xFFu);
+        Byte(w >> 8u);
+    }
+
+    void Dword(int32_t d)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            Byte(static_cast<uint32_t>(d) >> (8 * i));
+        }
+    }
+
+    // A REX prefix is always emitted for byte registers so that sil/bpl
+    // are addressable instead of dh/ch.
+    void Rex8(uint8_t reg, uint8_t rm)
+    {
+        Byte(0x40 | (reg >= 8 ? 0x4 : 0) | (rm >= 8 ? 0x1 : 0));
+    }
+
+    void ModRM(uint8_t mod, uint8_t reg, uint8_t rm)
+    {
+        Byte((mod << 6u) | ((reg & 7u) << 3u) | (rm & 7u));
+    }
+
+    // [rdi + disp32]
+    void MemRdi(uint8_t reg, int32_t disp)
+    {
+        ModRM(2, reg, RDI);
+        Dword(disp);
+    }
+
+    // [rdi + rax * scale + disp32], scaleLog2 in 0..3
+    void MemRdiRax(uint8_t reg, uint8_t scaleLog2, int32_t disp)
+    {
+        ModRM(2, reg, RSP);
+        Byte((scaleLog2 << 6u) | (RAX << 3u) | RDI);
+        Dword(disp);
+    }
+
+    // mov r8, [rdi + disp]
+    void LoadByte(uint8_t reg, int32_t disp)
+    {
+        Rex8(reg, 0);
+        Byte(0x8A);
+        MemRdi(reg, disp);
+    }
+
+    // mov [rdi + disp], r8
+    void StoreByte(int32_t disp, uint8_t reg)
+    {
+        Rex8(reg, 0);
+        Byte(0x88);
+        MemRdi(reg, disp);
+    }
+
+    // mov r8, [rdi + rax + disp]
+    void LoadByteIndexed(uint8_t reg, int32_t disp)
+    {
+        Rex8(reg, 0);
+        Byte(0x8A);
+        MemRdiRax(reg, 0, disp);
+    }
+
+    // mov [rdi + rax + disp], r8
+    void StoreByteIndexed(int32_t disp, uint8_t reg)
+    {
+        Rex8(reg, 0);
+        Byte(0x88);
+        MemRdiRax(reg, 0, disp);
+    }
+
+    // mov r8, imm8
+    void MovImm(uint8_t reg, uint8_t imm)
+    {
+        Rex8(0, reg);
+        Byte(0xB0 + (reg & 7u));
+        Byte(imm);
+    }
+
+    // mov dst8, src8
+    void Mov(uint8_t dst, uint8_t src)
+    {
+        Rex8(src, dst);
+        Byte(0x88);
+        ModRM(3, src, dst);
+    }
+
+    // <op> dst8, src8
+    void Alu(Alu op, uint8_t dst, uint8_t src)
+    {
+        Rex8(src, dst);
+        Byte(op);
+        ModRM(3, src, dst);
+    }
+
+    // add dst8, imm8
+    void AddImm(uint8_t dst, uint8_t imm)
+    {
+        Rex8(0, dst);
+        Byte(0x80);
+        ModRM(3, 0, dst);
+        Byte(imm);
+    }
+
+    // cmp dst8, imm8
+    void CmpImm(uint8_t dst, uint8_t imm)
+    {
+        Rex8(0, dst);
+        Byte(0x80);
+        ModRM(3, 7, dst);
+        Byte(imm);
+    }
+
+    // test dst8, imm8
+    void TestImm(uint8_t dst, uint8_t imm)
+    {
+        Rex8(0, dst);
+        Byte(0xF6);
+        ModRM(3, 0, dst);
+        Byte(imm);
+    }
+
+    // shr dst8, 1 / shl dst8, 1
+    void Shr1(uint8_t dst)
+    {
+        Rex8(0, dst);
+        Byte(0xD0);
+        ModRM(3, 5, dst);
+    }
+
+    void Shl1(uint8_t dst)
+    {
+        Rex8(0, dst);
+        Byte(0xD0);
+        ModRM(3, 4, dst);
+    }
+
+    // set<cc> dst8
+    void Set(Cond cc, uint8_t dst)
+    {
+        Rex8(0, dst);
+        Byte(0x0F);
+        Byte(0x90 + cc);
+        ModRM(3, 0, dst);
+    }
+
+    // movzx eax, src8
+    void MovzxEax(uint8_t src)
+    {
+        Rex8(0, src);
+        Byte(0x0F);
+        Byte(0xB6);
+        ModRM(3, RAX, src);
+    }
+
+    // movzx eax, byte [rdi + disp]
+    void MovzxEaxByte(int32_t disp)
+    {
+        Byte(0x0F);
+        Byte(0xB6);
+        MemRdi(RAX, disp);
+    }
+
+    // movzx reg32, word [rdi + disp]
+    void MovzxWord(uint8_t reg, int32_t disp)
+    {
+        Byte(0x0F);
+        Byte(0xB7);
+        MemRdi(reg, disp);
+    }
+
+    // movzx ecx, word [rdi + rax * 2 + disp]
+    void MovzxEcxWordIndexed(int32_t disp)
+    {
+        Byte(0x0F);
+        Byte(0xB7);
+        MemRdiRax(RCX, 1, disp);
+    }
+
+    // mov word [rdi + disp], imm16
+    void StoreWordImm(int32_t disp, uint16_t imm)
+    {
+        Byte(0x66);
+        Byte(0xC7);
+        MemRdi(0, disp);
+        Word(imm);
+    }
+
+    // mov word [rdi + rax * 2 + disp], imm16
+    void StoreWordImmIndexed(int32_t disp, uint16_t imm)
+    {
+        Byte(0x66);
+        Byte(0xC7);
+        MemRdiRax(0, 1, disp);
+        Word(imm);
+    }
+
+    // mov word [rdi + disp], reg16
+    void StoreWord(int32_t disp, uint8_t reg)
+    {
+        Byte(0x66);
+        Byte(0x89);
+        MemRdi(reg, disp);
+    }
+
+    // add word [rdi + disp], ax
+    void AddWordAx(int32_t disp)
+    {
+        Byte(0x66);
+        Byte(0x01);
+        MemRdi(RAX, disp);
+    }
+
+    // add eax, imm32
+    void AddEaxImm(int32_t imm)
+    {
+        Byte(0x05);
+        Dword(imm);
+    }
+
+    // and eax, imm32
+    void AndEaxImm(int32_t imm)
+    {
+        Byte(0x25);
+        Dword(imm);
+    }
+
+    // lea eax, [rax + rax * 4 + disp]
+    void LeaEaxTimes5(int32_t disp)
+    {
+        Byte(0x8D);
+        ModRM(2, RAX, RSP);
+        Byte((2u << 6u) | (RAX << 3u) | RAX);
+        Dword(disp);
+    }
+
+    // inc/dec byte [rdi + disp]
+    void IncByte(int32_t disp)
+    {
+        Byte(0xFE);
+        MemRdi(0, disp);
+    }
+
+    void DecByte(int32_t disp)
+    {
+        Byte(0xFE);
+        MemRdi(1, disp);
+    }
+
+    // cmp byte [rdi + rax + disp], 0
+    void CmpByteIndexedZero(int32_t disp)
+    {
+        Byte(0x80);
+        MemRdiRax(7, 0, disp);
+        Byte(0);
+    }
+
+    // j<cc> rel8; returns the offset of the displacement byte to patch
+    size_t Jump(Cond cc)
+    {
+        Byte(0x70 + cc);
+        Byte(0);
+        return bytes.size() - 1;
+    }
+
+    void Patch(size_t at) { bytes[at] = bytes.size() - at - 1; }
+
+    void Push(uint8_t reg)
+    {
+        if (reg >= 8)
+        {
+            Byte(0x41);
+        }
+        Byte(0x50 + (reg & 7u));
+    }
+
+    void Pop(uint8_t reg)
+    {
+        if (reg >= 8)
+        {
+            Byte(0x41);
+        }
+        Byte(0x58 + (reg & 7u));
+    }
+
+    void Ret() { Byte(0xC3); }
+};
+
+/*
+Guest registers touched by an instruction, used to check host register
+pressure before translating it. Returns false for instructions that are
+left to the interpreter.
+*/
+bool GuestRegsUsed(uint16_t opcode, uint8_t* regs, size_t& count)
+{
+    uint8_t x = (opcode & 0x0F00u) >> 8u;
+    uint8_t y = (opcode & 0x00F0u) >> 4u;
+    count = 0;
+    switch ((opcode & 0xF000u) >> 12u)
+    {
+        case 0x0:
+            // 00EE only; 00E0 and the unused 0nnn forms are interpreted
+            return (opcode & 0x000Fu) == 0xEu;
+        case 0x1:
+        case 0x2:
+        case 0xA:
+            return true;
+        case 0x3:
+        case 0x4:
+        case 0x6:
+        case 0x7:
+            regs[count++] = x;
+            return true;
+        case 0x5:
+        case 0x9:
+            regs[count++] = x;
+            regs[count++] = y;
+            return true;
+        case 0x8:
+            switch (opcode & 0x000Fu)
+            {
+                case 0x0:
+                case 0x1:
+                case 0x2:
+                case 0x3:
+                    regs[count++] = x;
+                    regs[count++] = y;
+                    return true;
+                case 0x4:
+                case 0x5:
+                case 0x7:
+                    regs[count++] = x;
+                    regs[count++] = y;
+                    regs[count++] = VF;
+                    return true;
+                case 0x6:
+                case 0xE:
+                    regs[count++] = x;
+                    regs[count++] = VF;
+                    return true;
+            }
+            return false;
+        case 0xB:
+            regs[count++] = 0;
+            return true;
+        case 0xE:
+            if ((opcode & 0x000Fu) == 0x1u || (opcode & 0x000Fu) == 0xEu)
+            {
+                regs[count++] = x;
+                return true;
+            }
+            return false;
+        case 0xF:
+            switch (opcode & 0x00FFu)
+            {
+                case 0x07:
+                case 0x15:
+                case 0x18:
+                case 0x1E:
+                case 0x29:
+                    regs[count++] = x;
+                    return true;
+                case 0x55:
+                case 0x65:
+                    // V0..Vx are accessed in place without allocating
+                    return true;
+            }
+            return false;
+        default:
+            // Cxkk needs the RNG and Dxyn the framebuffer
+            return false;
+    }
+}
+
+/*
+Per-block mapping of guest registers to host registers. A guest register is
+loaded on first use and written back when the block exits.
+*/
+class RegCache
+{
+public:
+    explicit RegCache(int32_t base) : base(base)
+    {
+        std::fill(std::begin(host), std::end(host), 0xFF);
+        std::fill(std::begin(dirty), std::end(dirty), false);
+    }
+
+    bool Cached(uint8_t guest) const { return host[guest] != 0xFF; }
+    uint8_t Host(uint8_t guest) const { return host[guest]; }
+
+    size_t Missing(const uint8_t* regs, size_t count) const
+    {
+        size_t missing = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            bool seen = false;
+            for (size_t j = 0; j < i; ++j)
+            {
+                seen = seen || regs[j] == regs[i];
+            }
+            if (!seen && !Cached(regs[i]))
+            {
+                ++missing;
+            }
+        }
+        return missing;
+    }
+
+    size_t Free() const { return HOST_POOL_SIZE - used; }
+
+    // Host register holding the guest register's current value.
+    uint8_t Read(Emitter& e, uint8_t guest)
+    {
+        if (!Cached(guest))
+        {
+            host[guest] = HOST_POOL[used++];
+            e.LoadByte(host[guest], base + guest);
+        }
+        return host[guest];
+    }
+
+    // Host register the guest register is about to be overwritten in.
+    uint8_t Write(Emitter& e, uint8_t guest, bool load = true)
+    {
+        if (!Cached(guest))
+        {
+            host[guest] = HOST_POOL[used++];
+            if (load)
+            {
+                e.LoadByte(host[guest], base + guest);
+            }
+        }
+        dirty[guest] = true;
+        return host[guest];
+    }
+
+    void WriteBack(Emitter& e) const
+    {
+        for (uint8_t guest = 0; guest < 16; ++guest)
+        {
+            if (dirty[guest])
+            {
+                e.StoreByte(base + guest, host[guest]);
+            }
+        }
+    }
+
+    size_t Used() const { return used; }
+
+private:
+    int32_t base;
+    uint8_t host[16];
+    bool dirty[16];
+    size_t used = 0;
+};
+} // namespace
+
+bool Jit::Available()
+{
+#ifdef CHIP8_JIT
+    return true;
+#else
+    return false;
+#endif
+}
+
+Jit::Jit(Chip8& chip8) : chip8(chip8)
+{
+    const uint8_t* base = reinterpret_cast<const uint8_t*>(&chip8);
+    auto at = [base](const void* field) {
+        return static_cast<int32_t>(static_cast<const uint8_t*>(field) -
+                                    base);
+    };
+    offsets.registers = at(chip8.registers);
+    offsets.memory = at(chip8.memory);
+    offsets.index = at(&chip8.index);
+    offsets.stack = at(chip8.stack);
+    offsets.sp = at(&chip8.sp);
+    offsets.pc = at(&chip8.pc);
+    offsets.delayTimer = at(&chip8.delayTimer);
+    offsets.soundTimer = at(&chip8.soundTimer);
+    offsets.keypad = at(chip8.keypad);
+
+#ifdef CHIP8_JIT
+    void* mapping = mmap(nullptr, BUFFER_SIZE,
+                         PROT_READ | PROT_WRITE | PROT_EXEC,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping != MAP_FAILED)
+    {
+        buffer = static_cast<uint8_t*>(mapping);
+        bufferSize = BUFFER_SIZE;
+    }
+#endif
+    Flush();
+}
+
+Jit::~Jit()
+{
+#ifdef CHIP8_JIT
+    if (buffer)
+    {
+        munmap(buffer, bufferSize);
+    }
+#endif
+}
+
+void Jit::Flush()
+{
+    std::fill(std::begin(blockAt), std::end(blockAt), NONE);
+    blocks.clear();
+    bufferUsed = 0;
+}
+
+void Jit::Run(uint32_t cycles)
+{
+    if (!buffer)
+    {
+        chip8.Run(cycles);
+        return;
+    }
+    while (cycles > 0)
+    {
+        cycles -= Step(cycles);
+    }
+}
+
+uint32_t Jit::Step(uint32_t maxCycles)
+{
+    uint16_t pc = chip8.pc;
+    if (buffer && pc <= MEMORY_SIZE - 2)
+    {
+        const Block& block = FindBlock(pc);
+        if (block.code && block.count <= maxCycles)
+        {
+            uint32_t count = block.count;
+            uint8_t writeLength = block.writeLength;
+            block.code(&chip8);
+            // Only a trailing Fx55 writes guest memory inside a block
+            if (writeLength)
+            {
+                Invalidate(chip8.index, writeLength);
+            }
+            return count;
+        }
+    }
+
+    // Fx55 may move I past what it wrote, depending on the quirk profile
+    uint16_t opcode = chip8.OpcodeAt(pc);
+    uint16_t index = chip8.index;
+    chip8.Cycle();
+    if ((opcode & 0xF0FFu) == 0xF033u)
+    {
+        Invalidate(index, 3);
+    }
+    else if ((opcode & 0xF0FFu) == 0xF055u)
+    {
+        Invalidate(index, ((opcode & 0x0F00u) >> 8u) + 1);
+    }
+    else if (chip8.opClasses[opcode] ==
+             Chip8::OpClass(0x5002, QuirkProfile::XoChip))
+    {
+        uint8_t x = (opcode & 0x0F00u) >> 8u;
+        uint8_t y = (opcode & 0x00F0u) >> 4u;
+        Invalidate(index, (x <= y ? y - x : x - y) + 1);
+    }
+    return 1;
+}
+
+const Jit::Block& Jit::FindBlock(uint16_t address)
+{
+    uint16_t id = blockAt[address];
+    if (id != NONE)
+    {
+        return blocks[id];
+    }
+
+    if (bufferSize - bufferUsed < MAX_BLOCK_BYTES || blocks.size() >= NONE)
+    {
+        Flush();
+    }
+
+    blockAt[address] = static_cast<uint16_t>(blocks.size());
+    blocks.push_back(Compile(address));
+    return blocks.back();
+}
+
+/*
+Translate the straight-line run starting at address. The block rules match
+Chip8::FindBlock, so a translated block always covers the same instructions
+the block interpreter would run in one dispatch, cut short where an
+instruction is interpreted or the host runs out of registers.
+*/
+Jit::Block Jit::Compile(uint16_t address)
+{
+    Block block;
+    block.code = nullptr;
+    block.start = address;
+    block.end = address;
+    block.count = 0;
+    block.writeLength = 0;
+    block.valid = true;
+
+    const Offsets& o = offsets;
+    Emitter e;
+    RegCache regs(o.registers);
+    bool wrotePc = false;
+    // eax = I + i wrapped to memory, the byte Fx55/Fx65 move for Vi
+    auto wrappedIndex = [&](uint8_t i)
+    {
+        e.MovzxWord(RAX, o.index);
+        if (i)
+        {
+            e.AddEaxImm(i);
+        }
+        e.AndEaxImm(ADDRESS_MASK);
+    };
+
+    uint16_t addr = address;
+    while (addr <= MEMORY_SIZE - 2 && block.count < MAX_BLOCK_LENGTH)
+    {
+        uint16_t opcode = (chip8.memory[addr] << 8u) | chip8.memory[addr + 1];
+        uint8_t used[3];
+        size_t usedCount;
+        // Translations follow the Default quirks; other profiles leave the
+        // opcodes they change to the interpreter
+        if (!GuestRegsUsed(opcode, used, usedCount) ||
+            regs.Missing(used, usedCount) > regs.Free() ||
+            Chip8::QuirksAffect(chip8.quirks, chip8.opClasses[opcode]))
+        {
+            break;
+        }
+
+        uint8_t x = (opcode & 0x0F00u) >> 8u;
+        uint8_t y = (opcode & 0x00F0u) >> 4u;
+        uint8_t kk = opcode & 0x00FFu;
+        uint16_t nnn = opcode & 0x0FFFu;
+        uint16_t next = addr + 2;
+
+        switch ((opcode & 0xF000u) >> 12u)
+        {
+            case 0x0: // 00EE
+                e.DecByte(o.sp);
+                e.MovzxEaxByte(o.sp);
+                e.AndEaxImm(0xF);
+                e.MovzxEcxWordIndexed(o.stack);
+                e.StoreWord(o.pc, RCX);
+                break;
+            case 0x1:
+                e.StoreWordImm(o.pc, nnn);
+                break;
+            case 0x2:
+                e.MovzxEaxByte(o.sp);
+                e.AndEaxImm(0xF);
+                e.StoreWordImmIndexed(o.stack, next);
+                e.IncByte(o.sp);
+                e.StoreWordImm(o.pc, nnn);
+                break;
+            case 0x3:
+            case 0x4:
+            {
+                uint8_t vx = regs.Read(e, x);
+                e.StoreWordImm(o.pc, next);
+                e.CmpImm(vx, kk);
+                size_t skip = e.Jump(opcode >> 12u == 0x3 ? CC_NE : CC_E);
+                e.StoreWordImm(o.pc, next + 2);
+                e.Patch(skip);
+                break;
+            }
+            case 0x5:
+            case 0x9:
+            {
+                uint8_t vx = regs.Read(e, x);
+                uint8_t vy = regs.Read(e, y);
+                e.StoreWordImm(o.pc, next);
+                e.Alu(ALU_CMP, vx, vy);
+                size_t skip = e.Jump(opcode >> 12u == 0x5 ? CC_NE : CC_E);
+                e.StoreWordImm(o.pc, next + 2);
+                e.Patch(skip);
+                break;
+            }
+            case 0x6:
+                e.MovImm(regs.Write(e, x, false), kk);
+                break;
+            case 0x7:
+                e.AddImm(regs.Write(e, x), kk);
+                break;
+            case 0x8:
+            {
+                // Same statement order as the OP_8xy* handlers so that the
+                // x == F and y == F cases alias identically.
+                uint8_t op = opcode & 0x000Fu;
+                uint8_t vy = op == 0x6 || op == 0xE
+                                 ? static_cast<uint8_t>(RAX)
+                                 : regs.Read(e, y);
+                uint8_t vx = regs.Write(e, x);
+                switch (op)
+                {
+                    case 0x0:
+                        e.Mov(vx, vy);
+                        break;
+                    case 0x1:
+                        e.Alu(ALU_OR, vx, vy);
+                        break;
+                    case 0x2:
+                        e.Alu(ALU_AND, vx, vy);
+                        break;
+                    case 0x3:
+                        e.Alu(ALU_XOR, vx, vy);
+                        break;
+                    case 0x4:
+                        e.Mov(RAX, vx);
+                        e.Alu(ALU_ADD, RAX, vy);
+                        e.Set(CC_B, regs.Write(e, VF));
+                        e.Mov(vx, RAX);
+                        break;
+                    case 0x5:
+                        e.Alu(ALU_CMP, vx, vy);
+                        e.Set(CC_A, regs.Write(e, VF));
+                        e.Alu(ALU_SUB, vx, vy);
+                        break;
+                    case 0x6:
+                        e.TestImm(vx, 0x1u);
+                        e.Set(CC_NE, regs.Write(e, VF));
+                        e.Shr1(vx);
+                        break;
+                    case 0x7:
+                        e.Alu(ALU_CMP, vy, vx);
+                        e.Set(CC_A, regs.Write(e, VF));
+                        e.Mov(RAX, vy);
+                        e.Alu(ALU_SUB, RAX, vx);
+                        e.Mov(vx, RAX);
+                        break;
+                    case 0xE:
+                        e.TestImm(vx, 0x80u);
+                        e.Set(CC_NE, regs.Write(e, VF));
+                        e.Shl1(vx);
+                        break;
+                }
+                break;
+            }
+            case 0xA:
+                e.StoreWordImm(o.index, nnn);
+                break;
+            case 0xB:
+                e.MovzxEax(regs.Read(e, 0));
+                e.AddEaxImm(nnn);
+                e.StoreWord(o.pc, RAX);
+                break;
+            case 0xE:
+            {
+                // Ex9E skips when the key is down, ExA1 when it is up; keys
+                // past F read as released
+                bool skipIfDown = (opcode & 0x000Fu) == 0xEu;
+                uint8_t vx = regs.Read(e, x);
+                e.StoreWordImm(o.pc, next);
+                e.CmpImm(vx, 0xF);
+                size_t noKey = e.Jump(CC_A);
+                e.MovzxEax(vx);
+                e.CmpByteIndexedZero(o.keypad);
+                size_t skip = e.Jump(skipIfDown ? CC_E : CC_NE);
+                if (!skipIfDown)
+                {
+                    e.Patch(noKey);
+                }
+                e.StoreWordImm(o.pc, next + 2);
+                e.Patch(skip);
+                if (skipIfDown)
+                {
+                    e.Patch(noKey);
+                }
+                break;
+            }
+            case 0xF:
+                switch (kk)
+                {
+                    case 0x07:
+                        e.LoadByte(regs.Write(e, x, false), o.delayTimer);
+                        break;
+                    case 0x15:
+                        e.StoreByte(o.delayTimer, regs.Read(e, x));
+                        break;
+                    case 0x18:
+                        e.StoreByte(o.soundTimer, regs.Read(e, x));
+                        break;
+                    case 0x1E:
+                        e.MovzxEax(regs.Read(e, x));
+                        e.AddWordAx(o.index);
+                        break;
+                    case 0x29:
+                        e.MovzxEax(regs.Read(e, x));
+                        e.LeaEaxTimes5(FONTSET_START_ADDRESS);
+                        e.StoreWord(o.index, RAX);
+                        break;
+                    case 0x55:
+                        for (uint8_t i = 0; i <= x; ++i)
+                        {
+                            wrappedIndex(i);
+                            uint8_t src = RCX;
+                            if (regs.Cached(i))
+                            {
+                                src = regs.Host(i);
+                            }
+                            else
+                            {
+                                e.LoadByte(RCX, o.registers + i);
+                            }
+                            e.StoreByteIndexed(o.memory, src);
+                        }
+                        e.StoreWordImm(o.pc, next);
+                        block.writeLength = x + 1;
+                        break;
+                    case 0x65:
+                        for (uint8_t i = 0; i <= x; ++i)
+                        {
+                            wrappedIndex(i);
+                            if (regs.Cached(i))
+                            {
+                                e.LoadByteIndexed(regs.Write(e, i),
+                                                  o.memory);
+                            }
+                            else
+                            {
+                                e.LoadByteIndexed(RCX, o.memory);
+                                e.StoreByte(o.registers + i, RCX);
+                            }
+                        }
+                        break;
+                }
+                break;
+        }
+
+        ++block.count;
+        addr = next;
+        if (Chip8::EndsBlock(opcode))
+        {
+            wrotePc = true;
+            break;
+        }
+    }
+    block.end = addr;
+
+    if (block.count == 0)
+    {
+        return block;
+    }
+
+    if (!wrotePc)
+    {
+        e.StoreWordImm(o.pc, addr);
+    }
+    regs.WriteBack(e);
+
+    std::vector<uint8_t> saved;
+    for (size_t i = 0; i < regs.Used(); ++i)
+    {
+        if (IsCalleeSaved(HOST_POOL[i]))
+        {
+            saved.push_back(HOST_POOL[i]);
+        }
+    }
+
+    uint8_t* out = buffer + bufferUsed;
+    Emitter prologue;
+    for (uint8_t reg : saved)
+    {
+        prologue.Push(reg);
+    }
+    Emitter epilogue;
+    for (auto it = saved.rbegin(); it != saved.rend(); ++it)
+    {
+        epilogue.Pop(*it);
+    }
+    epilogue.Ret();
+
+    uint8_t* p = out;
+    p = std::copy(prologue.bytes.begin(), prologue.bytes.end(), p);
+    p = std::copy(e.bytes.begin(), e.bytes.end(), p);
+    p = std::copy(epilogue.bytes.begin(), epilogue.bytes.end(), p);
+    bufferUsed += p - out;
+
+    block.code = reinterpret_cast<BlockFunc>(out);
+    return block;
+}
+
+/*
+Drop translated blocks overlapping a guest memory write, along with the
+machine's own predecoded blocks there. Their code stays in the buffer until
+the next flush; it simply becomes unreachable.
+*/
+void Jit::Invalidate(uint16_t address, uint16_t length)
+{
+    chip8.InvalidateCode(address, length);
+    auto drop = [this](uint32_t begin, uint32_t end)
+    {
+        for (Block& block : blocks)
+        {
+            if (block.valid && block.start < end && begin < block.end)
+            {
+                block.valid = false;
+                blockAt[block.start] = NONE;
+            }
+        }
+    };
+
+    // As in Chip8::InvalidateCode: XO-CHIP's high memory holds no code, and
+    // other profiles alias every address onto the 4 KB
+    if (chip8.quirks == QuirkProfile::XoChip)
+    {
+        uint32_t end = static_cast<uint32_t>(address) + length;
+        if (end > XO_MEMORY_SIZE)
+        {
+            drop(0, end - XO_MEMORY_SIZE);
+        }
+        if (address < MEMORY_SIZE)
+        {
+            drop(address, std::min<uint32_t>(end, MEMORY_SIZE));
+        }
+        return;
+    }
+    address &= ADDRESS_MASK;
+    uint32_t end = static_cast<uint32_t>(address) + length;
+    if (end > MEMORY_SIZE)
+    {
+        drop(0, end - MEMORY_SIZE);
+        end = MEMORY_SIZE;
+    }
+    drop(address, end);
+}
+
+bool Jit::SameState(const Chip8& a, const Chip8& b, std::ostream& out)
+{
+    struct Field
+    {
+        const char* name;
+        const void* left;
+        const void* right;
+        size_t size;
+    };
+    const Field fields[] = {
+        {"registers", a.registers, b.registers, sizeof(a.registers)},
+        {"index", &a.index, &b.index, sizeof(a.index)},
+        {"pc", &a.pc, &b.pc, sizeof(a.pc)},
+        {"sp", &a.sp, &b.sp, sizeof(a.sp)},
+        {"stack", a.stack, b.stack, sizeof(a.stack)},
+        {"delayTimer", &a.delayTimer, &b.delayTimer, sizeof(a.delayTimer)},
+        {"soundTimer", &a.soundTimer, &b.soundTimer, sizeof(a.soundTimer)},
+        {"rngState", &a.rngState, &b.rngState, sizeof(a.rngState)},
+        {"memory", a.memory, b.memory, sizeof(a.memory)},
+        {"video", a.video, b.video, sizeof(a.video)},
+    };
+
+    bool same = true;
+    for (const Field& field : fields)
+    {
+        if (std::memcmp(field.left, field.right, field.size) != 0)
+        {
+            out << "  " << field.name << " differs\n";
+            same = false;
+        }
+    }
+    const Chip8::Extension* left = a.extension.get();
+    const Chip8::Extension* right = b.extension.get();
+    if (left && right)
+    {
+        const ExtendedDisplay& l = left->display;
+        const ExtendedDisplay& r = right->display;
+        if (std::memcmp(l.rows, r.rows, sizeof(l.rows)) != 0 ||
+            l.hires != r.hires || l.planes != r.planes ||
+            std::memcmp(left->flags, right->flags, sizeof(left->flags)) ||
+            std::memcmp(left->audio, right->audio, sizeof(left->audio)) ||
+            left->pitch != right->pitch || left->high != right->high)
+        {
+            out << "  extension differs\n";
+            same = false;
+        }
+    }
+    else if (left || right)
+    {
+        out << "  extension differs\n";
+        same = false;
+    }
+    if (!same)
+    {
+        out << "  jit pc=" << std::hex << a.pc << " interpreter pc=" << b.pc
+            << std::dec << "\n  jit V:";
+        for (uint8_t v : a.registers)
+        {
+            out << " " << unsigned(v);
+        }
+        out << "\n  int V:";
+        for (uint8_t v : b.registers)
+        {
+            out << " " << unsigned(v);
+        }
+        out << "\n";
+    }
+    return same;
+}
+
+bool Jit::Differential(const char* romFileName, uint32_t seed,
+                       uint64_t cycles, std::ostream& out,
+                       QuirkProfile quirks)
+{
+    std::unique_ptr<Chip8> translated(new Chip8(seed));
+    std::unique_ptr<Chip8> reference(new Chip8(seed));
+    translated->SetQuirks(quirks);
+    reference->SetQuirks(quirks);
+    if (!translated->LoadROM(romFileName) || !reference->LoadROM(romFileName))
+    {
+        out << "Failed to load ROM: " << romFileName << "\n";
+        return false;
+    }
+    if (!Available())
+    {
+        out << "JIT not available in this build\n";
+        return false;
+    }
+
+    Jit jit(*translated);
+    uint64_t executed = 0;
+    uint64_t steps = 0;
+    while (executed < cycles)
+    {
+        uint16_t pc = translated->pc;
+        uint32_t budget = static_cast<uint32_t>(
+            std::min<uint64_t>(cycles - executed, MAX_BLOCK_LENGTH));
+        uint32_t count = jit.Step(budget);
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            reference->Cycle();
+        }
+        executed += count;
+        ++steps;
+
+        if (!SameState(*translated, *reference, out))
+        {
+            out << "Divergence in block at " << std::hex << pc << std::dec
+                << " after " << executed << " instructions\n";
+            return false;
+        }
+    }
+    out << "OK: " << executed << " instructions in " << steps
+        << " steps, no divergence\n";
+    return true;
+}
@@ -0,0 +1,507 @@
+#include "lockstep.hpp"
+#include "rom.hpp"
+#include <algorithm>
+
+namespace
+{
+// Lane counts are rounded up to a multiple of this, so every column loop
+// covers whole vectors even at AVX-512 width. Padding lanes never run.
+const size_t LANE_ALIGN = 64;
+// Above any real pc; the lowest-pc search returns it when no lane is due.
+const uint32_t NO_TARGET = 0x10000;
+
+constexpr uint8_t Op(uint16_t opcode) { return Chip8::OpClass(opcode); }
+
+// mask ? a : b for a lane mask of 0xFF or 0. Written as bit operations so
+// the loops using it have no branches and no conditional loads to stop the
+// compiler from vectorizing them.
+template <typename T>
+inline T Select(uint8_t mask, T a, T b)
+{
+    T wide = static_cast<T>(static_cast<int8_t>(mask));
+    return (a & wide) | (b & ~wide);
+}
+} // namespace
+
+Lockstep::Lockstep(const std::vector<uint32_t>& seeds)
+    : lanes(seeds.size()),
+      stride((seeds.size() + LANE_ALIGN - 1) / LANE_ALIGN * LANE_ALIGN),
+      registers(16 * stride), pc(stride, START_ADDRESS), index(stride),
+      stack(16 * stride), sp(stride), delayTimer(stride), soundTimer(stride),
+      keypads(stride), remaining(stride), active(stride),
+      written(MEMORY_SIZE)
+{
+    for (uint32_t seed : seeds)
+    {
+        machines.emplace_back(new Chip8(seed));
+    }
+    Chip8 blank(0);
+    memcpy(image, blank.memory, MEMORY_SIZE);
+}
+
+bool Lockstep::SetQuirks(QuirkProfile profile)
+{
+    bool fits = true;
+    for (std::unique_ptr<Chip8>& machine : machines)
+    {
+        fits = machine->SetQuirks(profile) && fits;
+    }
+    quirks = profile;
+    // SuperChip and XoChip load the big font too
+    if (!machines.empty())
+    {
+        machines.front()->BuildBaseImage(image);
+    }
+    return fits;
+}
+
+bool Lockstep::LoadROM(std::shared_ptr<const RomImage> rom)
+{
+    if (!rom || rom->Size() > Chip8::RomCapacity(quirks))
+    {
+        return false;
+    }
+    for (std::unique_ptr<Chip8>& machine : machines)
+    {
+        machine->LoadROM(rom);
+    }
+    Chip8 blank(0);
+    blank.SetQuirks(quirks);
+    blank.LoadROM(rom);
+    memcpy(image, blank.memory, MEMORY_SIZE);
+    written.assign(MEMORY_SIZE, false);
+    return true;
+}
+
+/*
+Each pass picks the lowest pc among lanes with instructions left and runs
+that one instruction for every lane sitting on it. Picking the lowest keeps
+lanes that branched forward waiting at the join point, so lanes that skip
+different instructions of an if come back together right after it.
+*/
+void Lockstep::Run(uint32_t cycles)
+{
+    const size_t n = stride;
+    uint32_t* left = remaining.data();
+    uint16_t* p = pc.data();
+    uint8_t* on = active.data();
+    std::fill(left, left + lanes, cycles);
+
+    while (true)
+    {
+        uint32_t target = NO_TARGET;
+        for (size_t i = 0; i < n; ++i)
+        {
+            uint32_t candidate = p[i] | (left[i] ? 0 : NO_TARGET);
+            target = std::min(target, candidate);
+        }
+        if (target == NO_TARGET)
+        {
+            return;
+        }
+        // Select the lanes at target and step them past it, as Cycle() does
+        // before calling a handler
+        uint16_t next = target + 2;
+        for (size_t i = 0; i < n; ++i)
+        {
+            uint8_t here = -uint8_t((left[i] != 0) & (p[i] == target));
+            on[i] = here;
+            p[i] = Select(here, next, p[i]);
+        }
+
+        if (target > MEMORY_SIZE - 2)
+        {
+            // Fetching past the end of memory; leave it to each machine
+            for (size_t i = 0; i < lanes; ++i)
+            {
+                if (on[i])
+                {
+                    p[i] = target;
+                    Spill(i);
+                    machines[i]->Cycle();
+                    Fill(i);
+                }
+            }
+        }
+        else if (!written[target] && !written[target + 1])
+        {
+            uint16_t opcode = (image[target] << 8u) | image[target + 1];
+            Execute(machines.front()->Decode(opcode));
+        }
+        else
+        {
+            // Code some lane has overwritten: run the lanes whose bytes
+            // match the first lane's, and the rest on a later pass
+            size_t leader = std::find(on, on + lanes, 0xFF) - on;
+            const uint8_t* code = machines[leader]->memory + target;
+            for (size_t i = leader; i < lanes; ++i)
+            {
+                const uint8_t* mine = machines[i]->memory + target;
+                if (on[i] && (mine[0] != code[0] || mine[1] != code[1]))
+                {
+                    on[i] = 0;
+                    p[i] = target;
+                }
+            }
+            Execute(machines[leader]->Decode((code[0] << 8u) | code[1]));
+        }
+
+        uint64_t ran = 0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            uint32_t step = on[i] & 1u;
+            left[i] -= step;
+            ran += step;
+        }
+        laneInstructions += ran;
+        ++steps;
+    }
+}
+
+/*
+The column loops below mirror the OP_* handler of the same opcode statement
+for statement, including the order VF and Vx are written in, so they agree
+with the interpreter when x or y is F. Every write is a select on the
+active mask rather than a branch. They have the Default quirks built in;
+under any other profile the opcodes it changes run through that profile's
+handlers instead.
+*/
+void Lockstep::Execute(const Instr& in)
+{
+    if (Chip8::QuirksAffect(quirks, in.op))
+    {
+        RunHandlers(in);
+        return;
+    }
+
+    // Everything in locals: a store through a uint8_t column may alias any
+    // member as far as the compiler knows, which would stop vectorization
+    const size_t n = stride;
+    const uint8_t* on = active.data();
+    uint16_t* p = pc.data();
+    uint16_t* I = index.data();
+    uint8_t* delay = delayTimer.data();
+    uint8_t* sound = soundTimer.data();
+    uint8_t* vx = V(in.x);
+    uint8_t* vy = V(in.y);
+    uint8_t* vf = V(VF);
+    uint8_t* v0 = V(0);
+    uint8_t kk = in.imm & 0xFFu;
+    uint16_t nnn = in.imm;
+
+    switch (in.op)
+    {
+        case Op(0x1000):
+            for (size_t i = 0; i < n; ++i)
+            {
+                p[i] = Select(on[i], nnn, p[i]);
+            }
+            break;
+        case Op(0x2000):
+            // The stack is indexed per lane, so this one stays scalar
+            for (size_t i = 0; i < lanes; ++i)
+            {
+                if (on[i])
+                {
+                    Stack(sp[i] & 0xFu)[i] = p[i];
+                    ++sp[i];
+                    p[i] = nnn;
+                }
+            }
+            break;
+        case Op(0x00EE):
+            for (size_t i = 0; i < lanes; ++i)
+            {
+                if (on[i])
+                {
+                    --sp[i];
+                    p[i] = Stack(sp[i] & 0xFu)[i];
+                }
+            }
+            break;
+        case Op(0x3000):
+            for (size_t i = 0; i < n; ++i)
+            {
+                p[i] += on[i] & ((vx[i] == kk) << 1);
+            }
+            break;
+        case Op(0x4000):
+            for (size_t i = 0; i < n; ++i)
+            {
+                p[i] += on[i] & ((vx[i] != kk) << 1);
+            }
+            break;
+        case Op(0x5000):
+            for (size_t i = 0; i < n; ++i)
+            {
+                p[i] += on[i] & ((vx[i] == vy[i]) << 1);
+            }
+            break;
+        case Op(0x9000):
+            for (size_t i = 0; i < n; ++i)
+            {
+                p[i] += on[i] & ((vx[i] != vy[i]) << 1);
+            }
+            break;
+        case Op(0x6000):
+            for (size_t i = 0; i < n; ++i)
+            {
+                vx[i] = Select(on[i], kk, vx[i]);
+            }
+            break;
+        case Op(0x7000):
+            for (size_t i = 0; i < n; ++i)
+            {
+                vx[i] = Select(on[i], uint8_t(vx[i] + kk), vx[i]);
+            }
+            break;
+        case Op(0x8000):
+            for (size_t i = 0; i < n; ++i)
+            {
+                vx[i] = Select(on[i], vy[i], vx[i]);
+            }
+            break;
+        case Op(0x8001):
+            for (size_t i = 0; i < n; ++i)
+            {
+                vx[i] = Select(on[i], uint8_t(vx[i] | vy[i]), vx[i]);
+            }
+            break;
+        case Op(0x8002):
+            for (size_t i = 0; i < n; ++i)
+            {
+                vx[i] = Select(on[i], uint8_t(vx[i] & vy[i]), vx[i]);
+            }
+            break;
+        case Op(0x8003):
+            for (size_t i = 0; i < n; ++i)
+            {
+                vx[i] = Select(on[i], uint8_t(vx[i] ^ vy[i]), vx[i]);
+            }
+            break;
+        case Op(0x8004):
+            for (size_t i = 0; i < n; ++i)
+            {
+                uint8_t sum = vx[i] + vy[i];
+                uint8_t carry = sum < vx[i];
+                vf[i] = Select(on[i], carry, vf[i]);
+                vx[i] = Select(on[i], sum, vx[i]);
+            }
+            break;
+        case Op(0x8005):
+            for (size_t i = 0; i < n; ++i)
+            {
+                uint8_t notBorrow = vx[i] > vy[i];
+                vf[i] = Select(on[i], notBorrow, vf[i]);
+                vx[i] = Select(on[i], uint8_t(vx[i] - vy[i]), vx[i]);
+            }
+            break;
+        case Op(0x8006):
+            for (size_t i = 0; i < n; ++i)
+            {
+                uint8_t low = vx[i] & 0x1u;
+                vf[i] = Select(on[i], low, vf[i]);
+                vx[i] = Select(on[i], uint8_t(vx[i] >> 1u), vx[i]);
+            }
+            break;
+        case Op(0x8007):
+            for (size_t i = 0; i < n; ++i)
+            {
+                uint8_t notBorrow = vx[i] < vy[i];
+                vf[i] = Select(on[i], notBorrow, vf[i]);
+                vx[i] = Select(on[i], uint8_t(vy[i] - vx[i]), vx[i]);
+            }
+            break;
+        case Op(0x800E):
+            for (size_t i = 0; i < n; ++i)
+            {
+                uint8_t high = vx[i] >> 7u;
+                vf[i] = Select(on[i], high, vf[i]);
+                vx[i] = Select(on[i], uint8_t(vx[i] << 1u), vx[i]);
+            }
+            break;
+        case Op(0xA000):
+            for (size_t i = 0; i < n; ++i)
+            {
+                I[i] = Select(on[i], nnn, I[i]);
+            }
+            break;
+        case Op(0xB000):
+            for (size_t i = 0; i < n; ++i)
+            {
+                p[i] = Select(on[i], uint16_t(nnn + v0[i]), p[i]);
+            }
+            break;
+        case Op(0xE09E):
+        case Op(0xE0A1):
+        {
+            // Keys past F read as released
+            uint16_t* keys = keypads.data();
+            bool skipIfPressed = in.op == Op(0xE09E);
+            for (size_t i = 0; i < n; ++i)
+            {
+                uint32_t pressed = (vx[i] < 16) & (keys[i] >> (vx[i] & 0xFu));
+                p[i] += on[i] & (((pressed & 1u) == skipIfPressed) << 1);
+            }
+            break;
+        }
+        case Op(0xF007):
+            for (size_t i = 0; i < n; ++i)
+            {
+                vx[i] = Select(on[i], delay[i], vx[i]);
+            }
+            break;
+        case Op(0xF015):
+            for (size_t i = 0; i < n; ++i)
+            {
+                delay[i] = Select(on[i], vx[i], delay[i]);
+            }
+            break;
+        case Op(0xF018):
+            for (size_t i = 0; i < n; ++i)
+            {
+                sound[i] = Select(on[i], vx[i], sound[i]);
+            }
+            break;
+        case Op(0xF01E):
+            for (size_t i = 0; i < n; ++i)
+            {
+                I[i] = Select(on[i], uint16_t(I[i] + vx[i]), I[i]);
+            }
+            break;
+        case Op(0xF029):
+            for (size_t i = 0; i < n; ++i)
+            {
+                uint16_t glyph = FONTSET_START_ADDRESS + 5 * vx[i];
+                I[i] = Select(on[i], glyph, I[i]);
+            }
+            break;
+        case Chip8::OP_CLASS_COUNT - 1:
+            break;
+        default:
+            RunHandlers(in);
+            break;
+    }
+}
+
+/*
+Instructions that touch memory, the framebuffer, the RNG or wait for a key
+go through the interpreter's own handler on each lane's Chip8.
+*/
+void Lockstep::RunHandlers(const Instr& in)
+{
+    const uint8_t* on = active.data();
+    // XoChip sends the key skips here too, to step over F000 nnnn
+    bool readsKeys = in.op == Op(0xF00A) || in.op == Op(0xE09E) ||
+                     in.op == Op(0xE0A1);
+    uint32_t length = 0;
+    if (in.op == Op(0xF033))
+    {
+        length = 3;
+    }
+    else if (in.op == Op(0xF055))
+    {
+        length = in.x + 1u;
+    }
+    else if (in.op == Chip8::OpClass(0x5002, QuirkProfile::XoChip))
+    {
+        length = (in.x <= in.y ? in.y - in.x : in.x - in.y) + 1u;
+    }
+
+    for (size_t i = 0; i < lanes; ++i)
+    {
+        if (!on[i])
+        {
+            continue;
+        }
+        // None of these handlers use the stack or timers, so only the
+        // registers, pc and index make the trip
+        Chip8& machine = *machines[i];
+        for (unsigned int r = 0; r < 16; ++r)
+        {
+            machine.registers[r] = V(r)[i];
+        }
+        machine.pc = pc[i];
+        machine.index = index[i];
+        if (readsKeys)
+        {
+            for (unsigned int key = 0; key < 16; ++key)
+            {
+                machine.keypad[key] = (keypads[i] >> key) & 1u;
+            }
+        }
+
+        in.handler(machine, in);
+
+        for (unsigned int r = 0; r < 16; ++r)
+        {
+            V(r)[i] = machine.registers[r];
+        }
+        pc[i] = machine.pc;
+        uint16_t start = index[i];
+        index[i] = machine.index;
+
+        for (uint32_t a = start; a < start + length; ++a)
+        {
+            // XO-CHIP's high memory never holds code the lanes share
+            uint32_t address = quirks == QuirkProfile::XoChip
+                                   ? a & (XO_MEMORY_SIZE - 1)
+                                   : a & ADDRESS_MASK;
+            if (address < MEMORY_SIZE)
+            {
+                written[address] = true;
+            }
+        }
+    }
+}
+
+void Lockstep::TickTimers()
+{
+    const size_t n = stride;
+    uint8_t* delay = delayTimer.data();
+    uint8_t* sound = soundTimer.data();
+    for (size_t i = 0; i < n; ++i)
+    {
+        delay[i] -= delay[i] != 0;
+        sound[i] -= sound[i] != 0;
+    }
+}
+
+const Chip8& Lockstep::Machine(size_t lane)
+{
+    Spill(lane);
+    return *machines[lane];
+}
+
+// Copy a lane's columns into its Chip8.
+void Lockstep::Spill(size_t lane)
+{
+    Chip8& machine = *machines[lane];
+    for (unsigned int r = 0; r < 16; ++r)
+    {
+        machine.registers[r] = V(r)[lane];
+        machine.stack[r] = Stack(r)[lane];
+        machine.keypad[r] = (keypads[lane] >> r) & 1u;
+    }
+    machine.pc = pc[lane];
+    machine.index = index[lane];
+    machine.sp = sp[lane];
+    machine.delayTimer = delayTimer[lane];
+    machine.soundTimer = soundTimer[lane];
+}
+
+// Copy a lane's Chip8 back into the columns.
+void Lockstep::Fill(size_t lane)
+{
+    const Chip8& machine = *machines[lane];
+    for (unsigned int r = 0; r < 16; ++r)
+    {
+        V(r)[lane] = machine.registers[r];
+        Stack(r)[lane] = machine.stack[r];
+    }
+    pc[lane] = machine.pc;
+    index[lane] = machine.index;
+    sp[lane] = machine.sp;
+    delayTimer[lane] = machine.delayTimer;
+    soundTimer[lane] = machine.soundTimer;
+}
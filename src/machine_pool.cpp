@@ -0,0 +1,39 @@
+#include "machine_pool.hpp"
+#include "rom.hpp"
+
+MachinePool::MachinePool(std::shared_ptr<const RomImage> rom,
+                         size_t capacity, QuirkProfile quirks)
+    : capacity(capacity), slots(new Slot[capacity])
+{
+    free.reserve(capacity);
+    // Last in first out, so the machine most recently released, and most
+    // likely still in this core's cache, goes out next
+    for (size_t i = capacity; i-- > 0;)
+    {
+        slots[i].machine.SetQuirks(quirks);
+        slots[i].machine.LoadROM(rom);
+        free.push_back(&slots[i].machine);
+    }
+}
+
+Chip8* MachinePool::Acquire(uint32_t seed)
+{
+    Chip8* machine;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (free.empty())
+        {
+            return nullptr;
+        }
+        machine = free.back();
+        free.pop_back();
+    }
+    machine->Reset(seed);
+    return machine;
+}
+
+void MachinePool::Release(Chip8* machine)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    free.push_back(machine);
+}
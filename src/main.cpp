@@ -1,46 +1,999 @@
+#include "batch.hpp"
+#include "capture.hpp"
 #include "chip8.hpp"
+#include "delta.hpp"
+#include "framebuffer.hpp"
+#include "jit.hpp"
+#include "movie.hpp"
 #include "platform.hpp"
+#include "profiler.hpp"
+#include "quirks.hpp"
+#include "rewind.hpp"
+#include "rom.hpp"
+#include "scheduler.hpp"
+#include "server.hpp"
+#include "spsc_queue.hpp"
+#include "triple_buffer.hpp"
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
 
-int main(int argc, char* argv[])
+// History kept for rewinding; at a few KB per second this is minutes.
+static const size_t REWIND_BUDGET = 8 << 20;
+
+/*
+Handle --quirks NAME, which runs every ROM under one profile, or
+--quirks-db FILE, which picks each ROM's from a database. False, with a
+message, for an unknown profile or a bad file.
+*/
+static bool QuirkOption(const std::string& option, const char* value,
+                        QuirkDatabase& quirks)
 {
-    if (argc != 4)
+    if (option == "--quirks-db")
     {
-        std::cerr << "Usage:" << argv[0] << " <Scale> <Delay> <ROM>\n";
-        std::exit(EXIT_FAILURE);
+        if (!quirks.Load(value))
+        {
+            std::cerr << "Bad quirk database: " << value << "\n";
+            return false;
+        }
+        return true;
     }
+    QuirkProfile profile;
+    if (!ParseQuirkProfile(value, profile))
+    {
+        std::cerr << "Unknown quirk profile: " << value
+                  << " (default, chip8, chip48, schip or xochip)\n";
+        return false;
+    }
+    quirks.Force(profile);
+    return true;
+}
 
-    int videoScale = std::stoi(argv[1]);
-    int cycleDelay = std::stoi(argv[2]);
-    char const* romFileName = argv[3];
+static bool IsQuirkOption(const std::string& option)
+{
+    return option == "--quirks" || option == "--quirks-db";
+}
+
+/*
+Headless batch mode: runs every ROM x input script x seed combination on a
+thread pool and prints one CSV line per instance.
+*/
+static int BatchMain(int argc, char* argv[])
+{
+    BatchOptions options;
+    std::vector<std::string> roms;
+    std::vector<InputScript> scripts;
+    uint32_t seedCount = 1;
+    uint32_t seedBase = 1;
+
+    for (int i = 0; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--threads" && hasValue)
+        {
+            options.threads = std::stoul(argv[++i]);
+        }
+        else if (arg == "--cycles" && hasValue)
+        {
+            options.cycles = std::stoull(argv[++i]);
+        }
+        else if (arg == "--frames" && hasValue)
+        {
+            options.frames = std::stoull(argv[++i]);
+        }
+        else if (arg == "--ipf" && hasValue)
+        {
+            options.cyclesPerFrame = std::stoul(argv[++i]);
+        }
+        else if (arg == "--seeds" && hasValue)
+        {
+            seedCount = std::stoul(argv[++i]);
+        }
+        else if (arg == "--seed-base" && hasValue)
+        {
+            seedBase = std::stoul(argv[++i]);
+        }
+        else if (arg == "--jit")
+        {
+            options.jit = true;
+        }
+        else if (IsQuirkOption(arg) && hasValue)
+        {
+            if (!QuirkOption(arg, argv[++i], options.quirks))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (arg == "--input" && hasValue)
+        {
+            scripts.emplace_back();
+            if (!LoadInputScript(argv[++i], scripts.back()))
+            {
+                std::cerr << "Bad input script: " << argv[i] << "\n";
+                return EXIT_FAILURE;
+            }
+        }
+        else if (arg.compare(0, 2, "--") == 0)
+        {
+            std::cerr << "Unknown batch option: " << arg << "\n";
+            return EXIT_FAILURE;
+        }
+        else
+        {
+            roms.push_back(arg);
+        }
+    }
+
+    if (roms.empty())
+    {
+        std::cerr << "Usage: CHIP8 --batch [--threads N] [--cycles N] "
+                     "[--frames N] [--ipf N] [--seeds N] [--seed-base N] "
+                     "[--jit] [--quirks NAME] [--quirks-db FILE]\n"
+                     "                     [--input SCRIPT]... <ROM>...\n";
+        return EXIT_FAILURE;
+    }
+    if (scripts.empty())
+    {
+        scripts.emplace_back(); // run once with no input
+    }
+
+    std::vector<BatchJob> jobs;
+    for (const std::string& rom : roms)
+    {
+        for (const InputScript& script : scripts)
+        {
+            for (uint32_t s = 0; s < seedCount; ++s)
+            {
+                jobs.push_back({&rom, &script, seedBase + s});
+            }
+        }
+    }
+
+    std::vector<BatchResult> results = RunBatch(jobs, options);
+
+    std::cout << "rom,input,seed,loaded,cycles,pc,video_hash,ns\n";
+    for (size_t i = 0; i < jobs.size(); ++i)
+    {
+        const BatchResult& r = results[i];
+        std::cout << *jobs[i].rom << "," << jobs[i].script->name << ","
+                  << jobs[i].seed << "," << r.loaded << "," << r.cycles
+                  << "," << std::hex << r.pc << "," << r.videoHash
+                  << std::dec << "," << r.nanoseconds << "\n";
+    }
+    return EXIT_SUCCESS;
+}
+
+// JSON unless fileName ends in .csv.
+static bool WriteProfile(const Profiler& profiler, const std::string& fileName)
+{
+    std::ofstream out(fileName);
+    if (fileName.size() >= 4 &&
+        fileName.compare(fileName.size() - 4, 4, ".csv") == 0)
+    {
+        profiler.WriteCsv(out);
+    }
+    else
+    {
+        profiler.WriteJson(out);
+    }
+    return out.good();
+}
+
+/*
+Replay a recorded movie without a window, as fast as possible. The result
+line is identical across runs and builds unless emulation itself changed,
+which makes a movie a fixed workload for comparing performance.
+*/
+static int ReplayMain(int argc, char* argv[])
+{
+    bool useJit = false;
+    std::string profileFileName;
+    const char* videoFileName = nullptr;
+    const char* captureFileName = nullptr;
+    unsigned int captureScale = 10;
+    QuirkDatabase quirks;
+    bool quirksGiven = false;
+    bool usage = argc < 2;
+    for (int i = 2; i < argc; ++i)
+    {
+        if (std::strcmp(argv[i], "--jit") == 0)
+        {
+            useJit = true;
+        }
+        else if (std::strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+        {
+            profileFileName = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "--video") == 0 && i + 1 < argc)
+        {
+            videoFileName = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "--capture") == 0 && i + 1 < argc)
+        {
+            captureFileName = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "--scale") == 0 && i + 1 < argc)
+        {
+            captureScale = std::stoul(argv[++i]);
+        }
+        else if (IsQuirkOption(argv[i]) && i + 1 < argc)
+        {
+            if (!QuirkOption(argv[i], argv[i + 1], quirks))
+            {
+                return EXIT_FAILURE;
+            }
+            quirksGiven = true;
+            ++i;
+        }
+        else
+        {
+            usage = true;
+        }
+    }
+    if (usage)
+    {
+        std::cerr << "Usage: CHIP8 --replay <Movie> <ROM> [--jit] "
+                     "[--profile FILE] [--video FILE]\n"
+                     "                                     [--capture FILE]"
+                     " [--scale N] [--quirks NAME]\n"
+                     "                                     "
+                     "[--quirks-db FILE]\n";
+        return EXIT_FAILURE;
+    }
+    if (!profileFileName.empty() && !PROFILE_ENABLED)
+    {
+        std::cerr << "--profile needs a build with CHIP8_PROFILE\n";
+        return EXIT_FAILURE;
+    }
+
+    Movie movie;
+    if (!LoadMovie(argv[0], movie))
+    {
+        std::cerr << "Bad movie: " << argv[0] << "\n";
+        return EXIT_FAILURE;
+    }
+    std::shared_ptr<const RomImage> rom = RomImage::ReadFile(argv[1]);
+    if (!rom)
+    {
+        std::cerr << "Failed to load ROM: " << argv[1] << "\n";
+        return EXIT_FAILURE;
+    }
+    if (rom->Hash() != movie.romHash)
+    {
+        std::cerr << "Movie was recorded with a different ROM\n";
+        return EXIT_FAILURE;
+    }
+    // The movie's own profile wins; options may only confirm it
+    QuirkProfile profile = quirks.Find(rom->Hash());
+    if (movie.quirksRecorded)
+    {
+        if (quirksGiven && profile != movie.quirks)
+        {
+            std::cerr << "Movie was recorded under quirk profile "
+                      << QuirkProfileName(movie.quirks) << "\n";
+            return EXIT_FAILURE;
+        }
+        profile = movie.quirks;
+    }
+
+    // The profile goes first: it decides how large a ROM may be
+    Chip8 chip8(movie.seed);
+    chip8.SetQuirks(profile);
+    if (!chip8.LoadROM(rom))
+    {
+        std::cerr << "Failed to load ROM: " << argv[1] << "\n";
+        return EXIT_FAILURE;
+    }
+    if ((videoFileName || captureFileName) && chip8.Extended())
+    {
+        std::cerr << "--video and --capture record only the 64x32 display\n";
+        return EXIT_FAILURE;
+    }
+
+    std::unique_ptr<Profiler> profiler;
+    if (!profileFileName.empty())
+    {
+        profiler.reset(new Profiler);
+        chip8.SetProfiler(profiler.get());
+    }
+
+    std::ofstream videoFile;
+    std::unique_ptr<DeltaWriter> video;
+    if (videoFileName)
+    {
+        videoFile.open(videoFileName, std::ios::binary);
+        video.reset(new DeltaWriter(videoFile));
+    }
+    std::unique_ptr<FrameCapture> capture;
+    if (captureFileName)
+    {
+        capture.reset(new FrameCapture(captureFileName, captureScale));
+    }
+    FrameHook onFrame;
+    if (video || capture)
+    {
+        onFrame = [&](const Chip8& chip8)
+        {
+            if (video)
+            {
+                video->Frame(chip8.video);
+            }
+            if (capture)
+            {
+                capture->Frame(chip8.video);
+            }
+        };
+    }
+
+    uint32_t cyclesPerFrame = std::max(1u, movie.instructionsPerFrame);
+    BatchResult r = RunHeadless(chip8, MovieToScript(movie),
+                                movie.frames * cyclesPerFrame,
+                                cyclesPerFrame, useJit, onFrame);
+
+    std::cout << "frames,cycles,pc,video_hash,ns\n";
+    std::cout << movie.frames << "," << r.cycles << "," << std::hex << r.pc
+              << "," << r.videoHash << std::dec << "," << r.nanoseconds
+              << "\n";
+    if (profiler && !WriteProfile(*profiler, profileFileName))
+    {
+        std::cerr << "Failed to write profile: " << profileFileName << "\n";
+        return EXIT_FAILURE;
+    }
+    if (video)
+    {
+        videoFile.flush();
+        if (!video->Good())
+        {
+            std::cerr << "Failed to write video: " << videoFileName << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cerr << "Video: " << video->Frames() << " frames in "
+                  << video->Bytes() << " bytes\n";
+    }
+    if (capture && !capture->Finish())
+    {
+        std::cerr << "Failed to write capture: " << captureFileName << "\n";
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+static const char* const WINDOW_TITLE = "Chip8";
+
+// How fast-forward (Tab) runs.
+struct TurboOptions
+{
+    double speed = 0.0;      // times real time; 0 = as fast as possible
+    uint32_t frameSkip = 10; // present one frame in this many; 0 = none
+    bool startOn = false;
+};
+
+/*
+The interactive emulation state, advanced one 60 Hz frame at a time by
+whichever loop below drives it.
+*/
+struct Session
+{
+    Session(Chip8& chip8, uint32_t seed, uint32_t instructionsPerFrame,
+            const TurboOptions& turbo)
+        : chip8(chip8), scheduler(instructionsPerFrame),
+          timeline(scheduler.InstructionsPerFrame()), rewind(REWIND_BUDGET),
+          recorder(seed, chip8.RomHash(), scheduler.InstructionsPerFrame(),
+                   chip8.Quirks()),
+          turbo(turbo)
+    {
+        SetFastForward(turbo.startOn);
+    }
+
+    void SetFastForward(bool on)
+    {
+        if (on == fastForward)
+        {
+            return;
+        }
+        if (!on)
+        {
+            std::cerr << "Fast-forward ran at " << scheduler.MeasuredSpeed()
+                      << "x\n";
+        }
+        fastForward = on;
+        scheduler.SetSpeed(on ? turbo.speed : 1.0);
+        skipped = 0;
+        reportAt = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    }
+
+    // Whether to present the frame just run.
+    bool ShowFrame()
+    {
+        if (!fastForward)
+        {
+            return true;
+        }
+        return turbo.frameSkip != 0 && ++skipped % turbo.frameSkip == 0;
+    }
+
+    // The speed reached so far, once a second while fast-forwarding.
+    bool ReportSpeed(double& speed)
+    {
+        std::chrono::steady_clock::time_point now =
+            std::chrono::steady_clock::now();
+        if (!fastForward || now < reportAt)
+        {
+            return false;
+        }
+        reportAt = now + std::chrono::seconds(1);
+        speed = scheduler.MeasuredSpeed();
+        return true;
+    }
+
+    // Run one frame with the key events queued since the last one, or
+    // step back one while rewinding.
+    void Frame(KeyEventQueue& keyEvents, bool rewinding)
+    {
+        const std::vector<InputEvent>& events =
+            timeline.NextFrame(keyEvents, KeyTimeline::Clock::now());
+        if (rewinding)
+        {
+            // The restored state carries the keys held back then; keep
+            // the ones held now so play resumes with the real keypad
+            uint8_t keys[sizeof(chip8.keypad)];
+            std::memcpy(keys, chip8.keypad, sizeof(keys));
+            for (const InputEvent& event : events)
+            {
+                keys[event.key] = event.down;
+            }
+            if (rewind.StepBack(chip8))
+            {
+                recorder.Truncate(--frame);
+            }
+            std::memcpy(chip8.keypad, keys, sizeof(keys));
+        }
+        else
+        {
+            recorder.Frame(chip8.keypad, events);
+            scheduler.RunFrame(chip8, events);
+            rewind.Push(chip8);
+            ++frame;
+        }
+        if (capture)
+        {
+            capture->Frame(chip8.video);
+        }
+    }
+
+    Chip8& chip8;
+    Scheduler scheduler;
+    KeyTimeline timeline;
+    Rewind rewind;
+    MovieRecorder recorder;
+    uint64_t frame = 0;
+    FrameCapture* capture = nullptr; // every frame shown, rewinds included
+
+    TurboOptions turbo;
+    bool fastForward = false;
+    uint64_t skipped = 0;
+    std::chrono::steady_clock::time_point reportAt;
+};
+
+static void ShowSpeed(Platform& platform, double speed)
+{
+    char title[64];
+    std::snprintf(title, sizeof(title), "%s - fast-forward %.1fx",
+                  WINDOW_TITLE, speed);
+    platform.SetTitle(title);
+}
+
+// Emulate, present and poll input in turn on the calling thread.
+static void RunSerial(Platform& platform, Session& session)
+{
+    Chip8& chip8 = session.chip8;
+    KeyEventQueue keyEvents;
+    // Large enough for the extended display too
+    uint32_t pixels[HIRES_WIDTH * HIRES_HEIGHT];
+    int videoPitch = sizeof(pixels[0]) * VIDEO_WIDTH;
+    int hiresPitch = sizeof(pixels[0]) * HIRES_WIDTH;
+    bool quit = false;
 
-    Platform platform("Chip8", VIDEO_WIDTH * videoScale,
-                      VIDEO_HEIGHT * videoScale, VIDEO_WIDTH, VIDEO_HEIGHT);
+    std::chrono::steady_clock::time_point nextPoll;
 
-    Chip8 chip8;
-    chip8.LoadROM(romFileName);
+    while (!quit)
+    {
+        // An uncapped frame can take well under the cost of polling the
+        // window, so then poll about once a millisecond instead
+        if (!session.fastForward || session.turbo.speed != 0.0 ||
+            std::chrono::steady_clock::now() >= nextPoll)
+        {
+            quit = platform.ProcessInput(keyEvents);
+            nextPoll = std::chrono::steady_clock::now() +
+                       std::chrono::milliseconds(1);
+            if (platform.FastForwardToggled())
+            {
+                session.SetFastForward(!session.fastForward);
+                platform.SetTitle(WINDOW_TITLE);
+            }
+        }
+        session.Frame(keyEvents, platform.RewindHeld());
+
+        // Nothing is uploaded or presented for frames that drew nothing;
+        // rows drawn in skipped frames stay dirty until one is shown
+        unsigned int firstRow;
+        unsigned int rowCount;
+        bool show = session.ShowFrame();
+        const ExtendedDisplay* extended = chip8.Extended();
+        if (show && extended)
+        {
+            // Only tracked as a whole, so the whole of it goes up
+            if (chip8.TakeDirtyRows())
+            {
+                ExpandExtended(*extended, pixels);
+                platform.Update(pixels, hiresPitch);
+            }
+        }
+        else if (show && DirtySpan(chip8.TakeDirtyRows(), firstRow, rowCount))
+        {
+            ExpandRows(chip8.video, pixels, firstRow, rowCount);
+            platform.Update(pixels, videoPitch, firstRow, rowCount);
+        }
+        double speed;
+        if (session.ReportSpeed(speed))
+        {
+            ShowSpeed(platform, speed);
+        }
+
+        session.scheduler.WaitForNextFrame();
+    }
+}
+
+// A finished frame, as handed from the emulation thread to the renderer.
+struct VideoFrame
+{
+    uint64_t rows[VIDEO_HEIGHT];
+    ExtendedDisplay extended; // used instead under SuperChip and XoChip
+};
 
-    int videoPitch = sizeof(chip8.video[0]) * VIDEO_WIDTH;
+/*
+Emulate on a thread of its own while the calling thread, which owns the
+window, polls input and presents. Frames go out through a triple buffer and
+key events come back through a queue, so a present blocked on vsync or a slow
+driver never holds up emulation, and emulation never holds up the window.
+*/
+static void RunThreaded(Platform& platform, Session& session)
+{
+    TripleBuffer<VideoFrame> frames;
+    KeyEventQueue keyEvents;
+    std::atomic<bool> rewinding{false};
+    std::atomic<bool> fastForward{session.fastForward};
+    std::atomic<double> speed{0.0};
+    std::atomic<bool> running{true};
+
+    std::thread emulation([&] {
+        Chip8& chip8 = session.chip8;
+        while (running.load(std::memory_order_relaxed))
+        {
+            session.SetFastForward(
+                fastForward.load(std::memory_order_relaxed));
+            session.Frame(keyEvents,
+                          rewinding.load(std::memory_order_relaxed));
+
+            if (session.ShowFrame() && chip8.TakeDirtyRows())
+            {
+                std::memcpy(frames.Back().rows, chip8.video,
+                            sizeof(chip8.video));
+                if (const ExtendedDisplay* extended = chip8.Extended())
+                {
+                    frames.Back().extended = *extended;
+                }
+                frames.Publish();
+            }
+            double measured;
+            if (session.ReportSpeed(measured))
+            {
+                speed.store(measured, std::memory_order_relaxed);
+            }
+            session.scheduler.WaitForNextFrame();
+        }
+    });
 
-    auto lastCycleTime = std::chrono::high_resolution_clock::now();
+    uint32_t pixels[HIRES_WIDTH * HIRES_HEIGHT];
+    int videoPitch = sizeof(pixels[0]) * VIDEO_WIDTH;
+    bool extended = session.chip8.Extended() != nullptr;
+    // Frames can be skipped here, so dirty rows are found by comparing
+    // with what is on screen; the first frame uploads everything
+    uint64_t shown[VIDEO_HEIGHT] = {0};
+    uint32_t forceRows = 0xFFFFFFFF;
+    double shownSpeed = 0.0;
     bool quit = false;
 
     while (!quit)
     {
-        quit = platform.ProcessInput(chip8.keypad);
-        auto currentTime = std::chrono::high_resolution_clock::now();
-        float dt =
-            std::chrono::duration<float, std::chrono::milliseconds::period>(
-                currentTime - lastCycleTime)
-                .count();
+        quit = platform.ProcessInput(keyEvents);
+        rewinding.store(platform.RewindHeld(), std::memory_order_relaxed);
+        if (platform.FastForwardToggled())
+        {
+            bool on = !fastForward.load(std::memory_order_relaxed);
+            fastForward.store(on, std::memory_order_relaxed);
+            speed.store(0.0, std::memory_order_relaxed);
+            shownSpeed = 0.0;
+            platform.SetTitle(WINDOW_TITLE);
+        }
+        double measured = speed.load(std::memory_order_relaxed);
+        if (measured != shownSpeed)
+        {
+            shownSpeed = measured;
+            ShowSpeed(platform, measured);
+        }
+
+        if (!frames.Acquire())
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        const VideoFrame& frame = frames.Front();
+        if (extended)
+        {
+            // Only ever published when something changed
+            ExpandExtended(frame.extended, pixels);
+            platform.Update(pixels, sizeof(pixels[0]) * HIRES_WIDTH);
+            continue;
+        }
+        uint32_t dirtyRows = forceRows;
+        for (unsigned int row = 0; row < VIDEO_HEIGHT; ++row)
+        {
+            dirtyRows |= static_cast<uint32_t>(frame.rows[row] != shown[row])
+                         << row;
+        }
+        forceRows = 0;
+        std::memcpy(shown, frame.rows, sizeof(shown));
+
+        unsigned int firstRow;
+        unsigned int rowCount;
+        if (DirtySpan(dirtyRows, firstRow, rowCount))
+        {
+            ExpandRows(shown, pixels, firstRow, rowCount);
+            platform.Update(pixels, videoPitch, firstRow, rowCount);
+        }
+    }
+
+    running.store(false, std::memory_order_relaxed);
+    emulation.join();
+}
+
+/*
+Server mode hosts machines for clients on a Unix socket; client mode opens
+some and prints what they showed, or prints the server's stats.
+*/
+static int ServeMain(int argc, char* argv[])
+{
+    ServerOptions options;
+    const char* socketPath = nullptr;
+    for (int i = 0; i < argc; ++i)
+    {
+        if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            options.threads = std::stoul(argv[++i]);
+        }
+        else if (IsQuirkOption(argv[i]) && i + 1 < argc)
+        {
+            if (!QuirkOption(argv[i], argv[i + 1], options.quirks))
+            {
+                return EXIT_FAILURE;
+            }
+            ++i;
+        }
+        else if (!socketPath && argv[i][0] != '-')
+        {
+            socketPath = argv[i];
+        }
+        else
+        {
+            socketPath = nullptr;
+            break;
+        }
+    }
+    if (!socketPath)
+    {
+        std::cerr << "Usage: CHIP8 --serve <Socket> [--threads N] "
+                     "[--quirks NAME] [--quirks-db FILE]\n";
+        return EXIT_FAILURE;
+    }
+
+    Server server(options);
+    if (!server.Listen(socketPath))
+    {
+        std::cerr << "Cannot listen on " << socketPath << "\n";
+        return EXIT_FAILURE;
+    }
+    server.Run();
+    return EXIT_SUCCESS;
+}
+
+static int ClientMain(int argc, char* argv[])
+{
+    ClientOptions options;
+    const char* socketPath = argc > 0 ? argv[0] : nullptr;
+    bool stats = false;
+    bool usage = !socketPath;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--stats")
+        {
+            stats = true;
+        }
+        else if (arg == "--sessions" && hasValue)
+        {
+            options.sessions = std::stoul(argv[++i]);
+        }
+        else if (arg == "--frames" && hasValue)
+        {
+            options.frames = std::stoull(argv[++i]);
+        }
+        else if (arg == "--seed" && hasValue)
+        {
+            options.seed = std::stoul(argv[++i]);
+        }
+        else if (arg == "--ipf" && hasValue)
+        {
+            // The server runs at least one; 0 would also break frame math
+            options.instructionsPerFrame =
+                std::max(1ul, std::stoul(argv[++i]));
+        }
+        else if (arg == "--input" && hasValue)
+        {
+            options.input = argv[++i];
+        }
+        else if (arg.compare(0, 2, "--") != 0 && options.rom.empty())
+        {
+            options.rom = arg;
+        }
+        else
+        {
+            usage = true;
+        }
+    }
+    if (usage || (!stats && options.rom.empty()))
+    {
+        std::cerr << "Usage: CHIP8 --client <Socket> <ROM> [--sessions N] "
+                     "[--frames N] [--seed N] [--ipf N]\n"
+                     "                             [--input SCRIPT]\n"
+                     "       CHIP8 --client <Socket> --stats\n";
+        return EXIT_FAILURE;
+    }
+
+    bool ok = stats ? RunStatsClient(socketPath, std::cout)
+                    : RunClient(socketPath, options, std::cout);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Print the hash each ROM is listed under in a quirk database.
+static int RomHashMain(int argc, char* argv[])
+{
+    if (argc < 1)
+    {
+        std::cerr << "Usage: CHIP8 --rom-hash <ROM>...\n";
+        return EXIT_FAILURE;
+    }
+    int status = EXIT_SUCCESS;
+    for (int i = 0; i < argc; ++i)
+    {
+        std::shared_ptr<const RomImage> rom = RomImage::ReadFile(argv[i]);
+        if (!rom)
+        {
+            std::cerr << "Failed to load ROM: " << argv[i] << "\n";
+            status = EXIT_FAILURE;
+            continue;
+        }
+        char hash[9];
+        std::snprintf(hash, sizeof(hash), "%08x", rom->Hash());
+        std::cout << hash << "  " << argv[i] << "\n";
+    }
+    return status;
+}
 
-        if (dt > cycleDelay)
+int main(int argc, char* argv[])
+{
+    if (argc > 1 && std::strcmp(argv[1], "--batch") == 0)
+    {
+        return BatchMain(argc - 2, argv + 2);
+    }
+    if (argc > 1 && std::strcmp(argv[1], "--replay") == 0)
+    {
+        return ReplayMain(argc - 2, argv + 2);
+    }
+    if (argc > 1 && std::strcmp(argv[1], "--serve") == 0)
+    {
+        return ServeMain(argc - 2, argv + 2);
+    }
+    if (argc > 1 && std::strcmp(argv[1], "--client") == 0)
+    {
+        return ClientMain(argc - 2, argv + 2);
+    }
+    if (argc > 1 && std::strcmp(argv[1], "--rom-hash") == 0)
+    {
+        return RomHashMain(argc - 2, argv + 2);
+    }
+    if (argc > 1 && std::strcmp(argv[1], "--jit-diff") == 0)
+    {
+        QuirkProfile quirks = QuirkProfile::Default;
+        if (argc < 4 || (argc > 5 && !ParseQuirkProfile(argv[5], quirks)))
+        {
+            std::cerr << "Usage: " << argv[0]
+                      << " --jit-diff <Cycles> <ROM> [Seed] [Quirks]\n";
+            return EXIT_FAILURE;
+        }
+        uint32_t seed = argc > 4 ? std::stoul(argv[4]) : 1;
+        bool same = Jit::Differential(argv[3], seed, std::stoull(argv[2]),
+                                      std::cout, quirks);
+        return same ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    uint32_t seed = static_cast<uint32_t>(
+        std::chrono::system_clock::now().time_since_epoch().count());
+    char const* recordFileName = nullptr;
+    char const* captureFileName = nullptr;
+    std::string profileFileName;
+    bool threaded = false;
+    TurboOptions turbo;
+    QuirkDatabase quirks;
+    bool usage = argc < 4;
+    for (int i = 4; i < argc; ++i)
+    {
+        bool hasValue = i + 1 < argc;
+        if (std::strcmp(argv[i], "--seed") == 0 && hasValue)
+        {
+            seed = std::stoul(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--record") == 0 && hasValue)
+        {
+            recordFileName = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "--capture") == 0 && hasValue)
+        {
+            captureFileName = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "--profile") == 0 && hasValue)
+        {
+            profileFileName = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "--threaded") == 0)
+        {
+            threaded = true;
+        }
+        else if (std::strcmp(argv[i], "--turbo") == 0 && hasValue)
+        {
+            turbo.speed = std::stod(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--frameskip") == 0 && hasValue)
+        {
+            turbo.frameSkip = std::stoul(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--fast-forward") == 0)
+        {
+            turbo.startOn = true;
+        }
+        else if (IsQuirkOption(argv[i]) && hasValue)
+        {
+            if (!QuirkOption(argv[i], argv[i + 1], quirks))
+            {
+                std::exit(EXIT_FAILURE);
+            }
+            ++i;
+        }
+        else
         {
-            lastCycleTime = currentTime;
-            chip8.Cycle();
-            platform.Update(chip8.video, videoPitch);
+            usage = true;
         }
     }
+    if (usage)
+    {
+        std::cerr << "Usage:" << argv[0]
+                  << " <Scale> <Delay> <ROM> [--seed N] [--record MOVIE]"
+                     " [--profile FILE] [--threaded]\n"
+                     "             [--turbo SPEED] [--frameskip N]"
+                     " [--fast-forward] [--capture FILE]\n"
+                     "             [--quirks NAME] [--quirks-db FILE]\n";
+        std::cerr << "       " << argv[0] << " --batch [options] <ROM>...\n";
+        std::cerr << "       " << argv[0]
+                  << " --replay <Movie> <ROM> [--jit] [--profile FILE]"
+                     " [--video FILE]\n"
+                     "             [--capture FILE] [--scale N]\n";
+        std::cerr << "       " << argv[0]
+                  << " --jit-diff <Cycles> <ROM> [Seed] [Quirks]\n";
+        std::cerr << "       " << argv[0] << " --rom-hash <ROM>...\n";
+        std::cerr << "       " << argv[0]
+                  << " --serve <Socket> [--threads N] [--quirks NAME]"
+                     " [--quirks-db FILE]\n";
+        std::cerr << "       " << argv[0]
+                  << " --client <Socket> <ROM> [options] | --stats\n";
+        std::exit(EXIT_FAILURE);
+    }
+    if (!profileFileName.empty() && !PROFILE_ENABLED)
+    {
+        std::cerr << "--profile needs a build with CHIP8_PROFILE\n";
+        std::exit(EXIT_FAILURE);
+    }
+
+    int videoScale = std::stoi(argv[1]);
+    float cycleDelay = std::stof(argv[2]);
+    char const* romFileName = argv[3];
+
+    Chip8 chip8(seed);
+    std::shared_ptr<const RomImage> rom = RomImage::ReadFile(romFileName);
+    if (rom)
+    {
+        chip8.SetQuirks(quirks.Find(rom->Hash()));
+    }
+    if (!chip8.LoadROM(rom))
+    {
+        std::cerr << "Failed to load ROM: " << romFileName << "\n";
+        std::exit(EXIT_FAILURE);
+    }
+    if (captureFileName && chip8.Extended())
+    {
+        std::cerr << "--capture records only the 64x32 display\n";
+        std::exit(EXIT_FAILURE);
+    }
+
+    Profiler profiler;
+    if (!profileFileName.empty())
+    {
+        chip8.SetProfiler(&profiler);
+    }
+
+    // The extended display fills the same window at twice the resolution
+    bool extended = chip8.Extended() != nullptr;
+    Platform platform(WINDOW_TITLE, VIDEO_WIDTH * videoScale,
+                      VIDEO_HEIGHT * videoScale,
+                      extended ? HIRES_WIDTH : VIDEO_WIDTH,
+                      extended ? HIRES_HEIGHT : VIDEO_HEIGHT);
+
+    Session session(chip8, seed, Scheduler::FromCycleDelay(cycleDelay),
+                    turbo);
+    std::unique_ptr<FrameCapture> capture;
+    if (captureFileName)
+    {
+        capture.reset(new FrameCapture(captureFileName, videoScale));
+        session.capture = capture.get();
+    }
+    if (threaded)
+    {
+        RunThreaded(platform, session);
+    }
+    else
+    {
+        RunSerial(platform, session);
+    }
+
+    session.SetFastForward(false);
+    const Rewind& rewind = session.rewind;
+    std::cerr << "Rewind: " << rewind.SecondsStored() << " s in "
+              << rewind.BytesUsed() << " bytes, "
+              << static_cast<uint64_t>(rewind.BytesPerSecond())
+              << " bytes per second\n";
+    if (recordFileName &&
+        !SaveMovie(recordFileName, session.recorder.GetMovie()))
+    {
+        std::cerr << "Failed to write movie: " << recordFileName << "\n";
+        return EXIT_FAILURE;
+    }
+    if (!profileFileName.empty() && !WriteProfile(profiler, profileFileName))
+    {
+        std::cerr << "Failed to write profile: " << profileFileName << "\n";
+        return EXIT_FAILURE;
+    }
+    if (capture && !capture->Finish())
+    {
+        std::cerr << "Failed to write capture: " << captureFileName << "\n";
+        return EXIT_FAILURE;
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,262 @@
+#include "movie.hpp"
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
+/*
+Movie file layout, all fixed-width integers little-endian:
+
+  "C8MV"          magic
+  u8              version
+  u32             RNG seed
+  u32             ROM hash
+  u32             instructions per frame
+  u8              quirk profile, as QuirkProfile
+  u64             length in frames
+  u32             event count
+  events          {varint frames since the previous event,
+                   varint cycle within the frame, u16 keypad}
+
+A varint is 7 bits per byte, low bits first, high bit set on all but the
+last byte, so the typical event costs four to six bytes. Version 1 files,
+from before input changed within frames, have no cycle field, and files
+before version 3 have no quirk profile.
+*/
+
+namespace
+{
+const uint8_t MOVIE_MAGIC[4] = {'C', '8', 'M', 'V'};
+const uint8_t MOVIE_VERSION = 3;
+
+void PutLE(std::vector<uint8_t>& out, uint64_t value, unsigned int bytes)
+{
+    for (unsigned int i = 0; i < bytes; ++i)
+    {
+        out.push_back((value >> (8u * i)) & 0xFFu);
+    }
+}
+
+void PutVarint(std::vector<uint8_t>& out, uint64_t value)
+{
+    while (value >= 0x80u)
+    {
+        out.push_back((value & 0x7Fu) | 0x80u);
+        value >>= 7u;
+    }
+    out.push_back(value);
+}
+
+// Bounds-checked cursor; every read fails once past the end.
+struct Reader
+{
+    const std::vector<uint8_t>& data;
+    size_t at;
+
+    bool LE(uint64_t& value, unsigned int bytes)
+    {
+        if (data.size() - at < bytes)
+        {
+            return false;
+        }
+        value = 0;
+        for (unsigned int i = 0; i < bytes; ++i)
+        {
+            value |= static_cast<uint64_t>(data[at++]) << (8u * i);
+        }
+        return true;
+    }
+
+    bool Varint(uint64_t& value)
+    {
+        value = 0;
+        for (unsigned int shift = 0; shift < 64; shift += 7)
+        {
+            if (at == data.size())
+            {
+                return false;
+            }
+            uint8_t byte = data[at++];
+            value |= static_cast<uint64_t>(byte & 0x7Fu) << shift;
+            if (!(byte & 0x80u))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+uint16_t PackKeys(const uint8_t* keypad)
+{
+    uint16_t keys = 0;
+    for (unsigned int i = 0; i < 16; ++i)
+    {
+        keys |= (keypad[i] ? 1u : 0u) << i;
+    }
+    return keys;
+}
+} // namespace
+
+MovieRecorder::MovieRecorder(uint32_t seed, uint32_t romHash,
+                             uint32_t instructionsPerFrame,
+                             QuirkProfile quirks)
+{
+    movie.seed = seed;
+    movie.romHash = romHash;
+    movie.instructionsPerFrame = instructionsPerFrame;
+    movie.quirks = quirks;
+}
+
+void MovieRecorder::Frame(const uint8_t* keypad,
+                          const std::vector<InputEvent>& events)
+{
+    // The keypad can differ from the last recorded state after a rewind
+    uint16_t now = PackKeys(keypad);
+    Change(0, now);
+    for (const InputEvent& event : events)
+    {
+        uint16_t bit = 1u << event.key;
+        now = event.down ? (now | bit) : (now & ~bit);
+        Change(static_cast<uint32_t>(event.cycle), now);
+    }
+    ++movie.frames;
+}
+
+void MovieRecorder::Change(uint32_t cycle, uint16_t now)
+{
+    if (now == keys)
+    {
+        return;
+    }
+    if (!movie.events.empty() && movie.events.back().frame == movie.frames &&
+        movie.events.back().cycle == cycle)
+    {
+        movie.events.back().keys = now;
+    }
+    else
+    {
+        movie.events.push_back({movie.frames, cycle, now});
+    }
+    keys = now;
+}
+
+void MovieRecorder::Truncate(uint64_t frames)
+{
+    if (frames >= movie.frames)
+    {
+        return;
+    }
+    movie.frames = frames;
+    while (!movie.events.empty() && movie.events.back().frame >= frames)
+    {
+        movie.events.pop_back();
+    }
+    keys = movie.events.empty() ? 0 : movie.events.back().keys;
+}
+
+bool SaveMovie(const char* filename, const Movie& movie)
+{
+    std::vector<uint8_t> out(MOVIE_MAGIC, MOVIE_MAGIC + sizeof(MOVIE_MAGIC));
+    out.push_back(MOVIE_VERSION);
+    PutLE(out, movie.seed, 4);
+    PutLE(out, movie.romHash, 4);
+    PutLE(out, movie.instructionsPerFrame, 4);
+    PutLE(out, static_cast<uint8_t>(movie.quirks), 1);
+    PutLE(out, movie.frames, 8);
+    PutLE(out, movie.events.size(), 4);
+    uint64_t frame = 0;
+    for (const MovieEvent& event : movie.events)
+    {
+        PutVarint(out, event.frame - frame);
+        PutVarint(out, event.cycle);
+        PutLE(out, event.keys, 2);
+        frame = event.frame;
+    }
+
+    std::ofstream file(filename, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(out.data()), out.size());
+    return file.good();
+}
+
+bool LoadMovie(const char* filename, Movie& movie)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open())
+    {
+        return false;
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)),
+                              std::istreambuf_iterator<char>());
+
+    Reader in = {data, 0};
+    uint64_t magic;
+    uint64_t version;
+    uint64_t seed;
+    uint64_t romHash;
+    uint64_t instructionsPerFrame;
+    uint64_t quirks = 0;
+    uint64_t frames;
+    uint64_t count;
+    if (!in.LE(magic, 4) ||
+        !std::equal(MOVIE_MAGIC, MOVIE_MAGIC + 4, data.begin()) ||
+        !in.LE(version, 1) || version < 1 || version > MOVIE_VERSION ||
+        !in.LE(seed, 4) ||
+        !in.LE(romHash, 4) || !in.LE(instructionsPerFrame, 4) ||
+        (version >= 3 && !in.LE(quirks, 1)) ||
+        quirks >= QUIRK_PROFILE_COUNT || !in.LE(frames, 8) ||
+        !in.LE(count, 4))
+    {
+        return false;
+    }
+
+    std::vector<MovieEvent> events;
+    uint64_t frame = 0;
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        uint64_t delta;
+        uint64_t cycle = 0;
+        uint64_t keys;
+        if (!in.Varint(delta) || (version >= 2 && !in.Varint(cycle)) ||
+            (cycle != 0 && cycle >= instructionsPerFrame) ||
+            !in.LE(keys, 2))
+        {
+            return false;
+        }
+        frame += delta;
+        events.push_back({frame, static_cast<uint32_t>(cycle),
+                          static_cast<uint16_t>(keys)});
+    }
+
+    movie.seed = seed;
+    movie.romHash = romHash;
+    movie.instructionsPerFrame = instructionsPerFrame;
+    movie.quirks = static_cast<QuirkProfile>(quirks);
+    movie.quirksRecorded = version >= 3;
+    movie.frames = frames;
+    movie.events.swap(events);
+    return true;
+}
+
+InputScript MovieToScript(const Movie& movie)
+{
+    InputScript script;
+    script.name = "movie";
+    uint16_t keys = 0;
+    for (const MovieEvent& event : movie.events)
+    {
+        uint16_t changed = keys ^ event.keys;
+        uint64_t cycle =
+            event.frame * movie.instructionsPerFrame + event.cycle;
+        for (unsigned int key = 0; key < 16; ++key)
+        {
+            if (changed & (1u << key))
+            {
+                script.events.push_back(
+                    {cycle, static_cast<uint8_t>(key),
+                     static_cast<uint8_t>((event.keys >> key) & 1u)});
+            }
+        }
+        keys = event.keys;
+    }
+    return script;
+}
@@ -1,7 +1,22 @@
 #include "platform.hpp"
+#include <algorithm>
+
+namespace
+{
+// Host key for each keypad key, laid out on the left of a QWERTY keyboard:
+//   1 2 3 C        1 2 3 4
+//   4 5 6 D   ->   Q W E R
+//   7 8 9 E        A S D F
+//   A 0 B F        Z X C V
+const SDL_Keycode KEYMAP[16] = {
+    SDLK_x, SDLK_1, SDLK_2, SDLK_3, SDLK_q, SDLK_w, SDLK_e, SDLK_a,
+    SDLK_s, SDLK_d, SDLK_z, SDLK_c, SDLK_4, SDLK_r, SDLK_f, SDLK_v,
+};
+} // namespace
 
 Platform::Platform(char const* title, int windowWidth, int windowHeight,
                    int textureWidth, int textureHeight)
+    : textureWidth(textureWidth)
 {
     SDL_Init(SDL_INIT_VIDEO);
     window = SDL_CreateWindow(title, 0, 0, windowWidth, windowHeight,
@@ -20,10 +35,24 @@ void Platform::Update(void const* buffer, int pitch)
     SDL_RenderPresent(renderer);
 }
 
-bool Platform::ProcessInput(uint8_t* keys)
+void Platform::Update(void const* buffer, int pitch, int firstRow,
+                      int rowCount)
+{
+    SDL_Rect rows = {0, firstRow, textureWidth, rowCount};
+    SDL_UpdateTexture(texture, &rows,
+                      static_cast<uint8_t const*>(buffer) + firstRow * pitch,
+                      pitch);
+    SDL_RenderClear(renderer);
+    SDL_RenderCopy(renderer, texture, nullptr, nullptr);
+    SDL_RenderPresent(renderer);
+}
+
+bool Platform::ProcessInput(KeyEventQueue& events)
 {
     bool quit = false;
     SDL_Event event;
+    KeyTimeline::Clock::time_point now = KeyTimeline::Clock::now();
+    Uint32 ticks = SDL_GetTicks();
 
     while (SDL_PollEvent(&event))
     {
@@ -33,115 +62,40 @@ bool Platform::ProcessInput(uint8_t* keys)
                 quit = true;
                 break;
             case SDL_KEYDOWN:
-                switch (event.key.keysym.sym)
+            case SDL_KEYUP:
+            {
+                bool down = event.type == SDL_KEYDOWN;
+                SDL_Keycode sym = event.key.keysym.sym;
+                if (sym == SDLK_ESCAPE && down)
                 {
-                    case SDLK_ESCAPE:
-                        quit = true;
-                        break;
-                    case SDLK_x:
-                        keys[0] = 1;
-                        break;
-                    case SDLK_1:
-                        keys[1] = 1;
-                        break;
-                    case SDLK_2:
-                        keys[2] = 1;
-                        break;
-                    case SDLK_3:
-                        keys[3] = 1;
-                        break;
-                    case SDLK_q:
-                        keys[4] = 1;
-                        break;
-                    case SDLK_w:
-                        keys[5] = 1;
-                        break;
-                    case SDLK_e:
-                        keys[6] = 1;
-                        break;
-                    case SDLK_a:
-                        keys[7] = 1;
-                        break;
-                    case SDLK_s:
-                        keys[8] = 1;
-                        break;
-                    case SDLK_d:
-                        keys[9] = 1;
-                        break;
-                    case SDLK_z:
-                        keys[0xA] = 1;
-                        break;
-                    case SDLK_c:
-                        keys[0xB] = 1;
-                        break;
-                    case SDLK_4:
-                        keys[0xC] = 1;
-                        break;
-                    case SDLK_r:
-                        keys[0xD] = 1;
-                        break;
-                    case SDLK_f:
-                        keys[0xE] = 1;
-                        break;
-                    case SDLK_v:
-                        keys[0xF] = 1;
-                        break;
+                    quit = true;
                 }
-                break;
-            case SDL_KEYUP:
-                switch (event.key.keysym.sym)
+                else if (sym == SDLK_BACKSPACE)
+                {
+                    rewindHeld = down;
+                }
+                else if (sym == SDLK_TAB && down && !event.key.repeat)
+                {
+                    fastForwardToggled = true;
+                }
+                else if (!event.key.repeat)
                 {
-                    case SDLK_x:
-                        keys[0] = 0;
-                        break;
-                    case SDLK_1:
-                        keys[1] = 0;
-                        break;
-                    case SDLK_2:
-                        keys[2] = 0;
-                        break;
-                    case SDLK_3:
-                        keys[3] = 0;
-                        break;
-                    case SDLK_q:
-                        keys[4] = 0;
-                        break;
-                    case SDLK_w:
-                        keys[5] = 0;
-                        break;
-                    case SDLK_e:
-                        keys[6] = 0;
-                        break;
-                    case SDLK_a:
-                        keys[7] = 0;
-                        break;
-                    case SDLK_s:
-                        keys[8] = 0;
-                        break;
-                    case SDLK_d:
-                        keys[9] = 0;
-                        break;
-                    case SDLK_z:
-                        keys[0xA] = 0;
-                        break;
-                    case SDLK_c:
-                        keys[0xB] = 0;
-                        break;
-                    case SDLK_4:
-                        keys[0xC] = 0;
-                        break;
-                    case SDLK_r:
-                        keys[0xD] = 0;
-                        break;
-                    case SDLK_f:
-                        keys[0xE] = 0;
-                        break;
-                    case SDLK_v:
-                        keys[0xF] = 0;
-                        break;
+                    const SDL_Keycode* found =
+                        std::find(KEYMAP, KEYMAP + 16, sym);
+                    if (found != KEYMAP + 16)
+                    {
+                        // SDL stamps events in milliseconds since init
+                        Sint32 late =
+                            static_cast<Sint32>(ticks - event.key.timestamp);
+                        std::chrono::milliseconds age(std::max(0, late));
+                        events.TryPush({now - age,
+                                        static_cast<uint8_t>(found - KEYMAP),
+                                        static_cast<uint8_t>(down)});
+                    }
                 }
                 break;
+            }
         }
     }
     return quit;
-}
\ No newline at end of file
+}
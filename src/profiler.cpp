@@ -0,0 +1,120 @@
+#include "profiler.hpp"
+#include <algorithm>
+#include <iterator>
+
+const char* const Profiler::OP_NAMES[Profiler::OP_COUNT] = {
+    "00E0", "00EE", "1nnn", "2nnn", "3xkk", "4xkk", "5xy0", "6xkk", "7xkk",
+    "8xy0", "8xy1", "8xy2", "8xy3", "8xy4", "8xy5", "8xy6", "8xy7", "8xyE",
+    "9xy0", "Annn", "Bnnn", "Cxkk", "Dxyn", "Ex9E", "ExA1", "Fx07", "Fx0A",
+    "Fx15", "Fx18", "Fx1E", "Fx29", "Fx33", "Fx55", "Fx65", "00Cn", "00Dn",
+    "00FB", "00FC", "00FD", "00FE", "00FF", "5xy2", "5xy3", "F000", "Fn01",
+    "F002", "Fx30", "Fx3A", "Fx75", "Fx85", "invalid"};
+
+Profiler::Profiler()
+{
+    // Reading the clock twice costs tens of ns, as much as most handlers
+    clockOverhead = Clock::duration::max();
+    for (unsigned int i = 0; i < 1000; ++i)
+    {
+        Clock::time_point start = Clock::now();
+        clockOverhead = std::min(clockOverhead, Clock::now() - start);
+    }
+    Reset();
+}
+
+void Profiler::Reset()
+{
+    std::fill(std::begin(ops), std::end(ops), OpStats{});
+    std::fill(std::begin(pcHits), std::end(pcHits), 0);
+    jitter = 1;
+    NextSample();
+}
+
+/*
+The gap between samples varies between half and one and a half periods;
+with a fixed gap, a loop whose length divides the period would have the
+same instruction sampled every time.
+*/
+void Profiler::NextSample()
+{
+    jitter = jitter * 1664525u + 1013904223u;
+    untilSample = SAMPLE_PERIOD / 2 + (jitter >> 16u) % SAMPLE_PERIOD;
+}
+
+void Profiler::Record(OpStats& op, Clock::duration elapsed)
+{
+    elapsed = std::max(elapsed - clockOverhead, Clock::duration::zero());
+    uint64_t ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    unsigned int bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS - 1 && ns >= (1ull << bucket))
+    {
+        ++bucket;
+    }
+    ++op.samples;
+    op.sampledNs += ns;
+    ++op.histogram[bucket];
+}
+
+void Profiler::WriteJson(std::ostream& out) const
+{
+    out << "{\n  \"sample_period\": " << SAMPLE_PERIOD
+        << ",\n  \"opcodes\": [";
+    bool first = true;
+    for (unsigned int i = 0; i < OP_COUNT; ++i)
+    {
+        const OpStats& op = ops[i];
+        if (op.count == 0)
+        {
+            continue;
+        }
+        double meanNs = op.samples ? double(op.sampledNs) / op.samples : 0.0;
+        out << (first ? "\n" : ",\n") << "    {\"opcode\": \"" << OP_NAMES[i]
+            << "\", \"count\": " << op.count << ", \"samples\": "
+            << op.samples << ", \"mean_ns\": " << meanNs
+            << ", \"estimated_total_ns\": " << meanNs * op.count
+            << ", \"histogram_log2_ns\": [";
+        for (unsigned int b = 0; b < HISTOGRAM_BUCKETS; ++b)
+        {
+            out << (b ? ", " : "") << op.histogram[b];
+        }
+        out << "]}";
+        first = false;
+    }
+
+    out << "\n  ],\n  \"pc_heatmap\": {";
+    first = true;
+    for (unsigned int a = 0; a < MEMORY_SIZE; ++a)
+    {
+        if (pcHits[a] == 0)
+        {
+            continue;
+        }
+        out << (first ? "\n" : ",\n") << "    \"" << a << "\": " << pcHits[a];
+        first = false;
+    }
+    out << "\n  }\n}\n";
+}
+
+void Profiler::WriteCsv(std::ostream& out) const
+{
+    out << "kind,key,count,samples,mean_ns\n";
+    for (unsigned int i = 0; i < OP_COUNT; ++i)
+    {
+        const OpStats& op = ops[i];
+        if (op.count == 0)
+        {
+            continue;
+        }
+        double meanNs = op.samples ? double(op.sampledNs) / op.samples : 0.0;
+        out << "opcode," << OP_NAMES[i] << "," << op.count << ","
+            << op.samples << "," << meanNs << "\n";
+    }
+    for (unsigned int a = 0; a < MEMORY_SIZE; ++a)
+    {
+        if (pcHits[a] != 0)
+        {
+            out << "pc," << a << "," << pcHits[a] << ",,\n";
+        }
+    }
+}
@@ -0,0 +1,84 @@
+#include "quirks.hpp"
+#include <fstream>
+#include <sstream>
+
+namespace
+{
+// In QuirkProfile order
+const char* const PROFILE_NAMES[QUIRK_PROFILE_COUNT] = {
+    "default", "chip8", "chip48", "schip", "xochip"};
+} // namespace
+
+const char* QuirkProfileName(QuirkProfile profile)
+{
+    return PROFILE_NAMES[static_cast<unsigned int>(profile)];
+}
+
+bool ParseQuirkProfile(const std::string& name, QuirkProfile& profile)
+{
+    for (unsigned int i = 0; i < QUIRK_PROFILE_COUNT; ++i)
+    {
+        if (name == PROFILE_NAMES[i])
+        {
+            profile = static_cast<QuirkProfile>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool QuirkDatabase::Load(const char* filename)
+{
+    std::ifstream file(filename);
+    if (!file.is_open())
+    {
+        return false;
+    }
+
+    std::unordered_map<uint32_t, QuirkProfile> entries;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+        std::istringstream fields(line);
+        uint32_t hash;
+        std::string name;
+        QuirkProfile profile;
+        if (!(fields >> std::hex >> hash >> name) ||
+            !ParseQuirkProfile(name, profile))
+        {
+            return false;
+        }
+        entries[hash] = profile;
+    }
+
+    for (const auto& entry : entries)
+    {
+        profiles[entry.first] = entry.second;
+    }
+    return true;
+}
+
+void QuirkDatabase::Add(uint32_t romHash, QuirkProfile profile)
+{
+    profiles[romHash] = profile;
+}
+
+void QuirkDatabase::Force(QuirkProfile profile)
+{
+    forced = true;
+    forcedProfile = profile;
+}
+
+QuirkProfile QuirkDatabase::Find(uint32_t romHash) const
+{
+    if (forced)
+    {
+        return forcedProfile;
+    }
+    auto found = profiles.find(romHash);
+    return found != profiles.end() ? found->second : QuirkProfile::Default;
+}
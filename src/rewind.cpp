@@ -0,0 +1,270 @@
+#include "rewind.hpp"
+#include "scheduler.hpp"
+#include <algorithm>
+#include <cstring>
+
+/*
+Each entry is a list of {u16 skip, u16 length, length bytes} runs: skip
+bytes equal to the base, then length bytes XORed with it. Bytes after the
+last run equal the base. Keyframes use an all-zero base, which still pays off
+since most of memory and the framebuffer are zero.
+*/
+
+namespace
+{
+// Matching bytes shorter than a run header are cheaper to keep inline.
+const size_t MIN_SKIP = 4;
+// Longer skips and runs are split, as XO-CHIP states pass 64 KB.
+const size_t MAX_RUN = 0xFFFF;
+
+void Put16(std::vector<uint8_t>& out, size_t value)
+{
+    out.push_back(value & 0xFFu);
+    out.push_back(value >> 8u);
+}
+
+uint8_t BaseAt(const uint8_t* base, size_t i) { return base ? base[i] : 0; }
+
+void EncodeXor(const std::vector<uint8_t>& state, const uint8_t* base,
+               std::vector<uint8_t>& out)
+{
+    out.clear();
+    size_t size = state.size();
+    size_t i = 0;
+    size_t runEnd = 0;
+    while (true)
+    {
+        while (i < size && state[i] == BaseAt(base, i))
+        {
+            ++i;
+        }
+        if (i == size)
+        {
+            break;
+        }
+        size_t start = i;
+        size_t end = i + 1;
+        size_t same = 0;
+        for (size_t a = end; a < size && same < MIN_SKIP; ++a)
+        {
+            if (state[a] == BaseAt(base, a))
+            {
+                ++same;
+            }
+            else
+            {
+                same = 0;
+                end = a + 1;
+            }
+        }
+        end = std::min(end, start + MAX_RUN);
+        for (; start - runEnd > MAX_RUN; runEnd += MAX_RUN)
+        {
+            Put16(out, MAX_RUN);
+            Put16(out, 0);
+        }
+        Put16(out, start - runEnd);
+        Put16(out, end - start);
+        for (size_t a = start; a < end; ++a)
+        {
+            out.push_back(state[a] ^ BaseAt(base, a));
+        }
+        i = end;
+        runEnd = end;
+    }
+}
+
+// XOR an encoded entry into state, which must already hold the base.
+bool ApplyXor(const uint8_t* data, size_t size, std::vector<uint8_t>& state)
+{
+    size_t at = 0;
+    size_t pos = 0;
+    while (at < size)
+    {
+        if (size - at < 4)
+        {
+            return false;
+        }
+        size_t skip = data[at] | (data[at + 1] << 8u);
+        size_t length = data[at + 2] | (data[at + 3] << 8u);
+        at += 4;
+        pos += skip;
+        if (size - at < length || pos > state.size() ||
+            state.size() - pos < length)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < length; ++i)
+        {
+            state[pos + i] ^= data[at + i];
+        }
+        at += length;
+        pos += length;
+    }
+    return true;
+}
+} // namespace
+
+Rewind::Rewind(size_t budgetBytes, uint32_t keyframeInterval)
+    : ring(budgetBytes), keyframeInterval(keyframeInterval ? keyframeInterval
+                                                           : 1)
+{
+}
+
+void Rewind::Push(const Chip8& chip8)
+{
+    chip8.SaveState(current, false);
+
+    // A delta needs a base of its own size, so a state that grew or shrank
+    // with a change of profile starts a new keyframe
+    bool isKeyframe = keyframe.empty() || sinceKeyframe >= keyframeInterval ||
+                      current.size() != keyframe.size();
+    if (!isKeyframe)
+    {
+        EncodeXor(current, keyframe.data(), encoded);
+        // Making room may have evicted the keyframe this delta is against
+        isKeyframe = !MakeRoom(encoded.size()) || entries.empty();
+    }
+    if (isKeyframe)
+    {
+        EncodeXor(current, nullptr, encoded);
+        if (!MakeRoom(encoded.size()))
+        {
+            keyframe.clear();
+            return;
+        }
+        keyframe = current;
+        sinceKeyframe = 0;
+    }
+
+    memcpy(ring.data() + head, encoded.data(), encoded.size());
+    entries.push_back({head, encoded.size(), current.size(), isKeyframe});
+    head += encoded.size();
+    used += encoded.size();
+    ++sinceKeyframe;
+}
+
+bool Rewind::StepBack(Chip8& chip8)
+{
+    if (entries.size() < 2)
+    {
+        return false;
+    }
+
+    Entry newest = entries.back();
+    entries.pop_back();
+    head = newest.offset;
+    used -= newest.size;
+
+    // Later deltas must be encoded against the keyframe that is now newest
+    size_t last = entries.size() - 1;
+    size_t key = last;
+    while (!entries[key].keyframe)
+    {
+        --key;
+    }
+    sinceKeyframe = entries.size() - key;
+    if (newest.keyframe && !Decode(key, keyframe))
+    {
+        return false;
+    }
+
+    std::vector<uint8_t> state;
+    return Decode(last, state) && chip8.LoadState(state.data(), state.size());
+}
+
+bool Rewind::Seek(Chip8& chip8, size_t framesAgo)
+{
+    if (framesAgo >= entries.size())
+    {
+        return false;
+    }
+    std::vector<uint8_t> state;
+    return Decode(entries.size() - 1 - framesAgo, state) &&
+           chip8.LoadState(state.data(), state.size());
+}
+
+double Rewind::BytesPerSecond() const
+{
+    if (entries.empty())
+    {
+        return 0.0;
+    }
+    return static_cast<double>(used) / entries.size() * FRAME_RATE;
+}
+
+double Rewind::SecondsStored() const
+{
+    return static_cast<double>(entries.size()) / FRAME_RATE;
+}
+
+/*
+Free size contiguous bytes at head, evicting the oldest entries that are in
+the way. Entries never wrap; if one does not fit before the end of the ring
+it starts over at zero and the tail is left unused for this lap.
+*/
+bool Rewind::MakeRoom(size_t size)
+{
+    if (size > ring.size())
+    {
+        while (!entries.empty())
+        {
+            EvictOldest();
+        }
+        head = 0;
+        return false;
+    }
+
+    if (entries.empty())
+    {
+        head = 0;
+    }
+    else if (head + size > ring.size())
+    {
+        // Everything past head is older than what sits at the start
+        while (!entries.empty() && entries.front().offset >= head)
+        {
+            EvictOldest();
+        }
+        head = 0;
+    }
+
+    while (!entries.empty() && entries.front().offset >= head &&
+           entries.front().offset < head + size)
+    {
+        EvictOldest();
+    }
+    return true;
+}
+
+void Rewind::EvictOldest()
+{
+    // Deltas are useless without their keyframe, so they go with it
+    do
+    {
+        used -= entries.front().size;
+        entries.pop_front();
+    } while (!entries.empty() && !entries.front().keyframe);
+}
+
+bool Rewind::Decode(size_t entry, std::vector<uint8_t>& state) const
+{
+    size_t key = entry;
+    while (!entries[key].keyframe)
+    {
+        --key;
+    }
+
+    const Entry& base = entries[key];
+    state.assign(base.stateSize, 0);
+    if (!ApplyXor(ring.data() + base.offset, base.size, state))
+    {
+        return false;
+    }
+    if (key == entry)
+    {
+        return true;
+    }
+    const Entry& delta = entries[entry];
+    return ApplyXor(ring.data() + delta.offset, delta.size, state);
+}
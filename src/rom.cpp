@@ -0,0 +1,120 @@
+#include "rom.hpp"
+#include <fstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CHIP8_MMAP_ROMS
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+std::shared_ptr<const RomImage> RomImage::MapFile(const char* filename)
+{
+#ifdef CHIP8_MMAP_ROMS
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size <= 0 ||
+        static_cast<size_t>(info.st_size) > MAX_SIZE)
+    {
+        close(fd);
+        return nullptr;
+    }
+    void* mapping =
+        mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps its own reference to the file
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        return nullptr;
+    }
+
+    std::shared_ptr<RomImage> image(new RomImage);
+    image->mapping = mapping;
+    image->data = static_cast<const uint8_t*>(mapping);
+    image->size = info.st_size;
+    image->Seal();
+    return image;
+#else
+    return ReadFile(filename);
+#endif
+}
+
+std::shared_ptr<const RomImage> RomImage::ReadFile(const char* filename)
+{
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file.is_open())
+    {
+        return nullptr;
+    }
+    std::streamoff size = file.tellg();
+    if (size <= 0 || static_cast<size_t>(size) > MAX_SIZE)
+    {
+        return nullptr;
+    }
+
+    std::shared_ptr<RomImage> image(new RomImage);
+    image->owned.resize(size);
+    file.seekg(0, std::ios::beg);
+    if (!file.read(reinterpret_cast<char*>(image->owned.data()), size))
+    {
+        return nullptr;
+    }
+    image->data = image->owned.data();
+    image->size = size;
+    image->Seal();
+    return image;
+}
+
+std::shared_ptr<const RomImage> RomImage::FromMemory(const uint8_t* data,
+                                                     size_t size)
+{
+    if (size == 0 || size > MAX_SIZE)
+    {
+        return nullptr;
+    }
+    std::shared_ptr<RomImage> image(new RomImage);
+    image->owned.assign(data, data + size);
+    image->data = image->owned.data();
+    image->size = size;
+    image->Seal();
+    return image;
+}
+
+RomImage::~RomImage()
+{
+#ifdef CHIP8_MMAP_ROMS
+    if (mapping)
+    {
+        munmap(mapping, size);
+    }
+#endif
+}
+
+void RomImage::Seal()
+{
+    hash = EMPTY_HASH;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= data[i];
+        hash *= 0x01000193u;
+    }
+}
+
+std::shared_ptr<const RomImage> RomCache::Get(const std::string& filename)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = images.find(filename);
+    if (found != images.end())
+    {
+        return found->second;
+    }
+    std::shared_ptr<const RomImage> image =
+        RomImage::MapFile(filename.c_str());
+    images.emplace(filename, image);
+    return image;
+}
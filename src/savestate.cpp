@@ -0,0 +1,395 @@
+#include "chip8.hpp"
+#include "rom.hpp"
+
+/*
+Save-state layout, all integers little-endian:
+
+  "C8ST"          magic
+  u8              version, 2; version 1 blobs lack the extension bits
+  u8              flags, bit 0 set when memory is delta-encoded, bit 1 when
+                  the SuperChip/XoChip extension follows, bit 2 when it
+                  includes XO-CHIP memory above 4 KB
+  u8[16]          V0-VF
+  u16 u16         index, pc
+  u8 u8 u8        sp, delay timer, sound timer
+  u16[16]         stack
+  u16             keypad, one bit per key
+  u64             RNG state
+  u64[32]         framebuffer rows, already one bit per pixel
+  memory          either 4096 raw bytes, or
+                  u16 ROM size, u32 ROM hash, then runs of
+                  {u16 offset, u16 length, length bytes} that differ from the
+                  post-load image, ended by an offset of 0xFFFF
+  extension       u8 hires, u8 planes, u8[16] RPL flags, u8[16] audio
+                  pattern, u8 pitch, u64[256] display rows (plane, row,
+                  word), then the 61440 bytes above 0x1000 raw or as runs
+                  like memory's, with offsets from 0x1000
+*/
+
+namespace
+{
+const uint8_t STATE_MAGIC[4] = {'C', '8', 'S', 'T'};
+const uint8_t STATE_VERSION = 2;
+const uint8_t STATE_MEMORY_DELTA = 0x1;
+const uint8_t STATE_EXTENSION = 0x2;
+const uint8_t STATE_HIGH_MEMORY = 0x4;
+const uint16_t END_OF_RUNS = 0xFFFF;
+// Unchanged bytes shorter than a run header are cheaper to store inline
+// than to split the run around.
+const unsigned int MIN_RUN_GAP = 4;
+
+void Put8(std::vector<uint8_t>& out, uint8_t value) { out.push_back(value); }
+
+void Put16(std::vector<uint8_t>& out, uint16_t value)
+{
+    out.push_back(value & 0xFFu);
+    out.push_back(value >> 8u);
+}
+
+void Put32(std::vector<uint8_t>& out, uint32_t value)
+{
+    Put16(out, value & 0xFFFFu);
+    Put16(out, value >> 16u);
+}
+
+void Put64(std::vector<uint8_t>& out, uint64_t value)
+{
+    Put32(out, value & 0xFFFFFFFFu);
+    Put32(out, value >> 32u);
+}
+
+void PutBytes(std::vector<uint8_t>& out, const uint8_t* data, size_t size)
+{
+    out.insert(out.end(), data, data + size);
+}
+
+// The runs of data that differ from base, ended by END_OF_RUNS.
+void PutRuns(std::vector<uint8_t>& out, const uint8_t* data,
+             const uint8_t* base, unsigned int size)
+{
+    unsigned int addr = 0;
+    while (addr < size)
+    {
+        if (data[addr] == base[addr])
+        {
+            ++addr;
+            continue;
+        }
+        // Extend the run until MIN_RUN_GAP consecutive bytes match again
+        unsigned int start = addr;
+        unsigned int end = addr + 1;
+        unsigned int same = 0;
+        for (unsigned int a = end; a < size && same < MIN_RUN_GAP; ++a)
+        {
+            if (data[a] == base[a])
+            {
+                ++same;
+            }
+            else
+            {
+                same = 0;
+                end = a + 1;
+            }
+        }
+        Put16(out, start);
+        Put16(out, end - start);
+        PutBytes(out, data + start, end - start);
+        addr = end;
+    }
+    Put16(out, END_OF_RUNS);
+}
+
+// Bounds-checked cursor over a state blob; every read fails once past end.
+struct Reader
+{
+    const uint8_t* data;
+    size_t size;
+    size_t at;
+
+    bool Bytes(uint8_t* out, size_t count)
+    {
+        if (size - at < count)
+        {
+            return false;
+        }
+        memcpy(out, data + at, count);
+        at += count;
+        return true;
+    }
+
+    bool U8(uint8_t& value) { return Bytes(&value, 1); }
+
+    bool U16(uint16_t& value)
+    {
+        uint8_t b[2];
+        if (!Bytes(b, 2))
+        {
+            return false;
+        }
+        value = b[0] | (b[1] << 8u);
+        return true;
+    }
+
+    bool U32(uint32_t& value)
+    {
+        uint16_t low;
+        uint16_t high;
+        if (!U16(low) || !U16(high))
+        {
+            return false;
+        }
+        value = low | (static_cast<uint32_t>(high) << 16u);
+        return true;
+    }
+
+    bool U64(uint64_t& value)
+    {
+        uint32_t low;
+        uint32_t high;
+        if (!U32(low) || !U32(high))
+        {
+            return false;
+        }
+        value = low | (static_cast<uint64_t>(high) << 32u);
+        return true;
+    }
+
+    // Apply PutRuns() output to data, which already holds the base.
+    bool Runs(uint8_t* data, unsigned int size)
+    {
+        while (true)
+        {
+            uint16_t offset;
+            uint16_t length;
+            if (!U16(offset))
+            {
+                return false;
+            }
+            if (offset == END_OF_RUNS)
+            {
+                return true;
+            }
+            if (!U16(length) || offset + length > size ||
+                !Bytes(data + offset, length))
+            {
+                return false;
+            }
+        }
+    }
+};
+
+} // namespace
+
+void Chip8::SaveState(std::vector<uint8_t>& out, bool deltaMemory) const
+{
+    out.clear();
+    PutBytes(out, STATE_MAGIC, sizeof(STATE_MAGIC));
+    Put8(out, STATE_VERSION);
+    bool highMemory = extension && !extension->high.empty();
+    Put8(out, (deltaMemory ? STATE_MEMORY_DELTA : 0) |
+                  (extension ? STATE_EXTENSION : 0) |
+                  (highMemory ? STATE_HIGH_MEMORY : 0));
+
+    PutBytes(out, registers, sizeof(registers));
+    Put16(out, index);
+    Put16(out, pc);
+    Put8(out, sp);
+    Put8(out, delayTimer);
+    Put8(out, soundTimer);
+    for (uint16_t entry : stack)
+    {
+        Put16(out, entry);
+    }
+    uint16_t keys = 0;
+    for (unsigned int i = 0; i < 16; ++i)
+    {
+        keys |= (keypad[i] ? 1u : 0u) << i;
+    }
+    Put16(out, keys);
+    Put64(out, rngState);
+    for (uint64_t row : video)
+    {
+        Put64(out, row);
+    }
+
+    if (!deltaMemory)
+    {
+        PutBytes(out, memory, sizeof(memory));
+    }
+    else
+    {
+        uint8_t base[MEMORY_SIZE];
+        BuildBaseImage(base);
+        Put16(out, romImage ? romImage->Size() : 0);
+        Put32(out, RomHash());
+        PutRuns(out, memory, base, MEMORY_SIZE);
+    }
+
+    if (!extension)
+    {
+        return;
+    }
+    const ExtendedDisplay& display = extension->display;
+    Put8(out, display.hires);
+    Put8(out, display.planes);
+    PutBytes(out, extension->flags, sizeof(extension->flags));
+    PutBytes(out, extension->audio, sizeof(extension->audio));
+    Put8(out, extension->pitch);
+    for (const auto& plane : display.rows)
+    {
+        for (const auto& row : plane)
+        {
+            Put64(out, row[0]);
+            Put64(out, row[1]);
+        }
+    }
+    if (!highMemory)
+    {
+        return;
+    }
+    const std::vector<uint8_t>& high = extension->high;
+    if (!deltaMemory)
+    {
+        PutBytes(out, high.data(), high.size());
+        return;
+    }
+    std::vector<uint8_t> base(high.size());
+    BuildHighImage(base.data());
+    PutRuns(out, high.data(), base.data(), high.size());
+}
+
+bool Chip8::LoadState(const uint8_t* data, size_t size)
+{
+    Reader in = {data, size, 0};
+
+    uint8_t magic[4];
+    uint8_t version;
+    uint8_t flags;
+    if (!in.Bytes(magic, sizeof(magic)) ||
+        memcmp(magic, STATE_MAGIC, sizeof(magic)) != 0 || !in.U8(version) ||
+        version < 1 || version > STATE_VERSION || !in.U8(flags))
+    {
+        return false;
+    }
+    // The profile has to be set to one with the same extension first
+    bool highMemory = extension && !extension->high.empty();
+    if (((flags & STATE_EXTENSION) != 0) != (extension != nullptr) ||
+        ((flags & STATE_HIGH_MEMORY) != 0) != highMemory)
+    {
+        return false;
+    }
+
+    // Decode into temporaries so a bad blob leaves the machine untouched
+    uint8_t newRegisters[16] = {};
+    uint16_t newIndex = 0;
+    uint16_t newPc = 0;
+    uint8_t newSp = 0;
+    uint8_t newDelay = 0;
+    uint8_t newSound = 0;
+    uint16_t newStack[16];
+    uint16_t keys = 0;
+    uint64_t newRng = 0;
+    uint64_t newVideo[VIDEO_HEIGHT];
+    uint8_t newMemory[MEMORY_SIZE];
+
+    bool ok = in.Bytes(newRegisters, sizeof(newRegisters)) &&
+              in.U16(newIndex) && in.U16(newPc) && in.U8(newSp) &&
+              in.U8(newDelay) && in.U8(newSound);
+    for (uint16_t& entry : newStack)
+    {
+        ok = ok && in.U16(entry);
+    }
+    ok = ok && in.U16(keys) && in.U64(newRng);
+    for (uint64_t& row : newVideo)
+    {
+        ok = ok && in.U64(row);
+    }
+    if (!ok)
+    {
+        return false;
+    }
+
+    if (flags & STATE_MEMORY_DELTA)
+    {
+        uint16_t romSize;
+        uint32_t romHash;
+        if (!in.U16(romSize) || !in.U32(romHash) ||
+            romSize != (romImage ? romImage->Size() : 0) ||
+            romHash != RomHash())
+        {
+            return false;
+        }
+        BuildBaseImage(newMemory);
+        if (!in.Runs(newMemory, MEMORY_SIZE))
+        {
+            return false;
+        }
+    }
+    else if (!in.Bytes(newMemory, sizeof(newMemory)))
+    {
+        return false;
+    }
+
+    std::unique_ptr<Extension> newExtension;
+    if (extension)
+    {
+        newExtension.reset(new Extension);
+        ExtendedDisplay& display = newExtension->display;
+        uint8_t hires = 0;
+        ok = in.U8(hires) && in.U8(display.planes) &&
+             in.Bytes(newExtension->flags, sizeof(newExtension->flags)) &&
+             in.Bytes(newExtension->audio, sizeof(newExtension->audio)) &&
+             in.U8(newExtension->pitch);
+        display.hires = hires != 0;
+        for (auto& plane : display.rows)
+        {
+            for (auto& row : plane)
+            {
+                ok = ok && in.U64(row[0]) && in.U64(row[1]);
+            }
+        }
+        if (!ok || display.planes > 0x3)
+        {
+            return false;
+        }
+        std::vector<uint8_t>& high = newExtension->high;
+        high.resize(extension->high.size());
+        if (highMemory && (flags & STATE_MEMORY_DELTA))
+        {
+            BuildHighImage(high.data());
+            ok = in.Runs(high.data(), high.size());
+        }
+        else if (highMemory)
+        {
+            ok = in.Bytes(high.data(), high.size());
+        }
+        if (!ok)
+        {
+            return false;
+        }
+    }
+
+    memcpy(registers, newRegisters, sizeof(registers));
+    index = newIndex;
+    pc = newPc;
+    sp = newSp;
+    delayTimer = newDelay;
+    soundTimer = newSound;
+    memcpy(stack, newStack, sizeof(stack));
+    for (unsigned int i = 0; i < 16; ++i)
+    {
+        keypad[i] = (keys >> i) & 1u;
+    }
+    rngState = newRng;
+    memcpy(video, newVideo, sizeof(video));
+    memcpy(memory, newMemory, sizeof(memory));
+    if (extension)
+    {
+        extension = std::move(newExtension);
+    }
+    memoryDirty = true;
+
+    dirtyRows = 0xFFFFFFFF;
+    FlushCache();
+    return true;
+}
@@ -0,0 +1,80 @@
+#include "scheduler.hpp"
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+Scheduler::Scheduler(uint32_t instructionsPerFrame)
+    : instructionsPerFrame(std::max(1u, instructionsPerFrame)),
+      framePeriod(std::chrono::duration_cast<Clock::duration>(
+          std::chrono::duration<double>(1.0 / FRAME_RATE))),
+      nextFrame(Clock::now()), period(framePeriod), speedSince(nextFrame)
+{
+}
+
+void Scheduler::RunFrame(Chip8& chip8, const std::vector<InputEvent>& events)
+{
+    uint64_t cycle = 0;
+    for (const InputEvent& event : events)
+    {
+        chip8.Run(static_cast<uint32_t>(event.cycle - cycle));
+        chip8.keypad[event.key] = event.down;
+        cycle = event.cycle;
+    }
+    chip8.Run(static_cast<uint32_t>(instructionsPerFrame - cycle));
+    chip8.TickTimers();
+    ++frames;
+}
+
+void Scheduler::WaitForNextFrame()
+{
+    const int maxLag = 4;
+    if (speed == 0.0)
+    {
+        return;
+    }
+    nextFrame += period;
+    Clock::time_point now = Clock::now();
+    if (now > nextFrame + maxLag * period)
+    {
+        nextFrame = now;
+        return;
+    }
+    std::this_thread::sleep_until(nextFrame);
+}
+
+void Scheduler::SetSpeed(double speed)
+{
+    this->speed = std::max(0.0, speed);
+    if (this->speed > 0.0)
+    {
+        period = std::chrono::duration_cast<Clock::duration>(framePeriod /
+                                                             this->speed);
+    }
+    nextFrame = Clock::now();
+    speedSince = nextFrame;
+    framesSince = frames;
+}
+
+double Scheduler::MeasuredSpeed() const
+{
+    std::chrono::duration<double> wall = Clock::now() - speedSince;
+    if (wall.count() <= 0.0)
+    {
+        return 0.0;
+    }
+    return (frames - framesSince) / (FRAME_RATE * wall.count());
+}
+
+uint32_t Scheduler::FromCycleDelay(float cycleDelay)
+{
+    // A zero delay used to mean "as fast as the loop spins"; give it a
+    // generous fixed rate instead of an unbounded one.
+    const uint32_t maxInstructionsPerFrame = 1000;
+    if (cycleDelay <= 0.0f)
+    {
+        return maxInstructionsPerFrame;
+    }
+    float perFrame = 1000.0f / (FRAME_RATE * cycleDelay);
+    return std::min(maxInstructionsPerFrame,
+                    std::max(1u, static_cast<uint32_t>(std::lround(perFrame))));
+}
@@ -0,0 +1,804 @@
+#include "server.hpp"
+#include "batch.hpp"
+#include "chip8.hpp"
+#include "delta.hpp"
+#include "input.hpp"
+#include "scheduler.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#ifdef __linux__
+#define CHIP8_SERVER
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+void PutLE(std::vector<uint8_t>& out, uint64_t value, unsigned int bytes)
+{
+    for (unsigned int i = 0; i < bytes; ++i)
+    {
+        out.push_back((value >> (8u * i)) & 0xFFu);
+    }
+}
+
+uint64_t GetLE(const uint8_t* data, unsigned int bytes)
+{
+    uint64_t value = 0;
+    for (unsigned int i = 0; i < bytes; ++i)
+    {
+        value |= static_cast<uint64_t>(data[i]) << (8u * i);
+    }
+    return value;
+}
+
+void PutMessage(std::vector<uint8_t>& out, uint8_t type, const void* payload,
+                size_t size)
+{
+    PutLE(out, size + 1, 4);
+    out.push_back(type);
+    const uint8_t* bytes = static_cast<const uint8_t*>(payload);
+    out.insert(out.end(), bytes, bytes + size);
+}
+
+/*
+Take every complete message off the front of buffer, calling
+handle(type, payload, size) for each until it returns false. Returns false
+on a handler failure or a malformed length.
+*/
+template <typename Handler>
+bool TakeMessages(std::vector<uint8_t>& buffer, Handler handle)
+{
+    size_t at = 0;
+    bool ok = true;
+    while (ok && buffer.size() - at >= ServerProtocol::HEADER_SIZE)
+    {
+        uint32_t length = static_cast<uint32_t>(GetLE(&buffer[at], 4));
+        if (length == 0 || length > ServerProtocol::MAX_MESSAGE)
+        {
+            ok = false;
+            break;
+        }
+        if (buffer.size() - at - 4 < length)
+        {
+            break;
+        }
+        ok = handle(buffer[at + 4], &buffer[at + 5], length - 1);
+        at += 4 + length;
+    }
+    buffer.erase(buffer.begin(), buffer.begin() + at);
+    return ok;
+}
+
+#ifdef CHIP8_SERVER
+// A socket ready for bind() or connect(), or -1 if the path is too long.
+int UnixSocket(const char* path, sockaddr_un& address, int flags)
+{
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (std::strlen(path) >= sizeof(address.sun_path))
+    {
+        return -1;
+    }
+    std::strcpy(address.sun_path, path);
+    return socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | flags, 0);
+}
+
+int Connect(const char* path)
+{
+    sockaddr_un address;
+    int fd = UnixSocket(path, address, 0);
+    if (fd >= 0 &&
+        connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)))
+    {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+bool SendAll(int fd, const std::vector<uint8_t>& data)
+{
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent,
+                         MSG_NOSIGNAL);
+        if (n < 0 && errno != EINTR)
+        {
+            return false;
+        }
+        sent += std::max<ssize_t>(n, 0);
+    }
+    return true;
+}
+
+// Append whatever the socket has; false once the peer has closed.
+bool ReceiveSome(int fd, std::vector<uint8_t>& buffer)
+{
+    uint8_t chunk[16384];
+    ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+    if (n <= 0)
+    {
+        return n < 0 && (errno == EINTR || errno == EAGAIN);
+    }
+    buffer.insert(buffer.end(), chunk, chunk + n);
+    return true;
+}
+#endif
+} // namespace
+
+struct Server::Session
+{
+    Session(uint32_t seed, uint32_t instructionsPerFrame)
+        : chip8(seed), scheduler(instructionsPerFrame),
+          timeline(instructionsPerFrame)
+    {
+    }
+
+    Chip8 chip8;
+    Scheduler scheduler;
+    KeyTimeline timeline;
+    KeyEventQueue keys; // pushed by the event loop, drained by a worker
+    DeltaEncoder encoder;
+    std::vector<uint8_t> message; // the last frame, ready to send
+};
+
+Server::Server(const ServerOptions& options) : options(options)
+{
+}
+
+#ifdef CHIP8_SERVER
+
+Server::~Server()
+{
+    connections.clear();
+    for (int fd : {listenFd, epollFd, timerFd, signalFd})
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+    if (listenFd >= 0)
+    {
+        unlink(socketPath.c_str());
+    }
+}
+
+/*
+SIGINT and SIGTERM are blocked and read from a signalfd instead, before the
+worker pool starts so that its threads inherit the mask and the signals
+always reach the event loop.
+*/
+bool Server::Listen(const char* socketPath)
+{
+    sockaddr_un address;
+    listenFd = UnixSocket(socketPath, address, SOCK_NONBLOCK);
+    if (listenFd < 0)
+    {
+        return false;
+    }
+    this->socketPath = socketPath;
+    unlink(socketPath);
+    if (bind(listenFd, reinterpret_cast<sockaddr*>(&address),
+             sizeof(address)) ||
+        listen(listenFd, SOMAXCONN))
+    {
+        close(listenFd);
+        listenFd = -1;
+        return false;
+    }
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    itimerspec period{};
+    period.it_interval.tv_nsec = 1000000000 / FRAME_RATE;
+    period.it_value = period.it_interval;
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (signalFd < 0 || timerFd < 0 || epollFd < 0 ||
+        timerfd_settime(timerFd, 0, &period, nullptr))
+    {
+        return false;
+    }
+    for (int fd : {listenFd, timerFd, signalFd})
+    {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event))
+        {
+            return false;
+        }
+    }
+
+    unsigned threads = options.threads ? options.threads
+                                       : std::thread::hardware_concurrency();
+    pool.reset(new ThreadPool(threads));
+    started = Clock::now();
+    return true;
+}
+
+void Server::Run()
+{
+    epoll_event events[64];
+    bool stopping = false;
+    while (!stopping)
+    {
+        int count = epoll_wait(epollFd, events, 64, -1);
+        if (count < 0 && errno != EINTR)
+        {
+            break;
+        }
+        for (int i = 0; i < count; ++i)
+        {
+            int fd = events[i].data.fd;
+            if (fd == listenFd)
+            {
+                Accept();
+            }
+            else if (fd == timerFd)
+            {
+                uint64_t expirations = 0;
+                if (read(timerFd, &expirations, sizeof(expirations)) ==
+                        sizeof(expirations) &&
+                    expirations)
+                {
+                    lateTicks += expirations - 1;
+                    Tick();
+                }
+            }
+            else if (fd == signalFd)
+            {
+                stopping = true;
+            }
+            else
+            {
+                auto found = connections.find(fd);
+                if (found == connections.end())
+                {
+                    continue; // closed earlier in this batch
+                }
+                Connection& connection = *found->second;
+                uint32_t what = events[i].events;
+                bool open = !(what & (EPOLLERR | EPOLLHUP));
+                if (open && (what & EPOLLIN))
+                {
+                    open = Receive(connection);
+                }
+                if (open && (what & EPOLLOUT))
+                {
+                    open = Flush(connection);
+                }
+                if (!open)
+                {
+                    Close(fd);
+                }
+            }
+        }
+    }
+}
+
+void Server::Accept()
+{
+    for (;;)
+    {
+        int fd = accept4(listenFd, nullptr, nullptr,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            return; // EAGAIN once the backlog is empty
+        }
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event))
+        {
+            close(fd);
+            continue;
+        }
+        std::unique_ptr<Connection> connection(new Connection);
+        connection->fd = fd;
+        connections[fd] = std::move(connection);
+    }
+}
+
+bool Server::Receive(Connection& connection)
+{
+    for (;;)
+    {
+        size_t before = connection.in.size();
+        if (!ReceiveSome(connection.fd, connection.in))
+        {
+            return false;
+        }
+        if (connection.in.size() == before)
+        {
+            break;
+        }
+    }
+    return TakeMessages(connection.in,
+                        [&](uint8_t type, const uint8_t* payload, size_t size)
+                        { return Handle(connection, type, payload, size); }) &&
+           Flush(connection);
+}
+
+bool Server::Handle(Connection& connection, uint8_t type,
+                    const uint8_t* payload, size_t size)
+{
+    using namespace ServerProtocol;
+
+    if (type == OPEN && size >= 8)
+    {
+        uint32_t seed = static_cast<uint32_t>(GetLE(payload, 4));
+        uint32_t instructionsPerFrame =
+            static_cast<uint32_t>(GetLE(payload + 4, 4));
+        std::string rom(reinterpret_cast<const char*>(payload + 8), size - 8);
+        std::shared_ptr<const RomImage> image = roms.Get(rom);
+        QuirkProfile quirks =
+            image ? options.quirks.Find(image->Hash()) : QuirkProfile::Default;
+        // Frames go out in the 64x32 delta format
+        bool extended = quirks == QuirkProfile::SuperChip ||
+                        quirks == QuirkProfile::XoChip;
+        const char* error =
+            connection.session ? "a machine is already open"
+            : !image           ? "cannot load ROM"
+            : extended         ? "extended display not supported"
+            : image->Size() > Chip8::RomCapacity(quirks)
+                ? "ROM too large for its quirk profile"
+                : nullptr;
+        if (error)
+        {
+            PutMessage(connection.out, FAILED, error, std::strlen(error));
+            return true;
+        }
+        connection.session.reset(
+            new Session(seed, std::max(1u, instructionsPerFrame)));
+        connection.session->chip8.SetQuirks(quirks);
+        connection.session->chip8.LoadROM(image);
+        std::vector<uint8_t> hash;
+        PutLE(hash, image->Hash(), 4);
+        PutMessage(connection.out, READY, hash.data(), hash.size());
+        activeChanged = true;
+        return true;
+    }
+    if (type == KEY && size == 2)
+    {
+        if (connection.session && payload[0] < 16)
+        {
+            // Dropped if the queue is full, like a frontend's would be
+            uint8_t down = payload[1] ? 1 : 0;
+            connection.session->keys.TryPush(
+                {Clock::now(), payload[0], down});
+        }
+        return true;
+    }
+    if (type == STATS && size == 0)
+    {
+        std::string stats = Stats();
+        PutMessage(connection.out, STATS_REPLY, stats.data(), stats.size());
+        return true;
+    }
+    return false;
+}
+
+/*
+Write as much of the output as the socket takes. Whatever is left is sent
+when epoll reports the socket writable, which is only asked for while
+something is left.
+*/
+bool Server::Flush(Connection& connection)
+{
+    while (connection.sent < connection.out.size())
+    {
+        ssize_t n = send(connection.fd, connection.out.data() + connection.sent,
+                         connection.out.size() - connection.sent,
+                         MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN)
+            {
+                return false;
+            }
+            break;
+        }
+        connection.sent += n;
+    }
+    if (connection.sent == connection.out.size())
+    {
+        connection.out.clear();
+        connection.sent = 0;
+    }
+
+    bool writing = !connection.out.empty();
+    if (writing != connection.writing)
+    {
+        epoll_event event{};
+        event.events =
+            EPOLLIN | (writing ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+        event.data.fd = connection.fd;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, connection.fd, &event);
+        connection.writing = writing;
+    }
+    return true;
+}
+
+void Server::Close(int fd)
+{
+    auto found = connections.find(fd);
+    if (found->second->session)
+    {
+        // Not waiting for the next tick to rebuild the list: a tick may
+        // be closing connections as it goes
+        active.erase(std::remove(active.begin(), active.end(),
+                                 found->second.get()),
+                     active.end());
+    }
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    connections.erase(found);
+}
+
+/*
+One frame of every machine. The machines are split into a few chunks per
+worker, so the pool can even out machines that draw a lot against idle
+ones, and the event loop waits for all of them: the frames go out together
+and a machine never runs while its key queue is being filled.
+*/
+void Server::Tick()
+{
+    if (activeChanged)
+    {
+        active.clear();
+        for (auto& entry : connections)
+        {
+            if (entry.second->session)
+            {
+                active.push_back(entry.second.get());
+            }
+        }
+        activeChanged = false;
+    }
+    ++ticks;
+    if (active.empty())
+    {
+        return;
+    }
+
+    Clock::time_point now = Clock::now();
+    size_t chunks = std::min<size_t>(active.size(), pool->Size() * 4);
+    for (size_t c = 0; c < chunks; ++c)
+    {
+        size_t begin = active.size() * c / chunks;
+        size_t end = active.size() * (c + 1) / chunks;
+        pool->Submit(
+            [this, begin, end, now]
+            {
+                Clock::time_point start = Clock::now();
+                for (size_t i = begin; i < end; ++i)
+                {
+                    Session& s = *active[i]->session;
+                    s.scheduler.RunFrame(s.chip8,
+                                         s.timeline.NextFrame(s.keys, now));
+
+                    s.message.clear();
+                    PutLE(s.message, 0, 4); // length, filled in below
+                    s.message.push_back(ServerProtocol::FRAME);
+                    PutLE(s.message, s.scheduler.Frames(), 8);
+                    s.encoder.Encode(s.chip8.video, s.message);
+                    uint32_t length = static_cast<uint32_t>(s.message.size());
+                    for (unsigned b = 0; b < 4; ++b)
+                    {
+                        s.message[b] = ((length - 4) >> (8u * b)) & 0xFFu;
+                    }
+                }
+                emulationNanoseconds +=
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        Clock::now() - start)
+                        .count();
+            });
+    }
+    pool->Wait();
+    sessionFrames += active.size();
+
+    // A client too far behind misses frames; the changes in them are made
+    // up for by a keyframe once it has caught up.
+    Clock::time_point start = Clock::now();
+    std::vector<int> failed;
+    for (Connection* connection : active)
+    {
+        Session& s = *connection->session;
+        if (connection->out.size() - connection->sent > options.maxBacklog)
+        {
+            s.encoder.ForceKeyframe();
+            continue;
+        }
+        connection->out.insert(connection->out.end(), s.message.begin(),
+                               s.message.end());
+        if (!Flush(*connection))
+        {
+            failed.push_back(connection->fd);
+        }
+    }
+    for (int fd : failed)
+    {
+        Close(fd);
+    }
+    outputNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             Clock::now() - start)
+                             .count();
+}
+
+/*
+Per-session figures are averages. A session's bytes are everything the
+server holds for it: the machine with its block cache, pacing and key
+queue, and the connection with its buffers. The frame cost adds the
+emulation time, summed over workers, to the event loop's time queueing
+and writing frames, so one core can run 1/60 s divided by it.
+*/
+std::string Server::Stats() const
+{
+    size_t sessionBytes = 0;
+    for (const auto& entry : connections)
+    {
+        const Connection& connection = *entry.second;
+        if (connection.session)
+        {
+            const Session& s = *connection.session;
+            sessionBytes += sizeof(Connection) + sizeof(Session) -
+                            sizeof(Chip8) + s.chip8.MemoryFootprint() +
+                            s.message.capacity() + connection.in.capacity() +
+                            connection.out.capacity();
+        }
+    }
+    size_t sessions = active.size();
+    double frameNanoseconds =
+        sessionFrames ? static_cast<double>(emulationNanoseconds.load() +
+                                            outputNanoseconds) /
+                            sessionFrames
+                      : 0.0;
+    double uptime = std::chrono::duration<double>(Clock::now() - started)
+                        .count();
+
+    std::ostringstream out;
+    out << "{\"sessions\": " << sessions
+        << ", \"connections\": " << connections.size()
+        << ", \"threads\": " << pool->Size()
+        << ", \"uptime_s\": " << uptime << ", \"ticks\": " << ticks
+        << ", \"late_ticks\": " << lateTicks
+        << ", \"session_bytes\": " << (sessions ? sessionBytes / sessions : 0)
+        << ", \"session_frame_ns\": " << static_cast<uint64_t>(frameNanoseconds)
+        << ", \"max_sessions_per_core\": "
+        << (frameNanoseconds > 0
+                ? static_cast<uint64_t>(1e9 / FRAME_RATE / frameNanoseconds)
+                : 0)
+        << "}";
+    return out.str();
+}
+
+namespace
+{
+struct ClientSession
+{
+    int fd;
+    std::vector<uint8_t> in;
+    bool ready = false;
+    uint64_t frame = 0;
+    uint64_t bytes = 0;
+    size_t nextEvent = 0;
+    DeltaDecoder decoder;
+};
+} // namespace
+
+/*
+Key events go out as soon as the frame before the one their cycle falls in
+arrives. The server places them by arrival time, so they land on the
+intended frame only while client and server keep up with each other.
+*/
+bool RunClient(const char* socketPath, const ClientOptions& options,
+               std::ostream& out)
+{
+    using namespace ServerProtocol;
+
+    InputScript script;
+    if (!options.input.empty() &&
+        !LoadInputScript(options.input.c_str(), script))
+    {
+        std::cerr << "Bad input script: " << options.input << "\n";
+        return false;
+    }
+
+    // The same clamp the server applies, so key events land on its frames
+    uint32_t instructionsPerFrame = std::max(1u, options.instructionsPerFrame);
+    std::vector<ClientSession> sessions(options.sessions);
+    std::vector<pollfd> polls;
+    for (unsigned i = 0; i < options.sessions; ++i)
+    {
+        ClientSession& s = sessions[i];
+        s.fd = Connect(socketPath);
+        std::vector<uint8_t> open;
+        PutLE(open, options.seed + i, 4);
+        PutLE(open, instructionsPerFrame, 4);
+        open.insert(open.end(), options.rom.begin(), options.rom.end());
+        std::vector<uint8_t> message;
+        PutMessage(message, OPEN, open.data(), open.size());
+        if (s.fd < 0 || !SendAll(s.fd, message))
+        {
+            std::cerr << "Cannot connect to " << socketPath << "\n";
+            return false;
+        }
+        polls.push_back({s.fd, POLLIN, 0});
+    }
+
+    bool ok = true;
+    unsigned finished = 0;
+    while (ok && finished < sessions.size())
+    {
+        if (poll(polls.data(), polls.size(), -1) < 0 && errno != EINTR)
+        {
+            break;
+        }
+        for (size_t i = 0; ok && i < polls.size(); ++i)
+        {
+            ClientSession& s = sessions[i];
+            if (!polls[i].revents || polls[i].fd < 0)
+            {
+                continue;
+            }
+            size_t before = s.in.size();
+            if (!ReceiveSome(s.fd, s.in) || s.in.size() == before)
+            {
+                std::cerr << "Session " << i << ": server closed\n";
+                ok = false;
+                break;
+            }
+            s.bytes += s.in.size() - before;
+
+            std::vector<uint8_t> keys;
+            ok = TakeMessages(
+                s.in,
+                [&](uint8_t type, const uint8_t* payload, size_t size)
+                {
+                    if (type == READY)
+                    {
+                        s.ready = true;
+                    }
+                    else if (type == FAILED)
+                    {
+                        std::cerr << "Session " << i << ": "
+                                  << std::string(
+                                         reinterpret_cast<const char*>(payload),
+                                         size)
+                                  << "\n";
+                        return false;
+                    }
+                    else if (type == FRAME && size > 8 &&
+                             s.frame < options.frames)
+                    {
+                        s.frame = GetLE(payload, 8);
+                        size_t used;
+                        if (!s.decoder.Decode(payload + 8, size - 8, used) ||
+                            used != size - 8)
+                        {
+                            std::cerr << "Session " << i << ": bad frame\n";
+                            return false;
+                        }
+                        const std::vector<InputEvent>& events = script.events;
+                        while (s.nextEvent < events.size() &&
+                               events[s.nextEvent].cycle /
+                                       instructionsPerFrame <= s.frame)
+                        {
+                            const InputEvent& e = events[s.nextEvent++];
+                            uint8_t key[2] = {e.key, e.down};
+                            PutMessage(keys, KEY, key, sizeof(key));
+                        }
+                    }
+                    return true;
+                });
+            if (ok && !keys.empty())
+            {
+                ok = SendAll(s.fd, keys);
+            }
+            if (ok && s.frame >= options.frames)
+            {
+                close(s.fd);
+                polls[i].fd = -1;
+                ++finished;
+            }
+        }
+    }
+
+    out << "session,frames,bytes,video_hash\n";
+    for (size_t i = 0; i < sessions.size(); ++i)
+    {
+        const ClientSession& s = sessions[i];
+        out << i << "," << s.frame << "," << s.bytes << "," << std::hex
+            << HashVideo(s.decoder.Video()) << std::dec << "\n";
+        if (polls[i].fd >= 0)
+        {
+            close(s.fd);
+        }
+    }
+    return ok;
+}
+
+bool RunStatsClient(const char* socketPath, std::ostream& out)
+{
+    int fd = Connect(socketPath);
+    std::vector<uint8_t> request;
+    PutMessage(request, ServerProtocol::STATS, nullptr, 0);
+    if (fd < 0 || !SendAll(fd, request))
+    {
+        std::cerr << "Cannot connect to " << socketPath << "\n";
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return false;
+    }
+
+    std::vector<uint8_t> in;
+    bool answered = false;
+    while (!answered && ReceiveSome(fd, in))
+    {
+        TakeMessages(in,
+                     [&](uint8_t type, const uint8_t* payload, size_t size)
+                     {
+                         if (type == ServerProtocol::STATS_REPLY)
+                         {
+                             out.write(reinterpret_cast<const char*>(payload),
+                                       size);
+                             out << "\n";
+                             answered = true;
+                         }
+                         return true;
+                     });
+    }
+    close(fd);
+    return answered;
+}
+
+#else
+
+Server::~Server() {}
+
+bool Server::Listen(const char*)
+{
+    return false;
+}
+
+void Server::Run() {}
+
+bool RunClient(const char*, const ClientOptions&, std::ostream&)
+{
+    return false;
+}
+
+bool RunStatsClient(const char*, std::ostream&)
+{
+    return false;
+}
+
+#endif
@@ -0,0 +1,108 @@
+#include "thread_pool.hpp"
+
+ThreadPool::ThreadPool(unsigned threadCount)
+{
+    if (threadCount == 0)
+    {
+        threadCount = 1;
+    }
+    for (unsigned i = 0; i < threadCount; ++i)
+    {
+        queues.emplace_back(new Queue);
+    }
+    for (unsigned i = 0; i < threadCount; ++i)
+    {
+        threads.emplace_back(&ThreadPool::WorkerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(sleepLock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& t : threads)
+    {
+        t.join();
+    }
+}
+
+void ThreadPool::Submit(std::function<void()> task)
+{
+    Queue& q = *queues[nextQueue++ % queues.size()];
+    {
+        std::lock_guard<std::mutex> guard(q.lock);
+        q.tasks.push_back(std::move(task));
+    }
+    ++pending;
+    ++queued;
+    // Taking the sleep lock orders the increment above against a worker that
+    // is about to test the predicate and go to sleep, so no wakeup is lost.
+    {
+        std::lock_guard<std::mutex> guard(sleepLock);
+    }
+    wake.notify_one();
+}
+
+void ThreadPool::Wait()
+{
+    std::unique_lock<std::mutex> guard(sleepLock);
+    done.wait(guard, [this] { return pending == 0; });
+}
+
+bool ThreadPool::PopLocal(unsigned id, std::function<void()>& task)
+{
+    Queue& q = *queues[id];
+    std::lock_guard<std::mutex> guard(q.lock);
+    if (q.tasks.empty())
+    {
+        return false;
+    }
+    task = std::move(q.tasks.back());
+    q.tasks.pop_back();
+    return true;
+}
+
+bool ThreadPool::Steal(unsigned id, std::function<void()>& task)
+{
+    for (size_t i = 1; i < queues.size(); ++i)
+    {
+        Queue& q = *queues[(id + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(q.lock);
+        if (!q.tasks.empty())
+        {
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::WorkerLoop(unsigned id)
+{
+    while (true)
+    {
+        std::function<void()> task;
+        if (PopLocal(id, task) || Steal(id, task))
+        {
+            --queued;
+            task();
+            if (--pending == 0)
+            {
+                std::lock_guard<std::mutex> guard(sleepLock);
+                done.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(sleepLock);
+        wake.wait(guard, [this] { return stopping || queued > 0; });
+        if (stopping)
+        {
+            return;
+        }
+    }
+}
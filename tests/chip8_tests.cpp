@@ -0,0 +1,427 @@
+#include "chip8.hpp"
+#include "delta.hpp"
+#include "jit.hpp"
+#include "lockstep.hpp"
+#include "rewind.hpp"
+#include "rom.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*
+Behavioural checks for the emulator core, registered with CTest one test per
+name: `chip8_tests savestate` runs one, no argument runs them all. Every
+check drives whole machines through synthetic ROMs and compares complete
+save states, so a difference anywhere in the machine fails it.
+*/
+
+namespace
+{
+// CTest reports a test exiting with this code as skipped.
+const int SKIPPED = 77;
+
+const QuirkProfile PROFILES[] = {QuirkProfile::Default, QuirkProfile::Chip8,
+                                 QuirkProfile::Chip48, QuirkProfile::SuperChip,
+                                 QuirkProfile::XoChip};
+
+struct TestRom
+{
+    std::string name;
+    std::vector<uint8_t> bytes;
+};
+
+std::vector<uint8_t> Assemble(const std::vector<uint16_t>& program)
+{
+    std::vector<uint8_t> bytes;
+    for (uint16_t opcode : program)
+    {
+        bytes.push_back(opcode >> 8u);
+        bytes.push_back(opcode & 0xFFu);
+    }
+    return bytes;
+}
+
+std::vector<TestRom> TestRoms()
+{
+    std::vector<TestRom> roms;
+
+    // Drawing, random numbers, keys, timers, BCD and a subroutine.
+    roms.push_back({"game", Assemble({
+                                0xA050, // 200 LD I, font
+                                0x6A00, // 202 LD VA, 0
+                                0x6B00, // 204 LD VB, 0
+                                0xDAB5, // 206 DRW VA, VB, 5
+                                0x7A05, // 208 ADD VA, 5
+                                0x3A3C, // 20A SE VA, 60
+                                0x1206, // 20C JP 206
+                                0x6A00, // 20E LD VA, 0
+                                0x7B06, // 210 ADD VB, 6
+                                0x3B1E, // 212 SE VB, 30
+                                0x1206, // 214 JP 206
+                                0xC30F, // 216 RND V3, 0F
+                                0xF329, // 218 LD F, V3
+                                0xE3A1, // 21A SKNP V3
+                                0x00E0, // 21C CLS
+                                0x6410, // 21E LD V4, 10
+                                0xF415, // 220 LD DT, V4
+                                0xF507, // 222 LD V5, DT
+                                0xA800, // 224 LD I, 800
+                                0xF533, // 226 LD B, V5
+                                0x2230, // 228 CALL 230
+                                0x1200, // 22A JP 200
+                                0x0000, // 22C
+                                0x0000, // 22E
+                                0x8454, // 230 ADD V4, V5
+                                0x810E, // 232 SHL V1
+                                0x00EE, // 234 RET
+                            })});
+
+    // Stores over its own code: Fx55 turns the jump at 20C into JP 300,
+    // and Fx33 at 300 overwrites the jump at 306 with digits.
+    std::vector<uint16_t> selfModifying = {
+        0xA20C, // 200 LD I, 20C
+        0x6013, // 202 LD V0, 13
+        0x6100, // 204 LD V1, 00
+        0xF155, // 206 LD [I], V1
+        0x7201, // 208 ADD V2, 1
+        0x120C, // 20A JP 20C
+        0x1200, // 20C JP 200, becomes JP 300
+    };
+    selfModifying.resize((0x300 - 0x200) / 2);
+    selfModifying.insert(selfModifying.end(), {
+                                                  0xA306, // 300 LD I, 306
+                                                  0xF233, // 302 LD B, V2
+                                                  0x7301, // 304 ADD V3, 1
+                                                  0x1300, // 306 JP 300
+                                                  0x0000, // 308
+                                                  0x1200, // 30A JP 200
+                                              });
+    roms.push_back({"selfmod", Assemble(selfModifying)});
+    return roms;
+}
+
+std::string WriteRom(const TestRom& rom)
+{
+    std::filesystem::path path = std::filesystem::temp_directory_path() /
+                                 ("chip8_tests_" + rom.name + ".ch8");
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(rom.bytes.data()),
+               rom.bytes.size());
+    return path.string();
+}
+
+std::vector<uint8_t> State(const Chip8& chip8)
+{
+    std::vector<uint8_t> state;
+    chip8.SaveState(state, false);
+    return state;
+}
+
+// A machine with the ROM loaded under the profile, or nullptr.
+std::unique_ptr<Chip8> Machine(const TestRom& rom, QuirkProfile profile,
+                               uint32_t seed)
+{
+    std::unique_ptr<Chip8> chip8(new Chip8(seed));
+    chip8->SetQuirks(profile);
+    if (!chip8->LoadROM(rom.bytes.data(), rom.bytes.size()))
+    {
+        return nullptr;
+    }
+    return chip8;
+}
+
+// One 60 Hz frame, single-stepped, with a keypad that changes over time.
+void Frame(Chip8& chip8, uint32_t frame, uint32_t instructions = 50)
+{
+    for (unsigned int key = 0; key < 16; ++key)
+    {
+        chip8.keypad[key] = ((frame / 3 + key) % 5) == 0;
+    }
+    for (uint32_t i = 0; i < instructions; ++i)
+    {
+        chip8.Cycle();
+    }
+    chip8.TickTimers();
+}
+
+bool Check(bool ok, const std::string& what)
+{
+    if (!ok)
+    {
+        std::cerr << "FAILED: " << what << "\n";
+    }
+    return ok;
+}
+
+std::string Describe(const TestRom& rom, QuirkProfile profile)
+{
+    return rom.name + " under profile " +
+           std::to_string(static_cast<unsigned int>(profile));
+}
+
+// The recompiler against the interpreter, after every translated block.
+int TestJit()
+{
+    if (!Jit::Available())
+    {
+        std::cout << "JIT not available in this build\n";
+        return SKIPPED;
+    }
+    bool ok = true;
+    for (const TestRom& rom : TestRoms())
+    {
+        std::string path = WriteRom(rom);
+        for (QuirkProfile profile : PROFILES)
+        {
+            std::ostringstream out;
+            bool same =
+                Jit::Differential(path.c_str(), 7, 100000, out, profile);
+            ok = Check(same, "jit differential, " + Describe(rom, profile) +
+                                 ": " + out.str()) &&
+                 ok;
+        }
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// SaveState into a fresh machine, then both run on identically.
+int TestSaveState()
+{
+    bool ok = true;
+    for (const TestRom& rom : TestRoms())
+    {
+        for (QuirkProfile profile : PROFILES)
+        {
+            for (bool deltaMemory : {true, false})
+            {
+                std::string what = "savestate, " + Describe(rom, profile) +
+                                   (deltaMemory ? ", delta" : ", full");
+                std::unique_ptr<Chip8> original = Machine(rom, profile, 3);
+                std::unique_ptr<Chip8> restored = Machine(rom, profile, 99);
+                for (uint32_t frame = 0; frame < 40; ++frame)
+                {
+                    Frame(*original, frame);
+                }
+
+                std::vector<uint8_t> blob;
+                original->SaveState(blob, deltaMemory);
+                std::vector<uint8_t> untouched = State(*restored);
+                ok = Check(!restored->LoadState(blob.data(), blob.size() - 1),
+                           what + ": truncated state loaded") &&
+                     Check(State(*restored) == untouched,
+                           what + ": failed load changed the machine") &&
+                     Check(restored->LoadState(blob.data(), blob.size()),
+                           what + ": load failed") &&
+                     Check(State(*restored) == State(*original),
+                           what + ": restored state differs") &&
+                     ok;
+
+                for (uint32_t frame = 40; frame < 80; ++frame)
+                {
+                    Frame(*original, frame);
+                    Frame(*restored, frame);
+                }
+                ok = Check(State(*restored) == State(*original),
+                           what + ": diverged after restoring") &&
+                     ok;
+            }
+        }
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// StepBack and Seek return every pushed frame, across a change of profile
+// that changes the size of the save state.
+int TestRewind()
+{
+    bool ok = true;
+    for (const TestRom& rom : TestRoms())
+    {
+        std::string what = "rewind, " + rom.name;
+        std::unique_ptr<Chip8> chip8 = Machine(rom, QuirkProfile::Default, 5);
+        Rewind rewind(1 << 20, 8);
+        std::vector<std::vector<uint8_t>> states;
+        std::vector<QuirkProfile> profiles;
+        for (uint32_t frame = 0; frame < 60; ++frame)
+        {
+            if (frame == 30)
+            {
+                chip8->SetQuirks(QuirkProfile::XoChip);
+            }
+            Frame(*chip8, frame);
+            rewind.Push(*chip8);
+            states.push_back(State(*chip8));
+            profiles.push_back(chip8->Quirks());
+        }
+        ok = Check(rewind.Frames() == states.size(),
+                   what + ": frames were dropped") &&
+             ok;
+
+        ok = Check(rewind.Seek(*chip8, 10) && State(*chip8) == states[49],
+                   what + ": seek") &&
+             ok;
+        for (size_t frame = states.size() - 1; frame-- > 0;)
+        {
+            // A state only loads into a machine of its own profile
+            chip8->SetQuirks(profiles[frame]);
+            bool stepped = rewind.StepBack(*chip8);
+            ok = Check(stepped && State(*chip8) == states[frame],
+                       what + ": step back to frame " +
+                           std::to_string(frame)) &&
+                 ok;
+        }
+        ok = Check(!rewind.StepBack(*chip8), what + ": stepped past start") &&
+             ok;
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Every packet decodes to the frame it was encoded from.
+int TestDelta()
+{
+    bool ok = true;
+    for (const TestRom& rom : TestRoms())
+    {
+        std::string what = "delta, " + rom.name;
+        std::unique_ptr<Chip8> chip8 = Machine(rom, QuirkProfile::Default, 9);
+        DeltaEncoder encoder(7);
+        DeltaDecoder decoder;
+        std::vector<uint8_t> packet;
+        for (uint32_t frame = 0; frame < 120; ++frame)
+        {
+            Frame(*chip8, frame);
+            if (frame == 50)
+            {
+                encoder.ForceKeyframe();
+            }
+            packet.clear();
+            encoder.Encode(chip8->video, packet);
+
+            size_t used = 0;
+            if (packet.size() > 1)
+            {
+                ok = Check(!decoder.Decode(packet.data(), packet.size() - 1,
+                                           used),
+                           what + ": truncated packet decoded") &&
+                     ok;
+            }
+            bool decoded = decoder.Decode(packet.data(), packet.size(), used);
+            ok = Check(decoded && used == packet.size(),
+                       what + ": packet did not decode") &&
+                 Check(memcmp(decoder.Video(), chip8->video,
+                              DELTA_FRAME_BYTES) == 0,
+                       what + ": frame " + std::to_string(frame) +
+                           " differs") &&
+                 // A forced keyframe restarts the interval
+                 Check(decoder.LastWasKeyframe() ==
+                           (frame < 50 ? frame % 7 == 0
+                                       : (frame - 50) % 7 == 0),
+                       what + ": keyframe schedule") &&
+                 ok;
+        }
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Every lane of the lockstep engine matches a machine run on its own.
+int TestLockstep()
+{
+    const uint32_t INSTRUCTIONS = 50;
+    bool ok = true;
+    for (const TestRom& rom : TestRoms())
+    {
+        std::shared_ptr<const RomImage> image =
+            RomImage::FromMemory(rom.bytes.data(), rom.bytes.size());
+        for (QuirkProfile profile : PROFILES)
+        {
+            std::string what = "lockstep, " + Describe(rom, profile);
+            std::vector<uint32_t> seeds = {1, 2, 3, 4, 5, 6, 7, 8, 9};
+            Lockstep lockstep(seeds);
+            lockstep.SetQuirks(profile);
+            ok = Check(lockstep.LoadROM(image), what + ": load failed") && ok;
+
+            std::vector<std::unique_ptr<Chip8>> serial;
+            for (uint32_t seed : seeds)
+            {
+                serial.push_back(Machine(rom, profile, seed));
+            }
+            for (uint32_t frame = 0; frame < 60; ++frame)
+            {
+                for (size_t lane = 0; lane < seeds.size(); ++lane)
+                {
+                    // Lanes see different keys so they branch apart
+                    Frame(*serial[lane], frame + lane * 2, INSTRUCTIONS);
+                    uint16_t keys = 0;
+                    for (unsigned int key = 0; key < 16; ++key)
+                    {
+                        keys |= serial[lane]->keypad[key] << key;
+                    }
+                    lockstep.SetKeys(lane, keys);
+                }
+                lockstep.Run(INSTRUCTIONS);
+                lockstep.TickTimers();
+                for (size_t lane = 0; lane < seeds.size(); ++lane)
+                {
+                    ok = Check(State(lockstep.Machine(lane)) ==
+                                   State(*serial[lane]),
+                               what + ": lane " + std::to_string(lane) +
+                                   " differs at frame " +
+                                   std::to_string(frame)) &&
+                         ok;
+                }
+            }
+        }
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+struct Test
+{
+    const char* name;
+    std::function<int()> run;
+};
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    const Test tests[] = {{"jit", TestJit},
+                          {"savestate", TestSaveState},
+                          {"rewind", TestRewind},
+                          {"delta", TestDelta},
+                          {"lockstep", TestLockstep}};
+
+    int result = EXIT_SUCCESS;
+    bool found = false;
+    for (const Test& test : tests)
+    {
+        if (argc > 1 && std::strcmp(argv[1], test.name) != 0)
+        {
+            continue;
+        }
+        found = true;
+        int status = test.run();
+        std::cout << test.name << ": "
+                  << (status == EXIT_SUCCESS ? "passed"
+                      : status == SKIPPED    ? "skipped"
+                                             : "FAILED")
+                  << "\n";
+        if (status == EXIT_FAILURE || argc > 1)
+        {
+            result = status == EXIT_SUCCESS ? result : status;
+        }
+    }
+    if (!found)
+    {
+        std::cerr << "Usage: " << argv[0]
+                  << " [jit|savestate|rewind|delta|lockstep]\n";
+        return EXIT_FAILURE;
+    }
+    return result;
+}